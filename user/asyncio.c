@@ -0,0 +1,446 @@
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#include "trace.h"
+#include "diskio.h"
+#include "asyncio.h"
+#include "simdev.h"
+
+#define iotrace trace_off
+
+/*
+ * Asynchronous io for the buffer cache
+ *
+ * Three engines sit behind one interface: io_uring, driven through the raw
+ * system calls so we do not depend on liburing; a pool of worker threads
+ * doing ordinary preadv/pwritev, for kernels or sandboxes without io_uring;
+ * and a synchronous engine that does the transfer at submit time, mostly
+ * useful for comparison and debugging.  The first engine that initializes
+ * wins unless one is named explicitly.
+ *
+ * Finished requests land on a done list.  Completion handlers only run from
+ * wait_iobatch(), in the thread that waits, never in a worker or under the
+ * engine lock, so a handler may freely take buffer cache locks or submit
+ * more io.  Only one waiter at a time sleeps in the kernel for io_uring
+ * completions, the others sleep on io_done until the reaper wakes them.
+ *
+ * Requests to a simulated device bypass the engine.  They transfer at
+ * submit time and wait on a list in order of the completion time the
+ * device model gave them, and the reaper sleeps until the first is due.
+ */
+
+#define IO_DEPTH 64
+#define IO_THREADS 4
+
+struct io_engine {
+	const char *name;
+	int (*init)(unsigned depth);
+	void (*exit)(void);
+	int (*queue)(struct iorequest *req); /* with io_lock held */
+	void (*reap)(void); /* with io_lock held, may drop it to sleep */
+};
+
+static pthread_mutex_t io_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t io_done = PTHREAD_COND_INITIALIZER;
+static struct io_engine *engine;
+static struct iorequest *done_head, **done_tail = &done_head;
+static unsigned io_inflight;
+static int reaping;
+static struct iorequest *sim_head; /* simulated requests by due time */
+
+static void io_finished(struct iorequest *req, int err)
+{
+	req->err = err;
+	req->next = NULL;
+	*done_tail = req;
+	done_tail = &req->next;
+}
+
+/* Account for a transfer of res bytes (or -errno), resubmit any remainder */
+static void io_complete(struct iorequest *req, int res)
+{
+	if (res == -EINTR || res == -EAGAIN)
+		res = 0;
+	else if (res < 0) {
+		io_finished(req, res);
+		return;
+	} else if (res == 0) {
+		io_finished(req, -EIO);
+		return;
+	}
+	req->offset += res;
+	if (!iovskip(&req->iov, &req->iovcnt, res)) {
+		io_finished(req, 0);
+		return;
+	}
+	iotrace("short transfer, %u vecs left at %Lx", req->iovcnt, (long long)req->offset);
+	int err = engine->queue(req);
+	if (err)
+		io_finished(req, err);
+}
+
+/* Wait for some completions to show up on the done list, io_lock held */
+static void wait_completions(void)
+{
+	if (sim_head && !reaping) {
+		reaping = 1;
+		unsigned long long due = sim_head->due;
+		pthread_mutex_unlock(&io_lock);
+		sim_sleep(due);
+		pthread_mutex_lock(&io_lock);
+		reaping = 0;
+		unsigned long long now = sim_clock();
+		while (sim_head && sim_head->due <= now) {
+			struct iorequest *req = sim_head;
+			sim_head = req->next;
+			io_finished(req, req->err);
+		}
+		pthread_cond_broadcast(&io_done);
+	} else if (engine && engine->reap && !reaping) {
+		reaping = 1;
+		engine->reap();
+		reaping = 0;
+		pthread_cond_broadcast(&io_done);
+	} else
+		pthread_cond_wait(&io_done, &io_lock);
+}
+
+/* io_uring engine */
+
+static struct {
+	int fd;
+	unsigned depth, queued, pending;
+	unsigned *sq_tail, *sq_mask, *sq_array;
+	unsigned *cq_head, *cq_tail, *cq_mask;
+	struct io_uring_sqe *sqes;
+	struct io_uring_cqe *cqes;
+	void *sq_ring, *cq_ring;
+	size_t sq_size, cq_size, sqes_size;
+} ring = { .fd = -1 };
+
+static int uring_enter(unsigned submit, unsigned wait)
+{
+	int ret = syscall(__NR_io_uring_enter, ring.fd, submit, wait,
+		wait ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+	return ret < 0 ? -errno : ret;
+}
+
+static void uring_exit(void)
+{
+	if (ring.sqes)
+		munmap(ring.sqes, ring.sqes_size);
+	if (ring.cq_ring)
+		munmap(ring.cq_ring, ring.cq_size);
+	if (ring.sq_ring)
+		munmap(ring.sq_ring, ring.sq_size);
+	if (ring.fd >= 0)
+		close(ring.fd);
+	memset(&ring, 0, sizeof(ring));
+	ring.fd = -1;
+}
+
+static void *uring_map(size_t size, off_t offset)
+{
+	void *mem = mmap(NULL, size, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, ring.fd, offset);
+	return mem == MAP_FAILED ? NULL : mem;
+}
+
+static int uring_init(unsigned depth)
+{
+	struct io_uring_params params = { };
+	int fd = syscall(__NR_io_uring_setup, depth, &params);
+	if (fd < 0)
+		return -errno;
+	ring.fd = fd;
+	ring.depth = params.sq_entries;
+	ring.sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+	ring.cq_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+	ring.sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+	if (!(ring.sq_ring = uring_map(ring.sq_size, IORING_OFF_SQ_RING)) ||
+	    !(ring.cq_ring = uring_map(ring.cq_size, IORING_OFF_CQ_RING)) ||
+	    !(ring.sqes = uring_map(ring.sqes_size, IORING_OFF_SQES))) {
+		int err = -errno;
+		uring_exit();
+		return err;
+	}
+	ring.sq_tail = ring.sq_ring + params.sq_off.tail;
+	ring.sq_mask = ring.sq_ring + params.sq_off.ring_mask;
+	ring.sq_array = ring.sq_ring + params.sq_off.array;
+	ring.cq_head = ring.cq_ring + params.cq_off.head;
+	ring.cq_tail = ring.cq_ring + params.cq_off.tail;
+	ring.cq_mask = ring.cq_ring + params.cq_off.ring_mask;
+	ring.cqes = ring.cq_ring + params.cq_off.cqes;
+	return 0;
+}
+
+static void uring_reap(void)
+{
+	unsigned submit = ring.pending, wait = ring.queued != 0;
+	ring.pending = 0;
+	pthread_mutex_unlock(&io_lock);
+	int ret;
+	while ((ret = uring_enter(submit, wait)) == -EINTR)
+		;
+	pthread_mutex_lock(&io_lock);
+	if (ret < 0) {
+		warn("io_uring_enter failed (%s)", strerror(-ret));
+		ret = 0;
+	}
+	if (ret < submit)
+		ring.pending += submit - ret;
+
+	unsigned head = *ring.cq_head, tail = __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE);
+	for (; head != tail; head++) {
+		struct io_uring_cqe *cqe = ring.cqes + (head & *ring.cq_mask);
+		ring.queued--;
+		io_complete((void *)(unsigned long)cqe->user_data, cqe->res);
+	}
+	__atomic_store_n(ring.cq_head, head, __ATOMIC_RELEASE);
+}
+
+static int uring_queue(struct iorequest *req)
+{
+	if (req->iovcnt > IOV_MAX)
+		return -EINVAL;
+	while (ring.queued >= ring.depth)
+		wait_completions();
+	unsigned tail = *ring.sq_tail, index = tail & *ring.sq_mask;
+	ring.sqes[index] = (struct io_uring_sqe){
+		.opcode = req->rw ? IORING_OP_WRITEV : IORING_OP_READV,
+		.fd = req->fd,
+		.off = req->offset,
+		.addr = (unsigned long)req->iov,
+		.len = req->iovcnt,
+		.user_data = (unsigned long)req,
+	};
+	ring.sq_array[index] = index;
+	__atomic_store_n(ring.sq_tail, tail + 1, __ATOMIC_RELEASE);
+	ring.queued++;
+	/* Get the device going on a deep queue without waiting for a reaper */
+	if (++ring.pending >= ring.depth / 2) {
+		int ret = uring_enter(ring.pending, 0);
+		if (ret > 0)
+			ring.pending -= ret;
+	}
+	return 0;
+}
+
+/* Worker thread engine */
+
+static struct {
+	pthread_t *threads;
+	unsigned count, exiting;
+	struct iorequest *head, **tail;
+	pthread_cond_t work;
+} workers;
+
+static void *io_worker(void *arg)
+{
+	pthread_mutex_lock(&io_lock);
+	while (1) {
+		while (!workers.head && !workers.exiting)
+			pthread_cond_wait(&workers.work, &io_lock);
+		struct iorequest *req = workers.head;
+		if (!req)
+			break;
+		if (!(workers.head = req->next))
+			workers.tail = &workers.head;
+		pthread_mutex_unlock(&io_lock);
+		int err = ioabsv(req->fd, req->iov, req->iovcnt, req->rw, req->offset);
+		pthread_mutex_lock(&io_lock);
+		io_finished(req, err);
+		pthread_cond_broadcast(&io_done);
+	}
+	pthread_mutex_unlock(&io_lock);
+	return NULL;
+}
+
+static void threads_exit(void)
+{
+	workers.exiting = 1;
+	pthread_cond_broadcast(&workers.work);
+	pthread_mutex_unlock(&io_lock);
+	for (unsigned i = 0; i < workers.count; i++)
+		pthread_join(workers.threads[i], NULL);
+	pthread_mutex_lock(&io_lock);
+	pthread_cond_destroy(&workers.work);
+	free(workers.threads);
+	memset(&workers, 0, sizeof(workers));
+}
+
+static int threads_init(unsigned depth)
+{
+	unsigned count = depth < IO_THREADS ? depth : IO_THREADS;
+	workers.threads = malloc(count * sizeof(*workers.threads));
+	if (!workers.threads)
+		return -ENOMEM;
+	workers.tail = &workers.head;
+	pthread_cond_init(&workers.work, NULL);
+	for (; workers.count < count; workers.count++) {
+		int err = pthread_create(workers.threads + workers.count, NULL, io_worker, NULL);
+		if (err) {
+			threads_exit();
+			return -err;
+		}
+	}
+	return 0;
+}
+
+static int threads_queue(struct iorequest *req)
+{
+	req->next = NULL;
+	*workers.tail = req;
+	workers.tail = &req->next;
+	pthread_cond_signal(&workers.work);
+	return 0;
+}
+
+/* Synchronous engine */
+
+static int sync_queue(struct iorequest *req)
+{
+	pthread_mutex_unlock(&io_lock);
+	int err = ioabsv(req->fd, req->iov, req->iovcnt, req->rw, req->offset);
+	pthread_mutex_lock(&io_lock);
+	io_finished(req, err);
+	return 0;
+}
+
+static struct io_engine io_engines[] = {
+	{ "uring", uring_init, uring_exit, uring_queue, uring_reap },
+	{ "threads", threads_init, threads_exit, threads_queue },
+	{ "sync", .queue = sync_queue },
+};
+
+static int __init_io_engine(const char *name, unsigned depth)
+{
+	int err = -EINVAL;
+	for (int i = 0; i < ARRAY_SIZE(io_engines); i++) {
+		struct io_engine *try = io_engines + i;
+		if (name && strcmp(name, try->name))
+			continue;
+		if (!(err = try->init ? try->init(depth ? : IO_DEPTH) : 0)) {
+			iotrace("%s io engine", try->name);
+			engine = try;
+			return 0;
+		}
+		iotrace("%s io engine unavailable (%s)", try->name, strerror(-err));
+	}
+	return err;
+}
+
+static void __exit_io_engine(void)
+{
+	assert(!io_inflight);
+	if (engine && engine->exit)
+		engine->exit();
+	engine = NULL;
+}
+
+/* Select an io engine by name, or the best available if name is NULL */
+int init_io_engine(const char *name, unsigned depth)
+{
+	int err = -EBUSY;
+	pthread_mutex_lock(&io_lock);
+	if (!io_inflight) {
+		__exit_io_engine();
+		err = __init_io_engine(name, depth);
+	}
+	pthread_mutex_unlock(&io_lock);
+	return err;
+}
+
+void exit_io_engine(void)
+{
+	pthread_mutex_lock(&io_lock);
+	__exit_io_engine();
+	pthread_mutex_unlock(&io_lock);
+}
+
+const char *io_engine_name(void)
+{
+	return engine ? engine->name : "none";
+}
+
+static int submit_sim(struct simdev *sim, struct iorequest *req, struct iobatch *batch)
+{
+	size_t bytes = 0;
+	for (unsigned i = 0; i < req->iovcnt; i++)
+		bytes += req->iov[i].iov_len;
+	req->batch = batch;
+	req->due = sim_schedule(sim, req->rw, req->offset, bytes);
+	req->err = ioabsv(req->fd, req->iov, req->iovcnt, req->rw, req->offset);
+	pthread_mutex_lock(&io_lock);
+	__atomic_add_fetch(&batch->inflight, 1, __ATOMIC_SEQ_CST);
+	io_inflight++;
+	struct iorequest **link = &sim_head;
+	while (*link && (*link)->due <= req->due)
+		link = &(*link)->next;
+	req->next = *link;
+	*link = req;
+	pthread_mutex_unlock(&io_lock);
+	return 0;
+}
+
+int submit_io(struct iorequest *req, struct iobatch *batch)
+{
+	int err = 0;
+	struct simdev *sim = sim_lookup(req->fd);
+	if (sim)
+		return submit_sim(sim, req, batch);
+	req->batch = batch;
+	pthread_mutex_lock(&io_lock);
+	if (!engine && (err = __init_io_engine(NULL, 0)))
+		goto out;
+	__atomic_add_fetch(&batch->inflight, 1, __ATOMIC_SEQ_CST);
+	io_inflight++;
+	if ((err = engine->queue(req))) {
+		__atomic_sub_fetch(&batch->inflight, 1, __ATOMIC_SEQ_CST);
+		io_inflight--;
+	}
+out:
+	pthread_mutex_unlock(&io_lock);
+	return err;
+}
+
+/* Run completion handlers until every request in the batch is done */
+int wait_iobatch(struct iobatch *batch)
+{
+	pthread_mutex_lock(&io_lock);
+	while (1) {
+		struct iorequest *req = done_head;
+		if (req) {
+			done_head = NULL;
+			done_tail = &done_head;
+			pthread_mutex_unlock(&io_lock);
+			unsigned count = 0;
+			for (; req; count++) {
+				struct iorequest *next = req->next;
+				struct iobatch *owner = req->batch;
+				int err = req->err, none = 0;
+				if (err)
+					__atomic_compare_exchange_n(&owner->err, &none, err, 0,
+						__ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+				if (req->end_io)
+					req->end_io(req, err);
+				__atomic_sub_fetch(&owner->inflight, 1, __ATOMIC_SEQ_CST);
+				req = next;
+			}
+			pthread_mutex_lock(&io_lock);
+			io_inflight -= count;
+			pthread_cond_broadcast(&io_done);
+			continue;
+		}
+		if (!__atomic_load_n(&batch->inflight, __ATOMIC_SEQ_CST))
+			break;
+		wait_completions();
+	}
+	pthread_mutex_unlock(&io_lock);
+	return batch->err;
+}
@@ -0,0 +1,50 @@
+#ifndef TUX3_ASYNCIO_H
+#define TUX3_ASYNCIO_H
+
+#include <sys/types.h>
+#include <sys/uio.h>
+
+/*
+ * Asynchronous io engine
+ *
+ * A request describes one positioned, possibly vectored transfer.  It is
+ * queued to the engine by submit_io() and completes later inside
+ * wait_iobatch(), which runs the end_io handler in the waiting thread.
+ * The iovec array belongs to the request until then and is consumed as
+ * partial transfers are resubmitted.
+ */
+
+struct iobatch;
+struct iorequest;
+
+typedef void (ioend_t)(struct iorequest *req, int err);
+
+struct iorequest {
+	int fd, rw;
+	struct iovec *iov;
+	unsigned iovcnt;
+	off_t offset;
+	ioend_t *end_io;
+	void *private;
+	/* private to the engine */
+	struct iobatch *batch;
+	struct iorequest *next;
+	unsigned long long due; /* simulated completion time */
+	int err;
+};
+
+/* Requests that one caller waits for together; first error wins */
+struct iobatch {
+	unsigned inflight;
+	int err;
+};
+
+#define IOBATCH_INIT { }
+
+int init_io_engine(const char *name, unsigned depth);
+void exit_io_engine(void);
+const char *io_engine_name(void);
+int submit_io(struct iorequest *req, struct iobatch *batch);
+int wait_iobatch(struct iobatch *batch);
+
+#endif /* !TUX3_ASYNCIO_H */
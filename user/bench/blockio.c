@@ -0,0 +1,185 @@
+/*
+ * Block io benchmarks on simulated devices
+ *
+ * Licensed under the GPL version 3
+ *
+ * By contributing changes to this file you grant the original copyright holder
+ * the right to distribute those changes under any license.
+ */
+
+#include <sys/wait.h>
+#include "tux3user.h"
+#include "diskio.h"
+
+#define BLOCKS 256
+#define VOLSIZE (64 << 20)
+
+/* scattered dirty blocks, written back in one flush */
+static void bench_writeback(struct dev *dev)
+{
+	map_t *map = new_map(dev, NULL);
+	block_t span = (VOLSIZE >> dev->bits) / BLOCKS;
+	for (unsigned i = 0; i < BLOCKS; i++) {
+		struct buffer_head *buffer = blockget(map, (i * 97) % BLOCKS * span + i % 4);
+		memset(bufdata(buffer), i, bufsize(buffer));
+		blockput(set_buffer_dirty(buffer));
+	}
+	assert(!flush_buffers(map));
+	free_map(map);
+}
+
+/* the same blocks read in order, where readahead can help, then shuffled */
+static void bench_read(struct dev *dev, int shuffle)
+{
+	map_t *map = new_map(dev, NULL);
+	for (unsigned i = 0; i < BLOCKS; i++) {
+		struct buffer_head *buffer = blockread(map, shuffle ? (i * 97) % BLOCKS : i);
+		assert(buffer);
+		blockput(buffer);
+	}
+	free_map(map);
+}
+
+static void bench_sequential(struct dev *dev)
+{
+	bench_read(dev, 0);
+}
+
+static void bench_random(struct dev *dev)
+{
+	bench_read(dev, 1);
+}
+
+static struct sb *make_fs(struct dev *dev)
+{
+	struct sb *sb = rapid_sb(dev,
+		.max_inodes_per_block = 64,
+		.entries_per_node = calc_entries_per_node(1 << dev->bits),
+		.volblocks = VOLSIZE >> dev->bits,
+		.freeblocks = VOLSIZE >> dev->bits);
+	sb->super = (struct disksuper){ .magic = TUX3_MAGIC, .volblocks = to_be_u64(sb->blockbits) };
+	assert(sb->volmap = tux_new_volmap(sb));
+	assert(sb->logmap = tux_new_logmap(sb));
+	assert(!make_tux3(sb));
+	return sb;
+}
+
+/* make a filesystem, write a few files and commit them */
+static void bench_commit(struct dev *dev)
+{
+	struct sb *sb = make_fs(dev);
+	char text[1 << 14];
+	memset(text, 'x', sizeof(text));
+	for (int i = 0; i < 16; i++) {
+		char name[16];
+		snprintf(name, sizeof(name), "file%i", i);
+		struct inode *inode = tuxcreate(sb->rootdir, name, strlen(name),
+			&(struct tux_iattr){ .mode = S_IFREG | S_IRWXU });
+		assert(!IS_ERR(inode));
+		struct file *file = &(struct file){ .f_inode = inode };
+		for (int j = 0; j < 4; j++)
+			assert(tuxwrite(file, text, sizeof(text)) == sizeof(text));
+		iput(inode);
+	}
+	assert(!sync_super(sb));
+}
+
+#define FILESIZE (8 << 20)
+#define CHUNK (64 << 10)
+
+static struct sb *file_sb;
+
+/* one big file through tuxwrite, committed, so its extents are long */
+static void write_file(struct dev *dev)
+{
+	struct sb *sb = file_sb = make_fs(dev);
+	struct inode *inode = tuxcreate(sb->rootdir, "big", 3,
+		&(struct tux_iattr){ .mode = S_IFREG | S_IRWXU });
+	assert(!IS_ERR(inode));
+	struct file *file = &(struct file){ .f_inode = inode };
+	char *text = malloc(CHUNK);
+	for (int i = 0; i < FILESIZE / CHUNK; i++) {
+		memset(text, i, CHUNK);
+		assert(tuxwrite(file, text, CHUNK) == CHUNK);
+	}
+	free(text);
+	iput(inode);
+	assert(!sync_super(sb));
+}
+
+/* and read it back, none of it cached */
+static void bench_file_read(struct dev *dev)
+{
+	struct inode *inode = tuxopen(file_sb->rootdir, "big", 3);
+	assert(!IS_ERR(inode));
+	struct file *file = &(struct file){ .f_inode = inode };
+	char *text = malloc(CHUNK);
+	for (int i = 0; i < FILESIZE / CHUNK; i++) {
+		assert(tuxread(file, text, CHUNK) == CHUNK);
+		assert(text[0] == (char)i && text[CHUNK - 1] == (char)i);
+	}
+	free(text);
+	iput(inode);
+}
+
+/* setup, if any, is neither timed nor counted */
+static struct {
+	const char *name;
+	void (*run)(struct dev *dev);
+	void (*setup)(struct dev *dev);
+} benches[] = {
+	{ "writeback", bench_writeback },
+	{ "sequential read", bench_sequential },
+	{ "random read", bench_random },
+	{ "commit", bench_commit },
+	{ "file write", write_file },
+	{ "file read", bench_file_read, write_file },
+};
+
+/* each run gets a fresh process, so no cache state carries over */
+static void run(const char *spec, int which)
+{
+	pid_t pid = fork();
+	assert(pid >= 0);
+	if (pid) {
+		int status;
+		waitpid(pid, &status, 0);
+		if (!WIFEXITED(status) || WEXITSTATUS(status))
+			error("%s on %s failed", benches[which].name, spec);
+		return;
+	}
+	int fd = sim_ramdisk(VOLSIZE);
+	if (fd < 0)
+		error("no ram image (%s)", strerror(-fd));
+	struct dev *dev = &(struct dev){ .fd = fd, .bits = 12 };
+	int err = sim_dev(dev, spec);
+	if (err)
+		error("bad device '%s' (%s)", spec, strerror(-err));
+	init_buffers(dev, 2 * FILESIZE, 0);
+	struct simstats before = { }, stats;
+	if (benches[which].setup) {
+		benches[which].setup(dev);
+		assert(!get_sim_stats(fd, &before));
+	}
+	unsigned long long start = sim_clock();
+	benches[which].run(dev);
+	unsigned long long took = sim_clock() - start;
+	assert(!get_sim_stats(fd, &stats));
+	printf("%-8s %-16s %8Lu us %6lu reads %6lu writes %6lu seeks %5u queue\n",
+		spec, benches[which].name, took / 1000,
+		stats.reads - before.reads, stats.writes - before.writes,
+		stats.seeks - before.seeks, stats.max_queue);
+	exit(0);
+}
+
+int main(int argc, char *argv[])
+{
+	char *presets[] = { "hdd", "ssd", "nvme" };
+	char **specs = argc > 1 ? argv + 1 : presets;
+	int count = argc > 1 ? argc - 1 : ARRAY_SIZE(presets);
+	setvbuf(stdout, NULL, _IOLBF, 0);
+	for (int i = 0; i < count; i++)
+		for (int j = 0; j < ARRAY_SIZE(benches); j++)
+			run(specs[i], j);
+	return 0;
+}
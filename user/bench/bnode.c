@@ -0,0 +1,93 @@
+/*
+ * Index node lookup, binary search against the linear scan it replaced,
+ * in the original and the compact node layout
+ *
+ * Licensed under the GPL version 3
+ *
+ * By contributing changes to this file you grant the original copyright holder
+ * the right to distribute those changes under any license.
+ */
+
+#include "tux3user.h"
+
+/* bench has to access internal structure */
+#include "kernel/btree.c"
+
+#define LOOKUPS (1 << 22)
+
+static unsigned bnode_scan(struct bnode *node, tuxkey_t key)
+{
+	unsigned next = 0, top = bcount(node);
+	while (++next < top)
+		if (from_be_u64(node->entries[next].key) > key)
+			break;
+	return next;
+}
+
+static unsigned long long now(void)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+/* keys spaced out so lookups land between them as well as on them */
+static double bench(struct bnode *node, tuxkey_t *keys,
+		    unsigned (*lookup)(struct bnode *node, tuxkey_t key))
+{
+	unsigned long sum = 0;
+	unsigned long long start = now();
+	for (unsigned i = 0; i < LOOKUPS; i++)
+		sum += lookup(node, keys[i]);
+	double nsecs = (double)(now() - start) / LOOKUPS;
+	/* keep the loop from going away */
+	if (sum == 1)
+		printf("%lu\n", sum);
+	return nsecs;
+}
+
+int main(int argc, char *argv[])
+{
+	unsigned blocksizes[] = { 256, 512, 1024, 4096, 16384, 65536 };
+	tuxkey_t *keys = malloc(LOOKUPS * sizeof(*keys));
+	assert(keys);
+	struct sb *sb = &(struct sb){ .super = { .flags = to_be_u64(SB_COMPACT_BNODE) } };
+	printf("%8s %8s %8s %10s %10s %10s %8s\n", "block", "fanout", "compact",
+	       "scan ns", "search ns", "compact ns", "speedup");
+	for (int i = 0; i < ARRAY_SIZE(blocksizes); i++) {
+		unsigned fanout = calc_entries_per_node(blocksizes[i]);
+		unsigned cfanout = calc_entries_per_cnode(blocksizes[i]);
+		struct bnode *node = malloc(blocksizes[i]), *cnode = malloc(blocksizes[i]);
+		assert(node && cnode);
+		memset(node, 0, blocksizes[i]);
+		node->count = to_be_u32(fanout);
+		for (unsigned j = 0; j < fanout; j++)
+			node->entries[j] = (struct index_entry){
+				.key = to_be_u64(10 * j), .block = to_be_u64(j) };
+		/* the same keys, more of them, above a base */
+		tuxkey_t base = 1ULL << 40;
+		bnode_init(sb, cnode, base, base + 10 * cfanout);
+		assert(bnode_compact(cnode));
+		for (unsigned j = 0; j < cfanout; j++)
+			bnode_set(cnode, j, base + 10 * j, j);
+		cnode->count = to_be_u32(cfanout);
+		srand(i);
+		for (unsigned j = 0; j < LOOKUPS; j++)
+			keys[j] = rand() % (10 * fanout + 10);
+		for (unsigned j = 0; j < 10 * fanout + 10; j++)
+			assert(bnode_lookup(node, j) == bnode_scan(node, j));
+		double scan = bench(node, keys, bnode_scan);
+		double search = bench(node, keys, bnode_lookup);
+		for (unsigned j = 0; j < LOOKUPS; j++)
+			keys[j] = base + rand() % (10 * cfanout + 10);
+		for (unsigned j = 0; j < 10 * cfanout + 10; j++)
+			assert(bnode_lookup(cnode, base + j) == min(j / 10 + 1, cfanout));
+		double compact = bench(cnode, keys, bnode_lookup);
+		printf("%8u %8u %8u %10.1f %10.1f %10.1f %7.1fx\n", blocksizes[i], fanout, cfanout,
+		       scan, search, compact, scan / search);
+		free(cnode);
+		free(node);
+	}
+	free(keys);
+	return 0;
+}
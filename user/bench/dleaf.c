@@ -0,0 +1,157 @@
+/*
+ * Data leaf probe, binary search against the linear walk it replaced,
+ * on full leaves
+ *
+ * Licensed under the GPL version 3
+ *
+ * By contributing changes to this file you grant the original copyright holder
+ * the right to distribute those changes under any license.
+ */
+
+#include "tux3user.h"
+
+#ifndef trace
+#define trace trace_off
+#endif
+
+/* bench has to access internal structure */
+#include "kernel/dleaf.c"
+
+#define PROBES (1 << 21)
+
+static int dwalk_scan(struct dleaf *leaf, unsigned blocksize, struct dwalk *walk, tuxkey_t key)
+{
+	unsigned keylo = key & 0xffffff, keyhi = key >> 24;
+
+	walk->leaf = leaf;
+	walk->gdict = (void *)leaf + blocksize;
+	walk->gstop = walk->gdict - dleaf_groups(leaf);
+	walk->group = walk->gdict;
+	walk->estop = (struct entry *)walk->gstop;
+	walk->exbase = leaf->table;
+	if (!dleaf_groups(leaf)) {
+		walk->entry = (struct entry *)walk->gstop;
+		walk->extent = leaf->table;
+		walk->exstop = leaf->table;
+		return 0;
+	}
+	while (walk->group > walk->gstop) {
+		walk->group--;
+		walk->entry = walk->estop - 1;
+		walk->estop -= group_count(walk->group);
+		if (group_keyhi(walk->group) > keyhi)
+			goto no_group;
+		if (group_keyhi(walk->group) == keyhi) {
+			if (entry_keylo(walk->entry) > keylo)
+				goto no_group;
+			if (walk->group == walk->gstop)
+				goto probe_entry;
+			if (group_keyhi(walk->group - 1) > keyhi)
+				goto probe_entry;
+			if (entry_keylo(walk->estop - 1) > keylo)
+				goto probe_entry;
+		}
+		walk->exbase += entry_limit(walk->estop);
+	}
+	walk->entry = walk->estop;
+	walk->exstop = walk->exbase;
+	walk->extent = walk->exbase;
+	walk->exbase = walk->exbase - entry_limit(walk->estop);
+	return 0;
+no_group:
+	walk->extent = walk->exbase;
+	walk->exstop = walk->exbase + entry_limit(walk->entry);
+	return 1;
+probe_entry:
+	walk->extent = walk->exbase;
+	walk->exstop = walk->exbase + entry_limit(walk->entry);
+	while (walk->entry > walk->estop) {
+		if (entry_keylo(walk->entry - 1) > keylo)
+			break;
+		walk->entry--;
+		walk->extent = walk->exstop;
+		walk->exstop = walk->exbase + entry_limit(walk->entry);
+	}
+	if (key < dwalk_index(walk) + dwalk_count(walk))
+		return 1;
+	dwalk_next(walk);
+	return !dwalk_end(walk);
+}
+
+static unsigned long long now(void)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+static double bench(struct dleaf *leaf, unsigned blocksize, tuxkey_t *keys,
+		    int (*probe)(struct dleaf *leaf, unsigned blocksize, struct dwalk *walk, tuxkey_t key))
+{
+	struct dwalk walk;
+	unsigned long sum = 0;
+	unsigned long long start = now();
+	for (unsigned i = 0; i < PROBES; i++) {
+		probe(leaf, blocksize, &walk, keys[i]);
+		sum += walk.extent - leaf->table;
+	}
+	double nsecs = (double)(now() - start) / PROBES;
+	/* keep the loop from going away */
+	if (sum == 1)
+		printf("%lu\n", sum);
+	return nsecs;
+}
+
+/* Fill a leaf with single block extents a gap apart, step keys apart */
+static unsigned fill(struct btree *btree, struct dleaf *leaf, tuxkey_t step)
+{
+	struct dwalk walk;
+	unsigned count = 0;
+	dleaf_init(btree, leaf);
+	dwalk_probe(leaf, btree->sb->blocksize, &walk, 0);
+	while (dleaf_free(btree, leaf) >= sizeof(struct group) + sizeof(struct entry) + sizeof(struct diskextent)) {
+		dwalk_add(&walk, count * step, make_extent(count + 1, 1));
+		count++;
+	}
+	return count;
+}
+
+int main(int argc, char *argv[])
+{
+	unsigned blocksizes[] = { 1024, 4096, 16384, 32768 };
+	tuxkey_t steps[] = { 2, 1 << 20 }; /* one keyhi, sixteen entries per keyhi */
+	tuxkey_t *keys = malloc(PROBES * sizeof(*keys));
+	assert(keys);
+	printf("%8s %8s %8s %8s %10s %10s %8s\n", "block", "step", "extents", "groups",
+	       "walk ns", "search ns", "speedup");
+	for (int i = 0; i < ARRAY_SIZE(blocksizes); i++) {
+		for (int j = 0; j < ARRAY_SIZE(steps); j++) {
+			struct sb *sb = &(struct sb){ .blocksize = blocksizes[i] };
+			struct btree *btree = &(struct btree){ .sb = sb, .ops = &dtree_ops };
+			struct dleaf *leaf = malloc(sb->blocksize);
+			assert(leaf);
+			unsigned count = fill(btree, leaf, steps[j]);
+			tuxkey_t top = count * steps[j];
+			/* same position for every key, on extents, between and past them */
+			tuxkey_t gap = steps[j] / 8 ? : 1;
+			for (tuxkey_t key = 0; key <= top; key += gap) {
+				struct dwalk walk, walk2;
+				int ret = dwalk_scan(leaf, sb->blocksize, &walk, key);
+				assert(dwalk_probe(leaf, sb->blocksize, &walk2, key) == ret);
+				assert(walk.group == walk2.group && walk.entry == walk2.entry);
+				assert(walk.estop == walk2.estop && walk.exbase == walk2.exbase);
+				assert(walk.extent == walk2.extent && walk.exstop == walk2.exstop);
+			}
+			srand(i);
+			for (unsigned k = 0; k < PROBES; k++)
+				keys[k] = (tuxkey_t)rand() * steps[j] / 2 % (top + 1);
+			double walk = bench(leaf, sb->blocksize, keys, dwalk_scan);
+			double search = bench(leaf, sb->blocksize, keys, dwalk_probe);
+			printf("%8u %8Lx %8u %8u %10.1f %10.1f %7.1fx\n", blocksizes[i], (L)steps[j],
+			       count, dleaf_groups(leaf), walk, search, walk / search);
+			free(leaf);
+		}
+	}
+	free(keys);
+	return 0;
+}
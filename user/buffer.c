@@ -1,12 +1,20 @@
 #include <stdlib.h>
 #include <stddef.h>
 #include <errno.h>
+#include <sched.h>
+#include <limits.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <time.h>
 #ifdef BUFFER_FOR_TUX3
 #include "utility.h"
-#else
-#include "diskio.h"
+#include "iotrace.h"
 #endif
+#include "diskio.h"
 #include "buffer.h"
+#include "simdev.h"
 #include "trace.h"
 #include "err.h"
 
@@ -31,13 +39,82 @@
  * add async IO.
  */
 
-#define SECTOR_BITS 9
-#define SECTOR_SIZE (1 << SECTOR_BITS)
+/*
+ * Debug builds (make DEBUG=1, the default) allocate each buffer on
+ * demand and check for leaks at exit.  Other builds carve all buffers
+ * from one preallocated arena.
+ */
+#ifdef DEBUG
 #define BUFFER_PARANOIA_DEBUG
+#endif
 typedef long long L; /* widen to suppress printf warnings on 64 bit systems */
 
-static struct list_head buffers[BUFFER_STATES], lru_buffers;
-static unsigned max_buffers = 10000, max_evict = 1000, buffer_count;
+static struct list_head buffers[BUFFER_STATES];
+static unsigned state_count[BUFFER_STATES]; /* under state_lock, freed not counted */
+
+/*
+ * Locking
+ *
+ * Each map hash is split into shards, each with its own lock, so lookups
+ * of different blocks rarely touch the same lock.  A cache hit takes only
+ * the shard lock: it bumps the atomic reference count and sets the
+ * referenced flag, and leaves reordering of the replacement queues to the
+ * eviction scan.  Each pool has a lock covering its queues, held list,
+ * ghosts and buffer count; it is taken for misses, evictions and queue
+ * changes.  state_lock covers the buffer state lists, map dirty lists and
+ * the free list.  Lock order is pool lock, then shard lock, then
+ * state_lock.
+ *
+ * A buffer reference count is only raised from zero under its shard lock,
+ * so the eviction path can check a victim is unused under the same lock
+ * and unhash it before anybody else can find it.  blockput() drops the
+ * count without locking.
+ */
+static pthread_mutex_t state_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Replacement queues, buffer->queue says which one a buffer is on */
+enum { QUEUE_NONE, QUEUE_HOT, QUEUE_COLD, QUEUES, QUEUE_HELD = 0x100 };
+
+struct ghost;
+
+/* Hit and miss counts, spread over cache lines by shard to avoid bouncing */
+struct pool_counts {
+	unsigned long hits, misses;
+} __attribute__((aligned(64)));
+
+/*
+ * Buffers are budgeted in separate pools so that streaming file data can
+ * not push out metadata.  Each pool has its own limit, replacement queues
+ * and statistics, only the free list and the state lists are shared.
+ */
+struct buffer_pool {
+	pthread_mutex_t lock;
+	char *name;
+	unsigned max_buffers, max_evict, buffer_count;
+	struct list_head queue[QUEUES], held;
+	unsigned queued[QUEUES];
+	struct ghost *ghosts;
+	struct hlist_head *ghost_hash;
+	unsigned ghost_bits, ghost_next;
+	struct pool_stats stats;
+	struct pool_counts counts[BUFFER_SHARDS];
+};
+
+static struct buffer_pool pools[BUFFER_POOLS] = {
+	[BUFFER_POOL_DATA] = {
+		.lock = PTHREAD_MUTEX_INITIALIZER,
+		.name = "data", .max_buffers = 10000, .max_evict = 1000
+	},
+	[BUFFER_POOL_META] = {
+		.lock = PTHREAD_MUTEX_INITIALIZER,
+		.name = "meta", .max_buffers = 10000, .max_evict = 1000
+	},
+};
+
+static inline struct buffer_pool *map_pool(map_t *map)
+{
+	return pools + map->pool;
+}
 
 void show_buffer(struct buffer_head *buffer)
 {
@@ -48,23 +125,128 @@ void show_buffer(struct buffer_head *buffer)
 		"?");
 }
 
+/*
+ * Each map shard has its own hash table, sized to the number of buffers
+ * it holds.  A shard starts small and doubles its table when the average
+ * chain length exceeds two.  Rather than rehash everything at once, the
+ * old table is kept and drained a few buckets at a time by each insert,
+ * so lookups have to check both tables until the move is complete.
+ */
+
+unsigned buffer_hash(block_t block, unsigned bits)
+{
+	return ((unsigned long long)block * 0x9e37fffffffc0001ULL) >> (64 - bits);
+}
+
+/* The shard is picked by the top bits of the hash, the bucket by the next ones */
+static inline struct buffer_shard *buffer_shard(map_t *map, block_t block)
+{
+	return map->shard + buffer_hash(block, BUFFER_SHARD_BITS);
+}
+
+static inline unsigned shard_hash(block_t block, unsigned bits)
+{
+	return buffer_hash(block, BUFFER_SHARD_BITS + bits) & ((1 << bits) - 1);
+}
+
+static unsigned shard_buckets(struct buffer_shard *shard)
+{
+	unsigned buckets = 1 << shard->hashbits;
+	return shard->rehash ? buckets + (buckets >> 1) : buckets;
+}
+
+static struct hlist_head *shard_bucket(struct buffer_shard *shard, unsigned i)
+{
+	unsigned buckets = 1 << shard->hashbits;
+	return i < buckets ? shard->hash + i : shard->rehash + i - buckets;
+}
+
+static struct hlist_head *new_hash(unsigned bits)
+{
+	struct hlist_head *hash = malloc(sizeof(*hash) << bits);
+	if (hash)
+		for (unsigned i = 0; i < 1 << bits; i++)
+			INIT_HLIST_HEAD(hash + i);
+	return hash;
+}
+
+/* Move a few buckets of the old table into the new one */
+static void rehash_buffers(struct buffer_shard *shard, unsigned buckets)
+{
+	unsigned limit = 1 << (shard->hashbits - 1);
+
+	for (; buckets && shard->rehashed < limit; buckets--, shard->rehashed++) {
+		struct hlist_head *bucket = shard->rehash + shard->rehashed;
+		while (!hlist_empty(bucket)) {
+			struct buffer_head *buffer = hlist_entry(bucket->first, struct buffer_head, hashlink);
+			hlist_del(&buffer->hashlink);
+			hlist_add_head(&buffer->hashlink, shard->hash + shard_hash(buffer->index, shard->hashbits));
+		}
+	}
+	if (shard->rehashed == limit) {
+		free(shard->rehash);
+		shard->rehash = NULL;
+	}
+}
+
+static void grow_hash(struct buffer_shard *shard)
+{
+	struct hlist_head *hash = new_hash(shard->hashbits + 1);
+	if (!hash)
+		return; /* live with longer chains */
+	buftrace("grow shard %p hash to %u buckets", shard, 2 << shard->hashbits);
+	shard->rehash = shard->hash;
+	shard->rehashed = 0;
+	shard->hash = hash;
+	shard->hashbits++;
+}
+
+static struct buffer_head *find_buffer(struct buffer_shard *shard, block_t block)
+{
+	struct buffer_head *buffer;
+	struct hlist_node *node;
+	struct hlist_head *bucket = shard->hash + shard_hash(block, shard->hashbits);
+	hlist_for_each_entry(buffer, node, bucket, hashlink)
+		if (buffer->index == block)
+			return buffer;
+	if (shard->rehash) {
+		bucket = shard->rehash + shard_hash(block, shard->hashbits - 1);
+		hlist_for_each_entry(buffer, node, bucket, hashlink)
+			if (buffer->index == block)
+				return buffer;
+	}
+	return NULL;
+}
+
+unsigned map_buffers(map_t *map)
+{
+	unsigned count = 0;
+	for (int i = 0; i < BUFFER_SHARDS; i++)
+		count += map->shard[i].buffers;
+	return count;
+}
+
 void show_buffers_(map_t *map, int all)
 {
 	struct buffer_head *buffer;
 	struct hlist_node *node;
-	unsigned i;
 
-	for (i = 0; i < BUFFER_BUCKETS; i++) {
-		struct hlist_head *bucket = &map->hash[i];
-		if (hlist_empty(bucket))
-			continue;
+	for (int j = 0; j < BUFFER_SHARDS; j++) {
+		struct buffer_shard *shard = map->shard + j;
+		pthread_mutex_lock(&shard->lock);
+		for (unsigned i = 0; i < shard_buckets(shard); i++) {
+			struct hlist_head *bucket = shard_bucket(shard, i);
+			if (hlist_empty(bucket))
+				continue;
 
-		printf("[%i] ", i);
-		hlist_for_each_entry(buffer, node, bucket, hashlink) {
-			if (all || buffer->count)
-				show_buffer(buffer);
+			printf("[%i:%i] ", j, i);
+			hlist_for_each_entry(buffer, node, bucket, hashlink) {
+				if (all || buffer->count)
+					show_buffer(buffer);
+			}
+			printf("\n");
 		}
-		printf("\n");
+		pthread_mutex_unlock(&shard->lock);
 	}
 }
 
@@ -103,10 +285,26 @@ void show_buffers_state(unsigned state)
 	show_buffer_list(buffers + state);
 }
 
+static void release_buffer(struct buffer_head *buffer);
+
+static inline int buffer_held(struct buffer_head *buffer)
+{
+	return __atomic_load_n(&buffer->queue, __ATOMIC_SEQ_CST) & QUEUE_HELD;
+}
+
 void set_buffer_state_list(struct buffer_head *buffer, unsigned state, struct list_head *list)
 {
+	pthread_mutex_lock(&state_lock);
 	list_move_tail(&buffer->link, list);
+	if (buffer->state != BUFFER_FREED)
+		state_count[buffer->state]--;
+	if (state != BUFFER_FREED)
+		state_count[state]++;
 	buffer->state = state;
+	pthread_mutex_unlock(&state_lock);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (buffer_held(buffer))
+		release_buffer(buffer);
 }
 
 static inline void set_buffer_state(struct buffer_head *buffer, unsigned state)
@@ -138,189 +336,975 @@ void blockput(struct buffer_head *buffer)
 {
 	assert(buffer != NULL);
 	buftrace("Release buffer %Lx, count = %i, state = %i", (L)buffer->index, buffer->count, buffer->state);
-	assert(buffer->count);
-	if (!--buffer->count)
+	assert(bufcount(buffer));
+	if (!__atomic_sub_fetch(&buffer->count, 1, __ATOMIC_SEQ_CST)) {
 		buftrace("Free buffer %Lx", (L)buffer->index);
+		if (buffer_held(buffer))
+			release_buffer(buffer);
+	}
 }
 
-unsigned buffer_hash(block_t block)
+/* Buffer lock, serializes reading a buffer in */
+static void unlock_buffer(struct buffer_head *buffer)
 {
-	return (((block >> 32) ^ (block_t)block) * 978317583) % BUFFER_BUCKETS;
+	__atomic_clear(&buffer->locked, __ATOMIC_RELEASE);
 }
 
-void insert_buffer_hash(struct buffer_head *buffer)
+/*
+ * Replacement policy
+ *
+ * Hashed buffers sit on one of the replacement queues, oldest first.  The
+ * policy decides which queue a new buffer goes on and which queue to take
+ * the next victim from.  Cache hits do not touch the queues, they only
+ * set the referenced flag, and a referenced victim on the hot queue gets
+ * a second chance at the young end instead of being evicted, so the hot
+ * queue is an approximate LRU that needs no lock on the hit path.
+ *
+ * A victim that is pinned or dirty is parked on the held list instead of
+ * being skipped on every pass, and goes back to the young end of its
+ * queue when its last user lets go of it or it is written out.  So the
+ * cost of an eviction does not depend on how many buffers are in use.
+ *
+ * "lru" is the traditional single LRU list.  "2q" is the full 2Q of
+ * Johnson and Shasha: a buffer seen for the first time goes on a FIFO
+ * cold queue and stays there however often it is hit.  When it is
+ * evicted from the cold queue we remember its identity on a ghost list,
+ * and if it is asked for again while still remembered it goes to the LRU
+ * hot queue.  The cold queue is trimmed first as long as it holds more
+ * than a quarter of the pool, so a big sequential read only ever churns
+ * the cold queue, and btree nodes that are used over and over survive it.
+ *
+ * Policy methods are called with the pool lock held.
+ */
+
+struct buffer_policy {
+	char *name;
+	void (*insert)(struct buffer_pool *pool, struct buffer_head *buffer);
+	void (*evict)(struct buffer_pool *pool, struct buffer_head *buffer);
+	unsigned (*victims)(struct buffer_pool *pool);
+};
+
+static void queue_buffer(struct buffer_pool *pool, struct buffer_head *buffer, unsigned queue)
 {
-	struct hlist_head *bucket = buffer->map->hash + buffer_hash(buffer->index);
-	hlist_add_head(&buffer->hashlink, bucket);
-	list_add_tail(&buffer->lru, &lru_buffers);
+	list_add_tail(&buffer->lru, pool->queue + queue);
+	buffer->queue = queue;
+	buffer->referenced = 0;
+	pool->queued[queue]++;
 }
 
-void remove_buffer_hash(struct buffer_head *buffer)
+static void dequeue_buffer(struct buffer_pool *pool, struct buffer_head *buffer)
 {
+	if (buffer->queue == QUEUE_NONE)
+		return;
+	pool->queued[buffer->queue & ~QUEUE_HELD]--;
+	__atomic_store_n(&buffer->queue, QUEUE_NONE, __ATOMIC_SEQ_CST);
 	list_del_init(&buffer->lru);
-	hlist_del_init(&buffer->hashlink);
 }
 
-void evict_buffer(struct buffer_head *buffer)
+static int buffer_reclaimable(struct buffer_head *buffer)
+{
+	return !bufcount(buffer) && (buffer_clean(buffer) || buffer_empty(buffer));
+}
+
+static void hold_buffer(struct buffer_pool *pool, struct buffer_head *buffer)
+{
+	__atomic_or_fetch(&buffer->queue, QUEUE_HELD, __ATOMIC_SEQ_CST);
+	if (buffer_reclaimable(buffer)) {
+		/* let go meanwhile, a release may have missed the flag */
+		__atomic_and_fetch(&buffer->queue, ~QUEUE_HELD, __ATOMIC_SEQ_CST);
+		list_move_tail(&buffer->lru, pool->queue + buffer->queue);
+		return;
+	}
+	list_move_tail(&buffer->lru, &pool->held);
+}
+
+static void release_buffer(struct buffer_head *buffer)
+{
+	struct buffer_pool *pool = map_pool(buffer->map);
+	pthread_mutex_lock(&pool->lock);
+	if ((buffer->queue & QUEUE_HELD) && buffer_reclaimable(buffer)) {
+		__atomic_and_fetch(&buffer->queue, ~QUEUE_HELD, __ATOMIC_SEQ_CST);
+		list_move_tail(&buffer->lru, pool->queue + buffer->queue);
+	}
+	pthread_mutex_unlock(&pool->lock);
+}
+
+static void lru_insert(struct buffer_pool *pool, struct buffer_head *buffer)
+{
+	queue_buffer(pool, buffer, QUEUE_HOT);
+}
+
+static void lru_evict(struct buffer_pool *pool, struct buffer_head *buffer)
+{
+}
+
+static unsigned lru_victims(struct buffer_pool *pool)
+{
+	return QUEUE_HOT;
+}
+
+/* 2Q ghost list: identities of buffers recently evicted from the cold queue */
+
+struct ghost { map_t *map; block_t index; struct hlist_node hashlink; };
+
+static struct hlist_head *ghost_bucket(struct buffer_pool *pool, map_t *map, block_t index)
+{
+	return pool->ghost_hash + buffer_hash(index ^ (unsigned long)map, pool->ghost_bits);
+}
+
+static int init_ghosts(struct buffer_pool *pool, unsigned bits)
+{
+	pool->ghosts = malloc(sizeof(*pool->ghosts) << bits);
+	if (!pool->ghosts || !(pool->ghost_hash = new_hash(bits))) {
+		free(pool->ghosts);
+		pool->ghosts = NULL;
+		return -ENOMEM;
+	}
+	for (unsigned i = 0; i < 1 << bits; i++)
+		INIT_HLIST_NODE(&pool->ghosts[i].hashlink);
+	pool->ghost_bits = bits;
+	pool->ghost_next = 0;
+	return 0;
+}
+
+#ifdef BUFFER_PARANOIA_DEBUG
+static void destroy_ghosts(struct buffer_pool *pool)
+{
+	free(pool->ghosts);
+	free(pool->ghost_hash);
+	pool->ghosts = NULL;
+	pool->ghost_hash = NULL;
+}
+#endif
+
+static void remember_buffer(struct buffer_pool *pool, struct buffer_head *buffer)
+{
+	struct ghost *ghost = pool->ghosts + pool->ghost_next;
+	pool->ghost_next = (pool->ghost_next + 1) & ((1 << pool->ghost_bits) - 1);
+	if (!hlist_unhashed(&ghost->hashlink))
+		hlist_del(&ghost->hashlink);
+	ghost->map = buffer->map;
+	ghost->index = buffer->index;
+	hlist_add_head(&ghost->hashlink, ghost_bucket(pool, buffer->map, buffer->index));
+}
+
+static int forget_buffer(struct buffer_pool *pool, struct buffer_head *buffer)
+{
+	struct ghost *ghost;
+	struct hlist_node *node;
+	hlist_for_each_entry(ghost, node, ghost_bucket(pool, buffer->map, buffer->index), hashlink)
+		if (ghost->index == buffer->index && ghost->map == buffer->map) {
+			hlist_del_init(&ghost->hashlink);
+			return 1;
+		}
+	return 0;
+}
+
+static void twoq_insert(struct buffer_pool *pool, struct buffer_head *buffer)
+{
+	int hot = pool->ghosts && forget_buffer(pool, buffer);
+	queue_buffer(pool, buffer, hot ? QUEUE_HOT : QUEUE_COLD);
+}
+
+static void twoq_evict(struct buffer_pool *pool, struct buffer_head *buffer)
+{
+	if (buffer->queue == QUEUE_COLD && pool->ghosts)
+		remember_buffer(pool, buffer);
+}
+
+static unsigned twoq_victims(struct buffer_pool *pool)
+{
+	if (pool->queued[QUEUE_COLD] > pool->max_buffers / 4 || list_empty(pool->queue + QUEUE_HOT))
+		return QUEUE_COLD;
+	return QUEUE_HOT;
+}
+
+static struct buffer_policy buffer_policies[] = {
+	{ "2q", twoq_insert, twoq_evict, twoq_victims },
+	{ "lru", lru_insert, lru_evict, lru_victims },
+};
+
+static struct buffer_policy *policy = buffer_policies;
+
+int set_buffer_policy(const char *name)
+{
+	for (int i = 0; i < sizeof(buffer_policies) / sizeof(*buffer_policies); i++) {
+		if (strcmp(name, buffer_policies[i].name))
+			continue;
+		/* Whatever is cached now starts out hot */
+		for (struct buffer_pool *pool = pools; pool < pools + BUFFER_POOLS; pool++) {
+			struct buffer_head *buffer;
+			pthread_mutex_lock(&pool->lock);
+			list_for_each_entry(buffer, pool->queue + QUEUE_COLD, lru)
+				buffer->queue = QUEUE_HOT;
+			list_for_each_entry(buffer, &pool->held, lru)
+				buffer->queue = QUEUE_HOT | QUEUE_HELD;
+			list_splice_init(pool->queue + QUEUE_COLD, pool->queue + QUEUE_HOT);
+			pool->queued[QUEUE_HOT] += pool->queued[QUEUE_COLD];
+			pool->queued[QUEUE_COLD] = 0;
+			pthread_mutex_unlock(&pool->lock);
+		}
+		policy = buffer_policies + i;
+		return 0;
+	}
+	return -EINVAL;
+}
+
+/* Called with pool and shard lock held */
+static void __insert_buffer_hash(struct buffer_pool *pool, struct buffer_shard *shard, struct buffer_head *buffer)
+{
+	if (shard->rehash)
+		rehash_buffers(shard, 2);
+	else if (shard->buffers >= 2 << shard->hashbits)
+		grow_hash(shard);
+	struct hlist_head *bucket = shard->hash + shard_hash(buffer->index, shard->hashbits);
+	hlist_add_head(&buffer->hashlink, bucket);
+	policy->insert(pool, buffer);
+	shard->buffers++;
+}
+
+static void __remove_buffer_hash(struct buffer_pool *pool, struct buffer_shard *shard, struct buffer_head *buffer)
+{
+	dequeue_buffer(pool, buffer);
+	if (!hlist_unhashed(&buffer->hashlink)) {
+		hlist_del_init(&buffer->hashlink);
+		shard->buffers--;
+	}
+}
+
+static void __evict_buffer(struct buffer_pool *pool, struct buffer_shard *shard, struct buffer_head *buffer)
 {
 	buftrace("evict buffer [%Lx]", (L)buffer->index);
 	assert(buffer_clean(buffer) || buffer_empty(buffer));
-	assert(!buffer->count);
-	remove_buffer_hash(buffer);
+	assert(!bufcount(buffer));
+	if (buffer->readahead == READAHEAD_READY) {
+		__atomic_add_fetch(&buffer->map->ra.wasted, 1, __ATOMIC_RELAXED);
+		buffer->readahead = READAHEAD_NONE;
+	}
+	__remove_buffer_hash(pool, shard, buffer);
+	pool->buffer_count--;
+	if (buffer->alloc) {
+		buffer->data = buffer->alloc;
+		buffer->alloc = NULL;
+	}
 	buffer->map = NULL;
 	set_buffer_state(buffer, BUFFER_FREED); /* insert at head, not tail? */
-	buffer_count--;
+}
+
+void insert_buffer_hash(struct buffer_head *buffer)
+{
+	struct buffer_pool *pool = map_pool(buffer->map);
+	struct buffer_shard *shard = buffer_shard(buffer->map, buffer->index);
+	pthread_mutex_lock(&pool->lock);
+	pthread_mutex_lock(&shard->lock);
+	__insert_buffer_hash(pool, shard, buffer);
+	pthread_mutex_unlock(&shard->lock);
+	pthread_mutex_unlock(&pool->lock);
+}
+
+void remove_buffer_hash(struct buffer_head *buffer)
+{
+	struct buffer_pool *pool = map_pool(buffer->map);
+	struct buffer_shard *shard = buffer_shard(buffer->map, buffer->index);
+	pthread_mutex_lock(&pool->lock);
+	pthread_mutex_lock(&shard->lock);
+	__remove_buffer_hash(pool, shard, buffer);
+	pthread_mutex_unlock(&shard->lock);
+	pthread_mutex_unlock(&pool->lock);
+}
+
+void evict_buffer(struct buffer_head *buffer)
+{
+	struct buffer_pool *pool = map_pool(buffer->map);
+	struct buffer_shard *shard = buffer_shard(buffer->map, buffer->index);
+	pthread_mutex_lock(&pool->lock);
+	pthread_mutex_lock(&shard->lock);
+	__evict_buffer(pool, shard, buffer);
+	pthread_mutex_unlock(&shard->lock);
+	pthread_mutex_unlock(&pool->lock);
+}
+
+/* Called with pool lock held */
+static void evict_buffers(struct buffer_pool *pool, unsigned count)
+{
+	while (count) {
+		struct list_head *queue = pool->queue + policy->victims(pool);
+		if (list_empty(queue) && list_empty(queue = pool->queue + QUEUE_HOT) &&
+		    list_empty(queue = pool->queue + QUEUE_COLD))
+			break;
+		struct buffer_head *victim = list_entry(queue->next, struct buffer_head, lru);
+		if (victim->queue == QUEUE_HOT && victim->referenced) {
+			victim->referenced = 0;
+			list_move_tail(&victim->lru, queue);
+			continue;
+		}
+		struct buffer_shard *shard = buffer_shard(victim->map, victim->index);
+		pthread_mutex_lock(&shard->lock);
+		if (!buffer_reclaimable(victim)) {
+			pthread_mutex_unlock(&shard->lock);
+			hold_buffer(pool, victim);
+			continue;
+		}
+		policy->evict(pool, victim);
+		__evict_buffer(pool, shard, victim);
+		shard->evictions++;
+		pthread_mutex_unlock(&shard->lock);
+		pool->stats.evictions++;
+		count--;
+	}
 }
 
 struct buffer_head *new_buffer(map_t *map)
 {
+	struct buffer_pool *pool = map_pool(map);
 	struct buffer_head *buffer = NULL;
 	int min_buffers = 100, err;
 
-	if (max_buffers < min_buffers)
-		max_buffers = min_buffers;
+	pthread_mutex_lock(&pool->lock);
+	if (pool->max_buffers < min_buffers)
+		pool->max_buffers = min_buffers;
 
-	if (!list_empty(buffers + BUFFER_FREED)) {
-		buffer = list_entry(buffers[BUFFER_FREED].next, struct buffer_head, link);
-		goto have_buffer;
-	}
-
-	if (buffer_count >= max_buffers) {
-		buftrace("try to evict buffers");
-		struct buffer_head *safe, *victim;
-		int count = 0;
-	
-		list_for_each_entry_safe(victim, safe, &lru_buffers, lru) {
-			if (victim->count == 0 && buffer_clean(victim)) {
-				evict_buffer(victim);
-				if (++count == max_evict)
-					break;
-			}
+	if (pool->buffer_count >= pool->max_buffers) {
+		buftrace("try to evict %s buffers", pool->name);
+		evict_buffers(pool, pool->max_evict);
+		if (pool->buffer_count >= pool->max_buffers) {
+			warn("Maximum %s buffer count exceeded (%i)", pool->name, pool->buffer_count);
+			pool->stats.exceeded++;
+			pthread_mutex_unlock(&pool->lock);
+			return ERR_PTR(-ERANGE);
 		}
+	}
+	pool->buffer_count++;
+	pthread_mutex_unlock(&pool->lock);
 
-		if (!list_empty(buffers + BUFFER_FREED)) {
-			buffer = list_entry(buffers[BUFFER_FREED].next, struct buffer_head, link);
-			goto have_buffer;
-		}
+	pthread_mutex_lock(&state_lock);
+	if (!list_empty(buffers + BUFFER_FREED)) {
+		buffer = list_entry(buffers[BUFFER_FREED].next, struct buffer_head, link);
+		list_del_init(&buffer->link);
 	}
+	pthread_mutex_unlock(&state_lock);
+	if (buffer)
+		goto have_buffer;
 
 	buftrace("expand buffer pool");
-	if (buffer_count == max_buffers) {
-		warn("Maximum buffer count exceeded (%i)", buffer_count);
-		return ERR_PTR(-ERANGE);
-	}
+	__atomic_add_fetch(&pool->stats.expansions, 1, __ATOMIC_RELAXED);
+	err = -ENOMEM;
 	buffer = (struct buffer_head *)malloc(sizeof(struct buffer_head));
 	if (!buffer)
-		return ERR_PTR(-ENOMEM);
+		goto error;
 	*buffer = (struct buffer_head){
 		.link = LIST_HEAD_INIT(buffer->link),
 		.lru = LIST_HEAD_INIT(buffer->lru),
 	};
 	INIT_HLIST_NODE(&buffer->hashlink);
-	if ((err = -posix_memalign((void **)&(buffer->data), SECTOR_SIZE, 1 << map->dev->bits))) {
-		warn("Error: %s unable to expand buffer pool", strerror(err));
+	if ((err = -posix_memalign((void **)&(buffer->data), dev_align(map->dev), 1 << map->dev->bits))) {
+		warn("Error: %s unable to expand buffer pool", strerror(-err));
 		free(buffer);
-		return ERR_PTR(err);
+		goto error;
 	}
 have_buffer:
 	assert(!buffer->count);
 	assert(buffer->state == BUFFER_FREED);
 	set_buffer_empty(buffer);
 	buffer->map = map;
-	buffer->count++;
-	buffer_count++;
+	buffer->readahead = READAHEAD_NONE;
+	buffer->count = 1;
 	return buffer;
+
+error:
+	pthread_mutex_lock(&pool->lock);
+	pool->buffer_count--;
+	pthread_mutex_unlock(&pool->lock);
+	return ERR_PTR(err);
+}
+
+/* Give back a buffer from new_buffer() that was never hashed */
+static void put_new_buffer(struct buffer_head *buffer)
+{
+	struct buffer_pool *pool = map_pool(buffer->map);
+	buffer->count = 0;
+	buffer->map = NULL;
+	set_buffer_state(buffer, BUFFER_FREED);
+	pthread_mutex_lock(&pool->lock);
+	pool->buffer_count--;
+	pthread_mutex_unlock(&pool->lock);
+}
+
+/* Queues and held list of each pool, for walking every hashed buffer */
+#define POOL_LISTS (BUFFER_POOLS * QUEUES)
+
+static struct list_head *pool_list(unsigned i)
+{
+	struct buffer_pool *pool = pools + i / QUEUES;
+	return i % QUEUES == QUEUE_NONE ? &pool->held : pool->queue + i % QUEUES;
 }
 
 int count_buffers(void)
 {
-	struct buffer_head *safe, *buffer;
+	struct buffer_head *buffer;
 	int count = 0;
-	list_for_each_entry_safe(buffer, safe, &lru_buffers, lru) {
-		if (!buffer->count)
-			continue;
-		trace_off("buffer %Lx has non-zero count %d", (long long)buffer->index, buffer->count);
-		count++;
+	for (int i = 0; i < POOL_LISTS; i++) {
+		list_for_each_entry(buffer, pool_list(i), lru) {
+			if (!buffer->count)
+				continue;
+			trace_off("buffer %Lx has non-zero count %d", (long long)buffer->index, buffer->count);
+			count++;
+		}
 	}
 	return count;
 }
 
 struct buffer_head *peekblk(map_t *map, block_t block)
 {
-	struct hlist_head *bucket = map->hash + buffer_hash(block);
-	struct buffer_head *buffer;
-	struct hlist_node *node;
-	hlist_for_each_entry(buffer, node, bucket, hashlink)
-		if (buffer->index == block) {
-			buffer->count++;
-			return buffer;
-		}
-	return NULL;
+	struct buffer_shard *shard = buffer_shard(map, block);
+	pthread_mutex_lock(&shard->lock);
+	struct buffer_head *buffer = find_buffer(shard, block);
+	if (buffer)
+		get_bh(buffer);
+	pthread_mutex_unlock(&shard->lock);
+	return buffer;
 }
 
 struct buffer_head *blockget(map_t *map, block_t block)
 {
-	struct hlist_head *bucket = map->hash + buffer_hash(block);
-	struct buffer_head *buffer;
-	struct hlist_node *node;
-	hlist_for_each_entry(buffer, node, bucket, hashlink)
-		if (buffer->index == block) {
-			list_move_tail(&buffer->lru, &lru_buffers);
-			buffer->count++;
-			return buffer;
-		}
+	struct buffer_pool *pool = map_pool(map);
+	struct buffer_shard *shard = buffer_shard(map, block);
+	struct pool_counts *counts = pool->counts + (shard - map->shard);
+	struct buffer_head *buffer, *found;
+
+	pthread_mutex_lock(&shard->lock);
+	buffer = find_buffer(shard, block);
+	if (buffer) {
+		get_bh(buffer);
+		buffer->referenced = 1;
+		shard->hits++;
+		pthread_mutex_unlock(&shard->lock);
+		__atomic_add_fetch(&counts->hits, 1, __ATOMIC_RELAXED);
+		return buffer;
+	}
+	shard->misses++;
+	pthread_mutex_unlock(&shard->lock);
+	__atomic_add_fetch(&counts->misses, 1, __ATOMIC_RELAXED);
+
 	buftrace("make buffer [%Lx]", (L)block);
 	if (IS_ERR(buffer = new_buffer(map)))
 		return NULL; // ERR_PTR me!!!
 	buffer->index = block;
-	insert_buffer_hash(buffer);
+	pthread_mutex_lock(&pool->lock);
+	pthread_mutex_lock(&shard->lock);
+	if ((found = find_buffer(shard, block))) {
+		/* somebody else made it meanwhile */
+		get_bh(found);
+		pthread_mutex_unlock(&shard->lock);
+		pthread_mutex_unlock(&pool->lock);
+		put_new_buffer(buffer);
+		return found;
+	}
+	__insert_buffer_hash(pool, shard, buffer);
+	pthread_mutex_unlock(&shard->lock);
+	pthread_mutex_unlock(&pool->lock);
 	return buffer;
 }
 
-struct buffer_head *blockread(map_t *map, block_t block)
+/* !!! only used for testing */
+void invalidate_buffers(map_t *map)
 {
-	struct buffer_head *buffer = blockget(map, block);
-	if (buffer && buffer_empty(buffer)) {
-		buftrace("read buffer %Lx, state %i", (L)buffer->index, buffer->state);
-		int err = buffer->map->io(buffer, 0);
-		if (err) {
-			blockput(buffer);
-			return NULL; // ERR_PTR me!!!
+	struct buffer_pool *pool = map_pool(map);
+	wait_readahead(map);
+	pthread_mutex_lock(&pool->lock);
+	for (int j = 0; j < BUFFER_SHARDS; j++) {
+		struct buffer_shard *shard = map->shard + j;
+		pthread_mutex_lock(&shard->lock);
+		for (unsigned i = 0; i < shard_buckets(shard); i++) {
+			struct hlist_head *bucket = shard_bucket(shard, i);
+			struct buffer_head *buffer;
+			struct hlist_node *node, *n;
+			hlist_for_each_entry_safe(buffer, node, n, bucket, hashlink) {
+				if (!bufcount(buffer)) {
+					if (!buffer_clean(buffer))
+						set_buffer_clean(buffer);
+					__evict_buffer(pool, shard, buffer);
+				}
+			}
 		}
+		pthread_mutex_unlock(&shard->lock);
 	}
-	return buffer;
+	pthread_mutex_unlock(&pool->lock);
 }
 
-/* !!! only used for testing */
-void invalidate_buffers(map_t *map)
+int dev_blockio(struct buffer_head *buffer, int write);
+
+/*
+ * On a mapped device reading a block costs nothing: the buffer borrows
+ * the page of the mapping and sets its own memory aside until eviction.
+ * Device maps borrow on any volume.  Other maps only borrow from a
+ * read-only volume, where nothing can ever write through the alias to
+ * another view of the same block.
+ */
+static int borrow_block(struct buffer_head *buffer, block_t block)
 {
-	unsigned i;
-	for (i = 0; i < BUFFER_BUCKETS; i++) {
-		struct hlist_head *bucket = &map->hash[i];
-		struct buffer_head *buffer;
-		struct hlist_node *node, *n;
-		hlist_for_each_entry_safe(buffer, node, n, bucket, hashlink) {
-			if (!buffer->count) {
-				if (!buffer_clean(buffer))
-					set_buffer_clean(buffer);
-				evict_buffer(buffer);
+	struct dev *dev = buffer->map->dev;
+	loff_t offset = block << dev->bits;
+	if (!dev->mapping || offset + bufsize(buffer) > dev->mapsize)
+		return 0;
+	if (buffer->map->io != dev_blockio && !(dev->flags & DEV_RDONLY))
+		return 0;
+	if (!buffer->alloc)
+		buffer->alloc = buffer->data;
+	buffer->data = dev->mapping + offset;
+	return 1;
+}
+
+/*
+ * Batched buffer io
+ *
+ * A batch is an array of buffers, each with the device block it goes to
+ * or comes from.  It is sorted by device and block in place, and each run
+ * of adjacent blocks goes out as one vectored request of at most
+ * flush_limit bytes and IOV_MAX buffers.  Buffers are pinned until the
+ * batch is waited on.  With BUFIO_UPDATE, a transfer finishes the way
+ * dev_blockio would: clean on success, and a failed write goes back on
+ * the dirty list of its map.  A read that can borrow from the device
+ * mapping never reaches the engine.
+ */
+
+enum { BUFIO_UPDATE = 1, BUFIO_EVICT = 2 };
+
+static unsigned flush_limit = FLUSH_LIMIT;
+
+void set_flush_limit(unsigned bytes)
+{
+	flush_limit = bytes;
+}
+
+struct bufrun {
+	struct iorequest req;
+	unsigned count, flags;
+	loff_t offset;
+	unsigned long long start;
+	struct buffer_head **buffers;
+	struct iovec vec[];
+};
+
+static void bufrun_end(struct iorequest *req, int err)
+{
+	struct bufrun *run = container_of(req, struct bufrun, req);
+	struct dev *dev = run->buffers[0]->map->dev;
+	count_io(req->rw, run->start);
+#ifdef BUFFER_FOR_TUX3
+	iotrace_io(req->rw, dev, run->offset, 0, run->buffers, run->count, run->start);
+#endif
+	if (!err && req->rw)
+		dev_written(dev, run->offset, (loff_t)run->count << dev->bits);
+	for (unsigned i = 0; i < run->count; i++) {
+		struct buffer_head *buffer = run->buffers[i];
+		if (run->flags & BUFIO_UPDATE) {
+			if (!err)
+				set_buffer_clean(buffer);
+			else if (req->rw)
+				set_buffer_state_list(buffer, buffer->state, &buffer->map->dirty);
+		}
+		if (buffer->readahead == READAHEAD_PENDING) {
+			__atomic_store_n(&buffer->readahead, err ? READAHEAD_NONE : READAHEAD_READY, __ATOMIC_RELEASE);
+			unlock_buffer(buffer);
+		}
+		blockput(buffer);
+		if (!err && (run->flags & BUFIO_EVICT))
+			evict_buffer(buffer);
+	}
+	free(run);
+}
+
+static int submit_run(struct bufvec *vec, unsigned count, int write, unsigned flags, struct iobatch *batch)
+{
+	struct dev *dev = vec->buffer->map->dev;
+	struct bufrun *run = malloc(sizeof(*run) + count * (sizeof(struct iovec) + sizeof(struct buffer_head *)));
+	if (!run)
+		return -ENOMEM;
+	*run = (struct bufrun){
+		.req = {
+			.fd = dev->fd, .rw = write,
+			.iov = run->vec, .iovcnt = count,
+			.offset = vec->block << dev->bits,
+			.end_io = bufrun_end,
+		},
+		.count = count, .flags = flags,
+		.offset = vec->block << dev->bits,
+		.start = io_clock(),
+		.buffers = (void *)(run->vec + count),
+	};
+	for (unsigned i = 0; i < count; i++) {
+		struct buffer_head *buffer = vec[i].buffer;
+		run->vec[i] = (struct iovec){ .iov_base = bufdata(buffer), .iov_len = bufsize(buffer) };
+		run->buffers[i] = buffer;
+		get_bh(buffer);
+	}
+	buftrace("submit %s run %Lx/%u", write ? "write" : "read", (L)vec->block, count);
+	int err = submit_io(&run->req, batch);
+	if (err) {
+		for (unsigned i = 0; i < count; i++)
+			blockput(vec[i].buffer);
+		free(run);
+	}
+	return err;
+}
+
+static int cmp_bufvec(const void *a, const void *b)
+{
+	const struct bufvec *x = a, *y = b;
+	struct dev *xdev = x->buffer->map->dev, *ydev = y->buffer->map->dev;
+	if (xdev != ydev)
+		return xdev < ydev ? -1 : 1;
+	return x->block < y->block ? -1 : x->block > y->block;
+}
+
+static int adjacent(struct bufvec *prev, struct bufvec *next)
+{
+	return next->buffer->map->dev == prev->buffer->map->dev && next->block == prev->block + 1;
+}
+
+/* Returns how far it got in *done and how many requests it made in *runs */
+static int __submit_bufvec(struct bufvec *vec, unsigned count, int write, unsigned flags,
+			   struct iobatch *batch, unsigned *done, unsigned *runs)
+{
+	unsigned i = 0, requests = 0;
+	int err = 0;
+	qsort(vec, count, sizeof(*vec), cmp_bufvec);
+	while (i < count) {
+		struct buffer_head *buffer = vec[i].buffer;
+		assert(buffer->map->dev->bits >= 8 && buffer->map->dev->fd);
+		if (!write && (flags & BUFIO_UPDATE) && borrow_block(buffer, vec[i].block)) {
+			set_buffer_clean(buffer);
+			i++;
+			continue;
+		}
+		unsigned run = 1, bytes = bufsize(buffer);
+		while (i + run < count && run < IOV_MAX && adjacent(vec + i + run - 1, vec + i + run) &&
+		       bytes + bufsize(vec[i + run].buffer) <= flush_limit)
+			bytes += bufsize(vec[i + run++].buffer);
+		if ((err = submit_run(vec + i, run, write, flags, batch)))
+			break;
+		i += run;
+		requests++;
+	}
+	if (done)
+		*done = i;
+	if (runs)
+		*runs = requests;
+	return err;
+}
+
+int submit_bufvec(struct bufvec *vec, unsigned count, int write, struct iobatch *batch, int update)
+{
+	return __submit_bufvec(vec, count, write, update ? BUFIO_UPDATE : 0, batch, NULL, NULL);
+}
+
+int submit_bufio(struct buffer_head *buffer, int write, block_t block, struct iobatch *batch, int update)
+{
+	return submit_bufvec(&(struct bufvec){ .buffer = buffer, .block = block }, 1, write, batch, update);
+}
+
+/*
+ * Readahead
+ *
+ * Each map watches for a sequential reader.  A miss on the block after
+ * the last one read opens a window of READAHEAD_MIN blocks, a miss
+ * anywhere else closes it.  When the reader gets to the mark in the last
+ * window read ahead, the next window goes out, twice as big, up to
+ * READAHEAD_MAX or a quarter of the pool.  Blocks read ahead and evicted
+ * before anybody read them halve the window, so a reader that only looks
+ * at part of what it is given stops paying for the rest.
+ *
+ * Device maps read ahead asynchronously into the readahead batch of the
+ * map.  The buffer stays locked and pending until the read completes,
+ * and a reader that runs into it drives the batch.  Other maps can only
+ * read through their io method, which sizes its transfer with
+ * readahead_window(), so their readahead is synchronous but still goes
+ * out as one big read instead of many small ones.  Blocks borrowed from
+ * a mapped device cost nothing and are not read ahead.
+ */
+static int readahead_async(map_t *map)
+{
+	return map->io == dev_blockio && !map->dev->mapping;
+}
+
+static unsigned readahead_max(map_t *map)
+{
+	unsigned max = map_pool(map)->max_buffers / 4;
+	return max < READAHEAD_MAX ? max : READAHEAD_MAX;
+}
+
+/* Halve the window once for any readahead wasted since last time */
+static void readahead_waste(struct readahead *ra)
+{
+	unsigned wasted = __atomic_load_n(&ra->wasted, __ATOMIC_RELAXED);
+	if (wasted != ra->seen) {
+		ra->seen = wasted;
+		ra->window /= 2;
+	}
+}
+
+static unsigned grow_window(map_t *map, unsigned window)
+{
+	unsigned max = readahead_max(map);
+	window = window ? 2 * window : READAHEAD_MIN;
+	return window < max ? window : max;
+}
+
+/* A read missed, return how many blocks after it to read ahead */
+static unsigned readahead_miss(map_t *map, block_t block)
+{
+	struct readahead *ra = &map->ra;
+	unsigned count = 0;
+	pthread_mutex_lock(&ra->lock);
+	readahead_waste(ra);
+	if (block == ra->next) {
+		ra->window = grow_window(map, ra->window);
+		ra->ahead = block + ra->window;
+		ra->mark = block + ra->window / 2;
+		count = ra->window - 1;
+	} else
+		ra->window = 0;
+	ra->next = block + 1;
+	pthread_mutex_unlock(&ra->lock);
+	return count;
+}
+
+/* A read found a block read ahead, maybe send out the next window */
+static unsigned readahead_hit(map_t *map, block_t block, block_t *start)
+{
+	struct readahead *ra = &map->ra;
+	unsigned count = 0;
+	pthread_mutex_lock(&ra->lock);
+	readahead_waste(ra);
+	ra->used++;
+	ra->next = block + 1;
+	if (block >= ra->mark && ra->window) {
+		ra->window = grow_window(map, ra->window);
+		if (ra->ahead <= block)
+			ra->ahead = block + 1;
+		*start = ra->mark = ra->ahead;
+		ra->ahead += count = ra->window;
+	}
+	pthread_mutex_unlock(&ra->lock);
+	return count;
+}
+
+/*
+ * Read blocks not cached yet asynchronously, as one batch with a read per
+ * run of adjacent blocks, either count blocks from start or the count
+ * blocks in list.  Nothing past the end of the volume.
+ */
+static void readahead_batch(map_t *map, block_t *list, block_t start, unsigned count)
+{
+	struct bufvec vec[READAHEAD_MAX];
+	unsigned held = 0, done = 0;
+	uint64_t size;
+	int sized = !fdsize64(map->dev->fd, &size);
+	if (count > READAHEAD_MAX)
+		count = READAHEAD_MAX;
+	for (unsigned i = 0; i < count; i++) {
+		block_t block = list ? list[i] : start + i;
+		if (sized && block >= size >> map->dev->bits)
+			continue;
+		struct buffer_head *buffer = blockget(map, block);
+		if (!buffer)
+			break;
+		if (buffer_empty(buffer) && !__atomic_test_and_set(&buffer->locked, __ATOMIC_ACQUIRE)) {
+			if (buffer_empty(buffer)) {
+				buffer->readahead = READAHEAD_PENDING;
+				vec[held++] = (struct bufvec){ .buffer = buffer, .block = block };
+				continue;
 			}
+			unlock_buffer(buffer);
+		}
+		blockput(buffer);
+	}
+	if (held)
+		__submit_bufvec(vec, held, READ, BUFIO_UPDATE, &map->ra.batch, &done, NULL);
+	__atomic_add_fetch(&map->ra.issued, done, __ATOMIC_RELAXED);
+	for (unsigned i = 0; i < held; i++) {
+		struct buffer_head *buffer = vec[i].buffer;
+		if (i >= done) {
+			buffer->readahead = READAHEAD_NONE;
+			unlock_buffer(buffer);
 		}
+		blockput(buffer);
 	}
 }
 
-int flush_list(struct list_head *list)
+static void map_readahead(map_t *map, block_t start, unsigned count)
+{
+	buftrace("readahead %Lx/%u", (L)start, count);
+	if (!readahead_async(map)) {
+		struct buffer_head *buffer = blockget(map, start);
+		if (!buffer)
+			return;
+		if (buffer_empty(buffer) && !__atomic_test_and_set(&buffer->locked, __ATOMIC_ACQUIRE)) {
+			if (buffer_empty(buffer) && !map->io(buffer, 0))
+				set_buffer_readahead(buffer);
+			unlock_buffer(buffer);
+		}
+		blockput(buffer);
+		return;
+	}
+	readahead_batch(map, NULL, start, count);
+}
+
+/*
+ * Start reading blocks somebody knows will be wanted soon, adjacent or
+ * not, say the leaves under an index node.  They are taken just like
+ * readahead when they are read.  Only device maps read asynchronously,
+ * for any other map this is a no-op.
+ */
+void prefetch_blocks(map_t *map, block_t *blocks, unsigned count)
+{
+	if (readahead_async(map))
+		readahead_batch(map, blocks, 0, count);
+}
+
+/* Io methods mark blocks they read beyond the one asked for */
+void set_buffer_readahead(struct buffer_head *buffer)
+{
+	buffer->readahead = READAHEAD_READY;
+	__atomic_add_fetch(&buffer->map->ra.issued, 1, __ATOMIC_RELAXED);
+}
+
+unsigned readahead_window(map_t *map)
+{
+	return __atomic_load_n(&map->ra.window, __ATOMIC_RELAXED);
+}
+
+/* Complete all asynchronous readahead of a map */
+void wait_readahead(map_t *map)
+{
+	if (__atomic_load_n(&map->ra.batch.inflight, __ATOMIC_SEQ_CST))
+		wait_iobatch(&map->ra.batch);
+}
+
+/* Lock a buffer for io, completing readahead that holds the lock */
+static void lock_buffer(struct buffer_head *buffer)
+{
+	while (__atomic_test_and_set(&buffer->locked, __ATOMIC_ACQUIRE)) {
+		if (__atomic_load_n(&buffer->readahead, __ATOMIC_ACQUIRE) == READAHEAD_PENDING)
+			wait_readahead(buffer->map);
+		else
+			sched_yield();
+	}
+}
+
+struct buffer_head *blockread(map_t *map, block_t block)
+{
+	struct buffer_head *buffer = blockget(map, block);
+	if (!buffer)
+		return NULL;
+	if (buffer_empty(buffer)) {
+		unsigned char state = __atomic_load_n(&buffer->readahead, __ATOMIC_ACQUIRE);
+		if (state != READAHEAD_PENDING) {
+			unsigned count = readahead_miss(map, block);
+			if (count && readahead_async(map))
+				map_readahead(map, block + 1, count);
+		}
+		lock_buffer(buffer);
+		if (buffer_empty(buffer)) {
+			buftrace("read buffer %Lx, state %i", (L)buffer->index, buffer->state);
+			int err = buffer->map->io(buffer, 0);
+			if (err) {
+				unlock_buffer(buffer);
+				blockput(buffer);
+				return NULL; // ERR_PTR me!!!
+			}
+		}
+		unlock_buffer(buffer);
+	}
+	unsigned char ready = READAHEAD_READY;
+	if (__atomic_load_n(&buffer->readahead, __ATOMIC_ACQUIRE) == READAHEAD_READY &&
+	    __atomic_compare_exchange_n(&buffer->readahead, &ready, READAHEAD_NONE, 0,
+					__ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST)) {
+		block_t start;
+		unsigned count = readahead_hit(map, block, &start);
+		if (count)
+			map_readahead(map, start, count);
+	}
+	return buffer;
+}
+
+/*
+ * Writeback of device maps
+ *
+ * Dirty buffers that go straight to the device are taken off the list
+ * and written as one batch, a vectored write per run of adjacent blocks,
+ * all runs in flight at once.  Anything else is written synchronously
+ * through its map->io as before.
+ */
+
+static struct flush_stats flush_stats;
+
+void get_flush_stats(struct flush_stats *stats)
 {
+	pthread_mutex_lock(&state_lock);
+	*stats = flush_stats;
+	pthread_mutex_unlock(&state_lock);
+}
+
+static int __flush_list(struct list_head *list, int evict)
+{
+	LIST_HEAD(inflight);
+	struct bufvec *sorted = NULL;
+	unsigned count = 0, max = 0;
 	int err = 0;
 	while (!list_empty(list)) {
 		struct buffer_head *buffer = list_entry(list->next, struct buffer_head, link);
 		buftrace("write buffer %Lx", (L)buffer->index);
 		assert(buffer_dirty(buffer));
+		if (buffer->map->io == dev_blockio) {
+			if (count == max) {
+				void *vec = realloc(sorted, (max = max ? 2 * max : 64) * sizeof(*sorted));
+				if (!vec) {
+					err = -ENOMEM;
+					break;
+				}
+				sorted = vec;
+			}
+			set_buffer_state_list(buffer, buffer->state, &inflight);
+			sorted[count++] = (struct bufvec){ .buffer = buffer, .block = buffer->index };
+			continue;
+		}
 		if ((err = buffer->map->io(buffer, 1)))
 			break;
 		assert(buffer_clean(buffer));
+		if (evict)
+			evict_buffer(buffer);
 	}
-	return err;
+
+	struct iobatch batch = IOBATCH_INIT;
+	unsigned i = 0, writes = 0;
+	if (!err)
+		err = __submit_bufvec(sorted, count, WRITE, BUFIO_UPDATE | (evict ? BUFIO_EVICT : 0),
+				      &batch, &i, &writes);
+	/* Whatever did not make it out goes back where it came from */
+	for (; i < count; i++)
+		set_buffer_state_list(sorted[i].buffer, sorted[i].buffer->state, list);
+	int ioerr = wait_iobatch(&batch);
+	assert(list_empty(&inflight));
+	free(sorted);
+
+	pthread_mutex_lock(&state_lock);
+	flush_stats.buffers += count;
+	flush_stats.writes += writes;
+	pthread_mutex_unlock(&state_lock);
+	return err ? : ioerr;
+}
+
+int flush_list(struct list_head *list)
+{
+	return __flush_list(list, 0);
+}
+
+/* Write out and drop buffers nobody will look up again */
+int flush_evict_list(struct list_head *list)
+{
+	return __flush_list(list, 1);
 }
 
 int flush_buffers(map_t *map)
@@ -344,7 +1328,7 @@ static void free_buffer(struct buffer_head *buffer)
 		assert(!hlist_unhashed(&buffer->hashlink));
 	list_del(&buffer->lru);
 	list_del(&buffer->link);
-	free(buffer->data);
+	free(buffer->alloc ? : buffer->data);
 	free(buffer);
 }
 
@@ -375,28 +1359,35 @@ static void __destroy_buffers(void)
 	}
 #if 1
 	int has_dirty = 0;
-	list_for_each_entry_safe(buffer, safe, &lru_buffers, lru) {
-		if (BUFFER_DIRTY <= buffer->state) {
-			if (!debug_buffer)
-				free_buffer(buffer);
-			else
-				has_dirty = 1;
+	for (int i = 0; i < POOL_LISTS; i++) {
+		list_for_each_entry_safe(buffer, safe, pool_list(i), lru) {
+			if (BUFFER_DIRTY <= buffer->state) {
+				if (!debug_buffer)
+					free_buffer(buffer);
+				else
+					has_dirty = 1;
+			}
 		}
 	}
 	if (has_dirty) {
 		warn("dirty buffer leak, or list corruption?");
-		list_for_each_entry(buffer, &lru_buffers, lru) {
-			if (BUFFER_DIRTY <= buffer->state) {
-				printf("map [%p] ", buffer->map);
-				show_buffer(buffer);
+		for (int i = 0; i < POOL_LISTS; i++) {
+			list_for_each_entry(buffer, pool_list(i), lru) {
+				if (BUFFER_DIRTY <= buffer->state) {
+					printf("map [%p] ", buffer->map);
+					show_buffer(buffer);
+				}
 			}
 		}
 		printf("\n");
-		assert(list_empty(&lru_buffers));
+		assert(0);
 	}
 #else
-	assert(list_empty(&lru_buffers));
+	for (int i = 0; i < POOL_LISTS; i++)
+		assert(list_empty(pool_list(i)));
 #endif
+	for (int i = 0; i < BUFFER_POOLS; i++)
+		destroy_ghosts(pools + i);
 }
 
 static void destroy_buffers(void)
@@ -406,36 +1397,76 @@ static void destroy_buffers(void)
 #endif
 
 #ifndef BUFFER_PARANOIA_DEBUG
-static struct buffer_head *prealloc_heads;
+/*
+ * Buffer arena
+ *
+ * Buffer data comes from one region backed by 2MB huge pages if the host
+ * has any reserved, otherwise by transparent huge pages where the kernel
+ * supports them, to keep TLB misses down on big caches.  The heads are a
+ * separate dense array, each head starting on its own cache line so the
+ * fields a hash lookup touches never straddle two lines.
+ */
+#define HUGE_PAGE_SIZE (2 << 20)
+#define CACHE_LINE_SIZE 64
+
+struct arena_head {
+	struct buffer_head head;
+} __attribute__((aligned(CACHE_LINE_SIZE)));
+
+static struct arena_head *prealloc_heads;
 static unsigned char *data_pool;
 
-static int preallocate_buffers(unsigned bufsize)
+static void *alloc_arena(size_t size, const char **kind)
+{
+	size = (size + HUGE_PAGE_SIZE - 1) & -(size_t)HUGE_PAGE_SIZE;
+	void *mem = mmap(NULL, size, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS|MAP_HUGETLB, -1, 0);
+	if (mem != MAP_FAILED) {
+		*kind = "huge pages";
+		return mem;
+	}
+	/* Over-allocate to start on a huge page boundary, trim the ends */
+	unsigned char *raw = mmap(NULL, size + HUGE_PAGE_SIZE, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+	if (raw == MAP_FAILED)
+		return NULL;
+	unsigned char *start = (unsigned char *)(((unsigned long)raw + HUGE_PAGE_SIZE - 1) & -(unsigned long)HUGE_PAGE_SIZE);
+	if (start > raw)
+		munmap(raw, start - raw);
+	munmap(start + size, raw + HUGE_PAGE_SIZE - start);
+	*kind = madvise(start, size, MADV_HUGEPAGE) ? "small pages" : "transparent huge pages";
+	return start;
+}
+
+static int preallocate_buffers(unsigned max_buffers, unsigned bufsize, unsigned align)
 {
-	int i, err = -ENOMEM; /* if malloc fails */
+	int i, err = -ENOMEM; /* if allocation fails */
+	const char *kind;
 
 	buftrace("Pre-allocating buffers...");
-	prealloc_heads = malloc(max_buffers * sizeof(*prealloc_heads));
-	if (!prealloc_heads)
+	if (posix_memalign((void **)&prealloc_heads, CACHE_LINE_SIZE, max_buffers * sizeof(*prealloc_heads)))
 		goto buffers_allocation_failure;
 	buftrace("Pre-allocating data for buffers...");
-	if ((err = posix_memalign((void **)&data_pool, (1 << SECTOR_BITS), max_buffers*bufsize)))
+	assert(align <= HUGE_PAGE_SIZE);
+	if (!(data_pool = alloc_arena((size_t)max_buffers * bufsize, &kind))) {
+		err = -errno;
 		goto data_allocation_failure;
+	}
+	buftrace("%u buffers of %u bytes on %s", max_buffers, bufsize, kind);
 
-	//memset(data_pool, 0xdd, max_buffers*bufsize); /* first time init to deadly data */
 	for(i = 0; i < max_buffers; i++) {
-		prealloc_heads[i] = (struct buffer_head){
-			.data = (data_pool + i*bufsize),
+		struct buffer_head *buffer = &prealloc_heads[i].head;
+		*buffer = (struct buffer_head){
+			.data = (data_pool + (size_t)i * bufsize),
 			.state = BUFFER_FREED,
-			.lru = LIST_HEAD_INIT(prealloc_heads[i].lru),
+			.lru = LIST_HEAD_INIT(buffer->lru),
 		};
-		INIT_HLIST_NODE(&prealloc_heads[i].hashlink);
-		list_add_tail(&prealloc_heads[i].link, buffers + BUFFER_FREED);
+		INIT_HLIST_NODE(&buffer->hashlink);
+		list_add_tail(&buffer->link, buffers + BUFFER_FREED);
 	}
 
 	return 0; /* sucess on pre-allocation of buffers */
 
 data_allocation_failure:
-	warn("Error: %s unable to allocate space for buffer data", strerror(err));
+	warn("Error: %s unable to allocate space for buffer data", strerror(-err));
 	free(prealloc_heads);
 buffers_allocation_failure:
 	warn("Unable to pre-allocate buffers. Using on demand allocation for buffers");
@@ -443,29 +1474,330 @@ buffers_allocation_failure:
 }
 #endif /* !BUFFER_PARANOIA_DEBUG */
 
-void init_buffers(struct dev *dev, unsigned poolsize, int debug)
+void init_buffer_pools(struct dev *dev, unsigned datasize, unsigned metasize, int debug)
 {
 	debug_buffer = debug;
-	INIT_LIST_HEAD(&lru_buffers);
 	for (int i = 0; i < BUFFER_STATES; i++)
 		INIT_LIST_HEAD(buffers + i);
+	memset(state_count, 0, sizeof(state_count));
+	for (struct buffer_pool *pool = pools; pool < pools + BUFFER_POOLS; pool++) {
+		for (int i = 0; i < QUEUES; i++)
+			INIT_LIST_HEAD(pool->queue + i);
+		INIT_LIST_HEAD(&pool->held);
+	}
 #ifndef BUFFER_PARANOIA_DEBUG
-	unsigned bufsize = 1 << dev->bits;
-	max_buffers = poolsize / bufsize;
-	max_evict = max_buffers / 10;
-	preallocate_buffers(bufsize);
+	unsigned poolsize[BUFFER_POOLS] = {
+		[BUFFER_POOL_DATA] = datasize,
+		[BUFFER_POOL_META] = metasize,
+	};
+	unsigned bufsize = 1 << dev->bits, total = 0;
+	for (struct buffer_pool *pool = pools; pool < pools + BUFFER_POOLS; pool++) {
+		pool->max_buffers = poolsize[pool - pools] / bufsize;
+		pool->max_evict = pool->max_buffers / 10;
+		total += pool->max_buffers;
+	}
+	preallocate_buffers(total, bufsize, dev_align(dev));
 #else
 	destroy_buffers();
 #endif
+	if (dev->flags & DEV_DIRECT) {
+		int err = direct_dev(dev);
+		if (err)
+			warn("unable to use O_DIRECT (%s), going through the page cache", strerror(-err));
+		else if (dev->flags & DEV_MMAP)
+			warn("volume not mapped, O_DIRECT bypasses the page cache it would map");
+	}
+	if ((dev->flags & (DEV_MMAP|DEV_DIRECT)) == DEV_MMAP) {
+		int err = map_dev(dev);
+		if (err)
+			warn("unable to map volume (%s), reading blocks instead", strerror(-err));
+	}
+	/* run anything, tests included, on a simulated device */
+	const char *spec = getenv("TUX3_SIM");
+	if (spec && !sim_lookup(dev->fd)) {
+		int err = sim_dev(dev, spec);
+		if (err)
+			warn("unable to simulate '%s' (%s)", spec, strerror(-err));
+	}
+#ifdef BUFFER_FOR_TUX3
+	const char *path = getenv("TUX3_IOTRACE");
+	if (path) {
+		int err = iotrace_open(path);
+		if (err && err != -EBUSY)
+			warn("unable to trace io to '%s' (%s)", path, strerror(-err));
+	}
+#endif
+	for (struct buffer_pool *pool = pools; pool < pools + BUFFER_POOLS; pool++) {
+		/* remember about half a pool worth of evicted cold buffers */
+		unsigned bits = 0;
+		while (2 << bits <= pool->max_buffers / 2)
+			bits++;
+		if (init_ghosts(pool, bits))
+			warn("No memory for %s ghost list, 2Q will act like FIFO", pool->name);
+	}
+}
+
+/* Metadata gets a quarter of the pool unless the caller says otherwise */
+void init_buffers(struct dev *dev, unsigned poolsize, int debug)
+{
+	init_buffer_pools(dev, poolsize - poolsize / 4, poolsize / 4, debug);
+}
+
+void set_map_pool(map_t *map, unsigned pool)
+{
+	assert(pool < BUFFER_POOLS);
+	assert(!map_buffers(map));
+	map->pool = pool;
+}
+
+void get_pool_stats(unsigned pool, struct pool_stats *stats)
+{
+	assert(pool < BUFFER_POOLS);
+	pthread_mutex_lock(&pools[pool].lock);
+	*stats = pools[pool].stats;
+	for (int i = 0; i < BUFFER_SHARDS; i++) {
+		stats->hits += __atomic_load_n(&pools[pool].counts[i].hits, __ATOMIC_RELAXED);
+		stats->misses += __atomic_load_n(&pools[pool].counts[i].misses, __ATOMIC_RELAXED);
+	}
+	stats->buffers = pools[pool].buffer_count;
+	stats->max_buffers = pools[pool].max_buffers;
+	pthread_mutex_unlock(&pools[pool].lock);
+}
+
+void show_buffer_pools(void)
+{
+	for (int i = 0; i < BUFFER_POOLS; i++) {
+		struct pool_stats stats;
+		get_pool_stats(i, &stats);
+		printf("%s pool: %u/%u buffers, %lu hits, %lu misses, %lu evictions, "
+			"%lu expansions, %lu exceeded\n",
+			pools[i].name, stats.buffers, stats.max_buffers,
+			stats.hits, stats.misses, stats.evictions,
+			stats.expansions, stats.exceeded);
+	}
+}
+
+/*
+ * Buffer statistics
+ *
+ * Map counts live in the shards and are bumped under the shard lock the
+ * lookup takes anyway, so they cost an increment.  Io latency is measured
+ * from submission to the completion handler, which for asynchronous io
+ * includes the time until the submitter waited for it, the way a caller
+ * sees it.  Histograms are log2 microseconds so they stay small enough to
+ * update with relaxed atomics on every transfer.
+ */
+static struct latency_stats latency[2];
+
+unsigned long long io_clock(void)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+void count_io(int write, unsigned long long start)
+{
+	struct latency_stats *stats = latency + !!write;
+	unsigned long long usecs = (io_clock() - start) / 1000;
+	unsigned bucket = usecs ? 64 - __builtin_clzll(usecs) : 0;
+	if (bucket >= LATENCY_BUCKETS)
+		bucket = LATENCY_BUCKETS - 1;
+	__atomic_add_fetch(&stats->count, 1, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&stats->usecs, usecs, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&stats->bucket[bucket], 1, __ATOMIC_RELAXED);
+}
+
+static void get_latency(struct latency_stats *from, struct latency_stats *to)
+{
+	to->count = __atomic_load_n(&from->count, __ATOMIC_RELAXED);
+	to->usecs = __atomic_load_n(&from->usecs, __ATOMIC_RELAXED);
+	for (int i = 0; i < LATENCY_BUCKETS; i++)
+		to->bucket[i] = __atomic_load_n(&from->bucket[i], __ATOMIC_RELAXED);
+}
+
+void get_map_stats(map_t *map, struct map_stats *stats)
+{
+	*stats = (struct map_stats){ };
+	for (int i = 0; i < BUFFER_SHARDS; i++) {
+		struct buffer_shard *shard = map->shard + i;
+		pthread_mutex_lock(&shard->lock);
+		stats->hits += shard->hits;
+		stats->misses += shard->misses;
+		stats->evictions += shard->evictions;
+		stats->buffers += shard->buffers;
+		pthread_mutex_unlock(&shard->lock);
+	}
+	pthread_mutex_lock(&map->ra.lock);
+	stats->readahead = __atomic_load_n(&map->ra.issued, __ATOMIC_RELAXED);
+	stats->rahits = map->ra.used;
+	stats->rawasted = __atomic_load_n(&map->ra.wasted, __ATOMIC_RELAXED);
+	stats->window = map->ra.window;
+	pthread_mutex_unlock(&map->ra.lock);
+	struct buffer_head *buffer;
+	pthread_mutex_lock(&state_lock);
+	list_for_each_entry(buffer, &map->dirty, link)
+		stats->dirty[buffer->state - BUFFER_DIRTY]++;
+	pthread_mutex_unlock(&state_lock);
+}
+
+void get_buffer_stats(struct buffer_stats *stats)
+{
+	*stats = (struct buffer_stats){ };
+	for (int i = 0; i < BUFFER_POOLS; i++)
+		get_pool_stats(i, stats->pool + i);
+	pthread_mutex_lock(&state_lock);
+	memcpy(stats->state, state_count, sizeof(state_count));
+	struct list_head *list;
+	list_for_each(list, buffers + BUFFER_FREED)
+		stats->state[BUFFER_FREED]++;
+	stats->flush = flush_stats;
+	pthread_mutex_unlock(&state_lock);
+	get_latency(latency + 0, &stats->read);
+	get_latency(latency + 1, &stats->write);
+}
+
+/* Reset global counters; map counters live as long as their map */
+void clear_buffer_stats(void)
+{
+	for (int i = 0; i < BUFFER_POOLS; i++) {
+		struct buffer_pool *pool = pools + i;
+		pthread_mutex_lock(&pool->lock);
+		pool->stats = (struct pool_stats){ };
+		for (int j = 0; j < BUFFER_SHARDS; j++)
+			pool->counts[j] = (struct pool_counts){ };
+		pthread_mutex_unlock(&pool->lock);
+	}
+	pthread_mutex_lock(&state_lock);
+	flush_stats = (struct flush_stats){ };
+	pthread_mutex_unlock(&state_lock);
+	memset(latency, 0, sizeof(latency));
+}
+
+void show_map_stats(map_t *map, const char *name)
+{
+	struct map_stats stats;
+	get_map_stats(map, &stats);
+	printf("%s map: %u buffers, %lu hits, %lu misses, %lu evictions, dirty",
+		name, stats.buffers, stats.hits, stats.misses, stats.evictions);
+	for (int i = 0; i < BUFFER_DIRTY_STATES; i++)
+		printf(" %u", stats.dirty[i]);
+	printf("\n");
+	printf("%s map: %lu blocks read ahead, %lu used, %lu wasted, window %u\n",
+		name, stats.readahead, stats.rahits, stats.rawasted, stats.window);
+}
+
+static void show_latency(const char *name, struct latency_stats *stats)
+{
+	printf("%s latency: %lu transfers", name, stats->count);
+	if (stats->count)
+		printf(", %lu us average", stats->usecs / stats->count);
+	printf("\n");
+	for (int i = 0; i < LATENCY_BUCKETS; i++)
+		if (stats->bucket[i])
+			printf("  < %8lu us: %lu\n", 1UL << i, stats->bucket[i]);
+}
+
+void show_buffer_stats(void)
+{
+	struct buffer_stats stats;
+	get_buffer_stats(&stats);
+	show_buffer_pools();
+	printf("buffer states: %u freed, %u empty, %u clean, dirty",
+		stats.state[BUFFER_FREED], stats.state[BUFFER_EMPTY],
+		stats.state[BUFFER_CLEAN]);
+	for (int i = BUFFER_DIRTY; i < BUFFER_STATES; i++)
+		printf(" %u", stats.state[i]);
+	printf("\n");
+	printf("writeback: %lu buffers in %lu writes\n",
+		stats.flush.buffers, stats.flush.writes);
+	show_latency("read", &stats.read);
+	show_latency("write", &stats.write);
+}
+
+/*
+ * Memory mapped volume
+ *
+ * A read-only volume is mapped shared and read-only, so a stray store
+ * through a borrowed buffer faults instead of going unnoticed.  A
+ * writable volume is mapped private: modifying a borrowed buffer copies
+ * the page, and the block only changes on disk when the buffer is
+ * written out.  Blocks must be at least a page so that dev_written() can
+ * drop the private copy of exactly the blocks that just went to disk.
+ */
+int map_dev(struct dev *dev)
+{
+	uint64_t size;
+	if ((1 << dev->bits) < sysconf(_SC_PAGESIZE))
+		return -EINVAL;
+	if (fdsize64(dev->fd, &size))
+		return -errno;
+	int mode = fcntl(dev->fd, F_GETFL);
+	if (mode == -1)
+		return -errno;
+	int rdonly = (mode & O_ACCMODE) == O_RDONLY;
+	void *mapping = mmap(NULL, size, rdonly ? PROT_READ : PROT_READ|PROT_WRITE,
+			     rdonly ? MAP_SHARED : MAP_PRIVATE, dev->fd, 0);
+	if (mapping == MAP_FAILED)
+		return -errno;
+	dev->mapping = mapping;
+	dev->mapsize = size;
+	dev->flags = (dev->flags & ~DEV_RDONLY) | (rdonly ? DEV_RDONLY : 0);
+	return 0;
+}
+
+/*
+ * Direct io
+ *
+ * With O_DIRECT the host keeps no second copy of what the buffer cache
+ * already holds.  Buffer memory is aligned to the block size for this,
+ * and devio() bounces anything else through an aligned buffer.  The flag
+ * is dropped again if the host refuses O_DIRECT for this file.
+ */
+int direct_dev(struct dev *dev)
+{
+	int mode = fcntl(dev->fd, F_GETFL);
+	if (mode == -1 || fcntl(dev->fd, F_SETFL, mode | O_DIRECT) == -1) {
+		dev->flags &= ~DEV_DIRECT;
+		return -errno;
+	}
+	dev->flags |= DEV_DIRECT;
+	return 0;
+}
+
+/* Only once no buffer borrows from the mapping any more */
+void unmap_dev(struct dev *dev)
+{
+	if (dev->mapping) {
+		munmap(dev->mapping, dev->mapsize);
+		dev->mapping = NULL;
+		dev->mapsize = 0;
+	}
+}
+
+/* Blocks just written: forget private copies so the mapping shows the disk */
+void dev_written(struct dev *dev, loff_t offset, size_t len)
+{
+	if (!dev->mapping || (dev->flags & DEV_RDONLY) || offset >= dev->mapsize)
+		return;
+	long pagesize = sysconf(_SC_PAGESIZE);
+	loff_t start = offset & -pagesize, end = (offset + len + pagesize - 1) & -pagesize;
+	if (end > dev->mapsize)
+		end = dev->mapsize;
+	madvise(dev->mapping + start, end - start, MADV_DONTNEED);
 }
 
 int dev_blockio(struct buffer_head *buffer, int write)
 {
 	struct dev *dev = buffer->map->dev;
 	assert(dev->bits >= 8 && dev->fd);
+	if (!write && borrow_block(buffer, buffer->index)) {
+		set_buffer_clean(buffer);
+		return 0;
+	}
 	int err;
 #ifdef BUFFER_FOR_TUX3
-	err = blockio(write, buffer, buffer->index);
+	err = bufferio(write, buffer, buffer->index);
 #else
 	if (write)
 		err = diskwrite(dev->fd, buffer->data, bufsize(buffer), buffer->index << dev->bits);
@@ -488,21 +1820,38 @@ map_t *new_map(struct dev *dev, blockio_t *io)
 	map_t *map = malloc(sizeof(*map)); // error???
 	*map = (map_t){ .dev = dev, .io = io ? io : dev_blockio };
 	INIT_LIST_HEAD(&map->dirty);
-	for (int i = 0; i < BUFFER_BUCKETS; i++)
-		INIT_HLIST_HEAD(&map->hash[i]);
+	pthread_mutex_init(&map->ra.lock, NULL);
+	for (int i = 0; i < BUFFER_SHARDS; i++) {
+		struct buffer_shard *shard = map->shard + i;
+		pthread_mutex_init(&shard->lock, NULL);
+		shard->hashbits = BUFFER_HASH_BITS;
+		shard->hash = new_hash(shard->hashbits); // error???
+	}
 	return map;
 }
 
 void free_map(map_t *map)
 {
+	struct buffer_pool *pool = map_pool(map);
 	assert(list_empty(&map->dirty));
+	wait_readahead(map);
 
-	for (int i = 0; i < BUFFER_BUCKETS; i++) {
-		struct hlist_head *bucket = &map->hash[i];
-		struct buffer_head *buffer;
-		struct hlist_node *node, *n;
-		hlist_for_each_entry_safe(buffer, node, n, bucket, hashlink)
-			evict_buffer(buffer);
+	pthread_mutex_lock(&pool->lock);
+	for (int j = 0; j < BUFFER_SHARDS; j++) {
+		struct buffer_shard *shard = map->shard + j;
+		for (unsigned i = 0; i < shard_buckets(shard); i++) {
+			struct hlist_head *bucket = shard_bucket(shard, i);
+			struct buffer_head *buffer;
+			struct hlist_node *node, *n;
+			hlist_for_each_entry_safe(buffer, node, n, bucket, hashlink)
+				__evict_buffer(pool, shard, buffer);
+		}
+		assert(!shard->buffers);
+		free(shard->rehash);
+		free(shard->hash);
+		pthread_mutex_destroy(&shard->lock);
 	}
+	pthread_mutex_unlock(&pool->lock);
+	pthread_mutex_destroy(&map->ra.lock);
 	free(map);
 }
@@ -1,7 +1,9 @@
 #ifndef BUFFER_H
 #define BUFFER_H
 
+#include <pthread.h>
 #include "list.h"
+#include "asyncio.h"
 
 #define BUFFER_FOR_TUX3
 
@@ -12,16 +14,83 @@ enum {
 	BUFFER_STATES = BUFFER_DIRTY + BUFFER_DIRTY_STATES
 };
 
-#define BUFFER_BUCKETS 999
+#define BUFFER_SHARD_BITS 3 /* each map hash is split in 1 << BUFFER_SHARD_BITS shards */
+#define BUFFER_SHARDS (1 << BUFFER_SHARD_BITS)
+#define BUFFER_HASH_BITS 2 /* initial shard hash is 1 << BUFFER_HASH_BITS buckets */
+
+enum { BUFFER_POOL_DATA, BUFFER_POOL_META, BUFFER_POOLS };
+
+#define FLUSH_LIMIT (1 << 20) /* default largest single batched transfer */
+
+struct flush_stats {
+	unsigned long buffers, writes;
+};
+
+struct pool_stats {
+	unsigned long hits, misses, evictions;
+	unsigned long expansions; /* buffers allocated because the free list was empty */
+	unsigned long exceeded; /* allocations refused at max_buffers, nothing evictable */
+	unsigned buffers, max_buffers;
+};
+
+#define LATENCY_BUCKETS 24 /* bucket i counts transfers under 2^i microseconds */
+
+struct latency_stats {
+	unsigned long count, usecs, bucket[LATENCY_BUCKETS];
+};
+
+struct map_stats {
+	unsigned long hits, misses, evictions;
+	unsigned long readahead, rahits, rawasted; /* blocks read ahead, used, evicted unused */
+	unsigned window;
+	unsigned buffers, dirty[BUFFER_DIRTY_STATES];
+};
+
+struct buffer_stats {
+	struct pool_stats pool[BUFFER_POOLS];
+	unsigned state[BUFFER_STATES]; /* buffers in each state, all maps */
+	struct flush_stats flush;
+	struct latency_stats read, write;
+};
 
 typedef loff_t block_t; // disk io address range
 
-struct dev { unsigned fd, bits; };
+#define DEV_MMAP	(1 << 0)	/* map the volume, clean buffers borrow its pages */
+#define DEV_RDONLY	(1 << 1)	/* set by map_dev() for a read-only volume */
+#define DEV_DIRECT	(1 << 2)	/* bypass the host page cache with O_DIRECT */
+
+struct dev {
+	unsigned fd, bits, flags;
+	void *mapping;
+	loff_t mapsize;
+};
 
 struct buffer_head;
 
 typedef int (blockio_t)(struct buffer_head *buffer, int write);
 
+struct buffer_shard {
+	pthread_mutex_t lock;
+	struct hlist_head *hash, *rehash; /* rehash drains into hash while growing */
+	unsigned hashbits, rehashed, buffers;
+	unsigned long hits, misses, evictions; /* counted under lock */
+};
+
+#define READAHEAD_MIN 4 /* first window of a sequential reader, in blocks */
+#define READAHEAD_MAX 256 /* largest window */
+
+/* Buffer readahead flag: read is in flight, or block arrived but not used yet */
+enum { READAHEAD_NONE, READAHEAD_PENDING, READAHEAD_READY };
+
+struct readahead {
+	pthread_mutex_t lock;
+	block_t next; /* a sequential reader asks for this block next */
+	block_t ahead, mark; /* window ends at ahead, hitting mark starts the next */
+	unsigned window, wasted, seen; /* seen is how many wasted the window has paid for */
+	unsigned long issued, used;
+	struct iobatch batch; /* asynchronous readahead nobody waits for yet */
+};
+
 struct map {
 #ifdef BUFFER_FOR_TUX3
 	struct inode *inode;
@@ -29,19 +98,30 @@ struct map {
 	struct list_head dirty;
 	struct dev *dev;
 	blockio_t *io;
-	struct hlist_head hash[BUFFER_BUCKETS];
+	unsigned pool; /* BUFFER_POOL_* this map takes its buffers from */
+	struct buffer_shard shard[BUFFER_SHARDS];
+	struct readahead ra;
 };
 
 typedef struct map map_t;
 
 struct buffer_head {
-	map_t *map;
+	/* what hash lookup looks at comes first, within one cache line */
 	struct hlist_node hashlink;
-	struct list_head link;
-	struct list_head lru; /* used for LRU list and the free list */
-	unsigned count, state;
+	map_t *map;
 	block_t index;
 	void *data;
+	unsigned count, state, queue;
+	unsigned char referenced, locked, readahead;
+	struct list_head link;
+	struct list_head lru; /* used for replacement queues and the held list */
+	void *alloc; /* own memory, set aside while data borrows a device mapping */
+};
+
+/* A buffer and the device block it transfers to or from */
+struct bufvec {
+	struct buffer_head *buffer;
+	block_t block;
 };
 
 struct buffer_head *new_buffer(map_t *map);
@@ -55,17 +135,41 @@ struct buffer_head *set_buffer_dirty(struct buffer_head *buffer);
 struct buffer_head *set_buffer_clean(struct buffer_head *buffer);
 struct buffer_head *set_buffer_empty(struct buffer_head *buffer);
 void blockput(struct buffer_head *buffer);
-unsigned buffer_hash(block_t block);
+unsigned buffer_hash(block_t block, unsigned bits);
 struct buffer_head *peekblk(map_t *map, block_t block);
 struct buffer_head *blockget(map_t *map, block_t block);
 struct buffer_head *blockread(map_t *map, block_t block);
+void set_buffer_readahead(struct buffer_head *buffer);
+void prefetch_blocks(map_t *map, block_t *blocks, unsigned count);
+unsigned readahead_window(map_t *map);
+void wait_readahead(map_t *map);
 void insert_buffer_hash(struct buffer_head *buffer);
 void remove_buffer_hash(struct buffer_head *buffer);
+int submit_bufio(struct buffer_head *buffer, int write, block_t block, struct iobatch *batch, int update);
+int submit_bufvec(struct bufvec *vec, unsigned count, int write, struct iobatch *batch, int update);
+int flush_list(struct list_head *list);
+int flush_evict_list(struct list_head *list);
+void set_flush_limit(unsigned bytes);
+void get_flush_stats(struct flush_stats *stats);
 int flush_buffers(map_t *map);
 int flush_state(unsigned state);
 void evict_buffer(struct buffer_head *buffer);
 void invalidate_buffers(map_t *map);
+unsigned map_buffers(map_t *map);
+int count_buffers(void);
 void init_buffers(struct dev *dev, unsigned poolsize, int debug);
+void init_buffer_pools(struct dev *dev, unsigned datasize, unsigned metasize, int debug);
+int set_buffer_policy(const char *name);
+void set_map_pool(map_t *map, unsigned pool);
+void get_pool_stats(unsigned pool, struct pool_stats *stats);
+void show_buffer_pools(void);
+void get_map_stats(map_t *map, struct map_stats *stats);
+void get_buffer_stats(struct buffer_stats *stats);
+void clear_buffer_stats(void);
+void show_map_stats(map_t *map, const char *name);
+void show_buffer_stats(void);
+unsigned long long io_clock(void);
+void count_io(int write, unsigned long long start);
 
 static inline void *bufdata(struct buffer_head *buffer)
 {
@@ -77,6 +181,14 @@ static inline unsigned bufsize(struct buffer_head *buffer)
 	return 1 << buffer->map->dev->bits;
 }
 
+/* Memory, offset and length alignment for io on this device */
+static inline unsigned dev_align(struct dev *dev)
+{
+	if (!dev->bits)
+		return 1 << 12; /* block size not known yet, assume the largest sector */
+	return dev->bits > 9 ? 1 << dev->bits : 1 << 9;
+}
+
 static inline block_t bufindex(struct buffer_head *buffer)
 {
 	return buffer->index;
@@ -84,12 +196,12 @@ static inline block_t bufindex(struct buffer_head *buffer)
 
 static inline void get_bh(struct buffer_head *buffer)
 {
-	buffer->count++;
+	__atomic_add_fetch(&buffer->count, 1, __ATOMIC_SEQ_CST);
 }
 
 static inline int bufcount(struct buffer_head *buffer)
 {
-	return buffer->count;
+	return __atomic_load_n(&buffer->count, __ATOMIC_SEQ_CST);
 }
 
 static inline int buffer_empty(struct buffer_head *buffer)
@@ -107,6 +219,10 @@ static inline int buffer_dirty(struct buffer_head *buffer)
 	return buffer->state >= BUFFER_DIRTY;
 }
 
+int map_dev(struct dev *dev);
+int direct_dev(struct dev *dev);
+void unmap_dev(struct dev *dev);
+void dev_written(struct dev *dev, loff_t offset, size_t len);
 int dev_errio(struct buffer_head *buffer, int write);
 map_t *new_map(struct dev *dev, blockio_t *io);
 void free_map(map_t *map);
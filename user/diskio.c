@@ -4,6 +4,8 @@
 #include <linux/fs.h> // for BLKGETSIZE
 #include <sys/ioctl.h>
 #include <sys/stat.h>
+#include <sys/uio.h>
+#include <limits.h>
 #include "trace.h"
 #include "diskio.h"
 
@@ -29,6 +31,48 @@ int ioabs(int fd, void *data, size_t count, int out, off_t offset)
 	return 0;
 }
 
+/* Step an iovec array past bytes already transferred, return vectors left */
+unsigned iovskip(struct iovec **iov, unsigned *iovcnt, size_t bytes)
+{
+	struct iovec *vec = *iov;
+	unsigned count = *iovcnt;
+	while (count && bytes >= vec->iov_len) {
+		bytes -= vec->iov_len;
+		vec++;
+		count--;
+	}
+	if (count) {
+		vec->iov_base += bytes;
+		vec->iov_len -= bytes;
+	}
+	*iov = vec;
+	*iovcnt = count;
+	return count;
+}
+
+/* Like ioabs, but scatter/gather; consumes the iovec array */
+int ioabsv(int fd, struct iovec *iov, unsigned iovcnt, int out, off_t offset)
+{
+	while (iovcnt) {
+		unsigned vecs = iovcnt < IOV_MAX ? iovcnt : IOV_MAX;
+		ssize_t ret;
+		if (out)
+			ret = pwritev(fd, iov, vecs, offset);
+		else
+			ret = preadv(fd, iov, vecs, offset);
+		if (ret == -1) {
+			if (errno == EAGAIN || errno == EINTR)
+				continue;
+			return -errno;
+		}
+		if (ret == 0)
+			return -EIO;
+		offset += ret;
+		iovskip(&iov, &iovcnt, ret);
+	}
+	return 0;
+}
+
 static int iorel(int fd, void *data, size_t count, int out)
 {
 	while (count) {
@@ -3,8 +3,11 @@
 
 #include <inttypes.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 
 int ioabs(int fd, void *data, size_t count, int out, off_t offset);
+unsigned iovskip(struct iovec **iov, unsigned *iovcnt, size_t bytes);
+int ioabsv(int fd, struct iovec *iov, unsigned iovcnt, int out, off_t offset);
 int diskread(int fd, void *data, size_t count, off_t offset);
 int diskwrite(int fd, void *data, size_t count, off_t offset);
 int streamread(int fd, void *data, size_t count);
@@ -55,21 +55,26 @@ struct buffer_head *blockdirty(struct buffer_head *buffer, unsigned newdelta)
  * For read (essentially readahead):
  *  - stop at first present buffer
  *  - stop at end of file
+ *  - stop at the readahead window of the map, one block if not sequential
  *
- * For both, stop when extent is "big enough", whatever that means.
+ * For write, stop at MAX_REGION_BITS worth of blocks.
  */
+#define MAX_REGION_BITS 22 /* 4MB */
+
 static void guess_region(struct buffer_head *buffer, block_t *start, unsigned *count, int write)
 {
 	struct inode *inode = buffer_inode(buffer);
 	block_t ends[2] = { bufindex(buffer), bufindex(buffer) };
+	struct sb *sb = tux_sb(inode->i_sb);
+	unsigned max = write ? 1 << (MAX_REGION_BITS - sb->blockbits) : readahead_window(buffer->map);
 	for (int up = !write; up < 2; up++) {
-		while (ends[1] - ends[0] + 1 < MAX_EXTENT) {
+		while (ends[1] - ends[0] + 1 < max) {
 			block_t next = ends[up] + (up ? 1 : -1);
 			struct buffer_head *nextbuf = peekblk(buffer->map, next);
 			if (!nextbuf) {
 				if (write)
 					break;
-				if (next > inode->i_size >> tux_sb(inode->i_sb)->blockbits)
+				if (next > inode->i_size >> sb->blockbits)
 					break;
 			} else {
 				unsigned stop = write ? !buffer_dirty(nextbuf) : !buffer_empty(nextbuf);
@@ -84,6 +89,52 @@ static void guess_region(struct buffer_head *buffer, block_t *start, unsigned *c
 	*count = ends[1] + 1 - ends[0];
 }
 
+/* Segs of a region, grown as map_segvec() needs more */
+struct segvec {
+	struct seg *map;
+	unsigned segs, size;
+	int err;		/* Why mapping stopped short, if it did */
+};
+
+#define SEGVEC_MIN 16
+
+/*
+ * Map a region of any size.  One map_region() does not go past the dleaf
+ * it starts in, nor create more than one extent per hole, so map a leaf
+ * at a time, and when creating at most the longest extent at a time.
+ * If a later chunk fails, return what was mapped before it, which may
+ * already be in the dtree, and keep the error in vec->err.
+ */
+static int map_segvec(struct inode *inode, block_t start, unsigned count, struct segvec *vec, int create)
+{
+	unsigned chunk = create ? dtree_max_extent(tux_sb(inode->i_sb)) : count;
+
+	while (count) {
+		if (vec->size - vec->segs < SEGVEC_MIN) {
+			unsigned size = vec->size ? 2 * vec->size : SEGVEC_MIN;
+			struct seg *map = realloc(vec->map, size * sizeof(*map));
+			if (!map) {
+				vec->err = -ENOMEM;
+				break;
+			}
+			vec->map = map;
+			vec->size = size;
+		}
+		struct seg *map = vec->map + vec->segs;
+		int segs = map_region(inode, start, min(count, chunk), map, vec->size - vec->segs, create);
+		if (segs <= 0) {
+			vec->err = segs;
+			break;
+		}
+		vec->segs += segs;
+		for (int i = 0; i < segs; i++) {
+			start += map[i].count;
+			count -= map[i].count;
+		}
+	}
+	return vec->segs ? : vec->err;
+}
+
 int filemap_extent_io(struct buffer_head *buffer, int write)
 {
 	struct inode *inode = buffer_inode(buffer);
@@ -103,13 +154,13 @@ int filemap_extent_io(struct buffer_head *buffer, int write)
 	guess_region(buffer, &start, &count, write);
 	printf("---- extent 0x%Lx/%x ----\n", (L)start, count);
 
-	struct seg map[10];
-
-	int segs = map_region(inode, start, count, map, ARRAY_SIZE(map), write);
-	if (segs < 0)
-		return segs;
-
-	if (!segs) {
+	struct segvec segvec = { };
+	int segs = map_segvec(inode, start, count, &segvec, write);
+	struct seg *map = segvec.map;
+	if (segs <= 0) {
+		free(map);
+		if (segs < 0)
+			return segs;
 		if (!write) {
 			trace("unmapped block %Lx", (L)bufindex(buffer));
 			memset(bufdata(buffer), 0, sb->blocksize);
@@ -119,27 +170,45 @@ int filemap_extent_io(struct buffer_head *buffer, int write)
 		return -EIO;
 	}
 
-	int err = 0;
-	for (int i = 0, index = start; !err && i < segs; i++) {
+	/* One request per physical run, all in flight, then wait for them */
+	struct bufvec *vec = malloc(count * sizeof(*vec));
+	if (!vec) {
+		free(map);
+		return -ENOMEM;
+	}
+	block_t want = bufindex(buffer);
+	unsigned n = 0;
+	block_t index = start;
+	for (int i = 0; i < segs; i++) {
 		int hole = map[i].state == SEG_HOLE;
 		trace_on("extent 0x%Lx/%x => %Lx", (L)index, map[i].count, (L)map[i].block);
-		for (int j = 0; !err && j < map[i].count; j++) {
+		for (int j = 0; j < map[i].count; j++) {
 			block_t block = map[i].block + j;
 			buffer = blockget(mapping(inode), index + j);
-			trace_on("block 0x%Lx => %Lx", (L)bufindex(buffer), (L)block);
-			if (write) {
-				err = blockio(WRITE, buffer, block);
-			} else {
-				if (hole)
-					memset(bufdata(buffer), 0, sb->blocksize);
-				else
-					err = blockio(READ, buffer, block);
+			trace_off("block 0x%Lx => %Lx", (L)bufindex(buffer), (L)block);
+			if (!write && hole) {
+				memset(bufdata(buffer), 0, sb->blocksize);
+				set_buffer_clean(buffer);
+				blockput(buffer);
+				continue;
 			}
-			blockput(set_buffer_clean(buffer)); // leave empty if error ???
+			if (!write && index + j != want)
+				set_buffer_readahead(buffer);
+			vec[n++] = (struct bufvec){ .buffer = buffer, .block = block };
 		}
 		index += map[i].count;
 	}
-	return err;
+	struct iobatch batch = IOBATCH_INIT;
+	int err = submit_bufvec(vec, n, write, &batch, 1);
+	for (unsigned i = 0; i < n; i++)
+		blockput(vec[i].buffer);
+	free(vec);
+	free(map);
+	int ioerr = wait_iobatch(&batch);
+	/* mapping stopped short of the buffer asked for */
+	if (!err && want >= index)
+		err = segvec.err ? : -EIO;
+	return err ? : ioerr;
 }
 
 /*
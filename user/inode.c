@@ -66,6 +66,8 @@ static void free_inode(struct inode *inode)
 	assert(list_empty(&inode->list));
 	assert(!inode->state);
 	assert(mapping(inode)); /* some inodes are not malloced */
+	release_finger(&inode->btree);
+	drop_extent_cache(inode);
 	free_map(mapping(inode)); // invalidate dirty buffers!!!
 	if (inode->xcache)
 		free(inode->xcache);
@@ -80,12 +82,20 @@ static void tux_setup_inode(struct inode *inode)
 	switch (inode->inum) {
 	case TUX_VOLMAP_INO:
 		/* use default handler */
+		set_map_pool(inode->map, BUFFER_POOL_META);
 		break;
 	case TUX_LOGMAP_INO:
 		inode->map->io = dev_errio;
+		set_map_pool(inode->map, BUFFER_POOL_META);
+		break;
+	case TUX_BITMAP_INO:
+		inode->map->io = filemap_extent_io;
+		set_map_pool(inode->map, BUFFER_POOL_META);
 		break;
 	default:
 		inode->map->io = filemap_extent_io;
+		if (S_ISDIR(inode->i_mode))
+			set_map_pool(inode->map, BUFFER_POOL_META);
 		break;
 	}
 }
@@ -0,0 +1,195 @@
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include "tux3user.h"
+#include "diskio.h"
+#include "iotrace.h"
+
+/*
+ * Records collect in memory and go out a batch at a time under the trace
+ * lock, completions run on whatever thread reaps them.  The block size is
+ * only known once the first transfer comes through, so the header is
+ * written again then.  A closed trace costs a load per transfer.
+ */
+
+#define IOTRACE_BATCH 1024
+
+const char *iotrace_names[IOTRACE_KINDS] = {
+	[IOTRACE_DATA] = "data",
+	[IOTRACE_BNODE] = "bnode",
+	[IOTRACE_ILEAF] = "ileaf",
+	[IOTRACE_DLEAF] = "dleaf",
+	[IOTRACE_BITMAP] = "bitmap",
+	[IOTRACE_LOG] = "log",
+	[IOTRACE_SUPER] = "super",
+};
+
+static pthread_mutex_t iotrace_lock = PTHREAD_MUTEX_INITIALIZER;
+static int iotrace_fd = -1;
+static unsigned long long iotrace_start;
+static struct iotrace_header iotrace_header;
+static struct iotrace_record iotrace_batch[IOTRACE_BATCH];
+static unsigned iotrace_count;
+static off_t iotrace_pos;
+
+static void iotrace_flush(void)
+{
+	size_t bytes = iotrace_count * sizeof(*iotrace_batch);
+	int err = diskwrite(iotrace_fd, iotrace_batch, bytes, iotrace_pos);
+	if (err)
+		warn("lost io trace records (%s)", strerror(-err));
+	else
+		iotrace_pos += bytes;
+	iotrace_count = 0;
+}
+
+int iotrace_open(const char *path)
+{
+	int fd = open(path, O_CREAT|O_TRUNC|O_WRONLY, S_IRUSR|S_IWUSR);
+	if (fd < 0)
+		return -errno;
+	pthread_mutex_lock(&iotrace_lock);
+	if (iotrace_fd >= 0) {
+		pthread_mutex_unlock(&iotrace_lock);
+		close(fd);
+		return -EBUSY;
+	}
+	iotrace_header = (struct iotrace_header){ .magic = IOTRACE_MAGIC, .version = IOTRACE_VERSION };
+	int err = diskwrite(fd, &iotrace_header, sizeof(iotrace_header), 0);
+	if (err) {
+		pthread_mutex_unlock(&iotrace_lock);
+		close(fd);
+		return err;
+	}
+	iotrace_start = io_clock();
+	iotrace_pos = sizeof(iotrace_header);
+	iotrace_count = 0;
+	__atomic_store_n(&iotrace_fd, fd, __ATOMIC_RELEASE);
+	pthread_mutex_unlock(&iotrace_lock);
+	static int registered;
+	if (!registered++)
+		atexit(iotrace_close);
+	return 0;
+}
+
+void iotrace_close(void)
+{
+	pthread_mutex_lock(&iotrace_lock);
+	if (iotrace_fd >= 0) {
+		if (iotrace_count)
+			iotrace_flush();
+		close(iotrace_fd);
+		__atomic_store_n(&iotrace_fd, -1, __ATOMIC_RELEASE);
+	}
+	pthread_mutex_unlock(&iotrace_lock);
+}
+
+/* What a block holds, by the inode that owns it or what it looks like */
+static enum iotrace_kind iotrace_kind(struct buffer_head *buffer)
+{
+	struct inode *inode = buffer->map->inode;
+	if (!inode)
+		return IOTRACE_DATA;
+	switch (inode->inum) {
+	case TUX_BITMAP_INO:
+		return IOTRACE_BITMAP;
+	case TUX_LOGMAP_INO:
+		return IOTRACE_LOG;
+	case TUX_VOLMAP_INO:
+		switch (from_be_u16(*(be_u16 *)bufdata(buffer))) {
+		case TUX3_MAGIC_ILEAF:
+			return IOTRACE_ILEAF;
+		case TUX3_MAGIC_DLEAF:
+		case TUX3_MAGIC_DLEAF_WIDE:
+			return IOTRACE_DLEAF;
+		case TUX3_MAGIC_LOG:
+			return IOTRACE_LOG;
+		}
+		return IOTRACE_BNODE;
+	}
+	return IOTRACE_DATA;
+}
+
+static void iotrace_add(int write, loff_t offset, unsigned bytes, uint64_t inum,
+			enum iotrace_kind kind, unsigned long long start, unsigned usecs)
+{
+	if (iotrace_count == IOTRACE_BATCH)
+		iotrace_flush();
+	iotrace_batch[iotrace_count++] = (struct iotrace_record){
+		.time = start - iotrace_start, .offset = offset, .inum = inum,
+		.bytes = bytes, .write = !!write, .kind = kind,
+		.usecs = usecs < UINT16_MAX ? usecs : UINT16_MAX,
+	};
+}
+
+/* Record a completed transfer, of buffers if any or of raw device bytes */
+void iotrace_io(int write, struct dev *dev, loff_t offset, unsigned bytes,
+		struct buffer_head **buffers, unsigned count, unsigned long long start)
+{
+	if (__atomic_load_n(&iotrace_fd, __ATOMIC_ACQUIRE) < 0)
+		return;
+	unsigned usecs = (io_clock() - start) / 1000;
+	pthread_mutex_lock(&iotrace_lock);
+	if (iotrace_fd < 0)
+		goto out;
+	if (!iotrace_header.blockbits && dev->bits) {
+		iotrace_header.blockbits = dev->bits;
+		int err = diskwrite(iotrace_fd, &iotrace_header, sizeof(iotrace_header), 0);
+		if (err)
+			warn("unable to write io trace header (%s)", strerror(-err));
+	}
+	if (!count) {
+		iotrace_add(write, offset, bytes, IOTRACE_NOINODE, IOTRACE_SUPER, start, usecs);
+		goto out;
+	}
+	for (unsigned i = 0, j; i < count; i = j) {
+		struct inode *inode = buffers[i]->map->inode;
+		enum iotrace_kind kind = iotrace_kind(buffers[i]);
+		bytes = bufsize(buffers[i]);
+		for (j = i + 1; j < count && buffers[j]->map == buffers[i]->map &&
+		     iotrace_kind(buffers[j]) == kind; j++)
+			bytes += bufsize(buffers[j]);
+		iotrace_add(write, offset, bytes, inode ? inode->inum : IOTRACE_NOINODE, kind, start, usecs);
+		offset += bytes;
+	}
+out:
+	pthread_mutex_unlock(&iotrace_lock);
+}
+
+/* Read a whole trace into memory, the caller frees the records */
+int iotrace_load(const char *path, struct iotrace_header *header,
+		 struct iotrace_record **records, unsigned long *count)
+{
+	int fd = open(path, O_RDONLY), err = 0;
+	if (fd < 0)
+		return -errno;
+	struct stat stat;
+	if (fstat(fd, &stat)) {
+		err = -errno;
+		goto out;
+	}
+	if (stat.st_size < sizeof(*header) || (err = diskread(fd, header, sizeof(*header), 0)))
+		goto bad;
+	if (memcmp(header->magic, IOTRACE_MAGIC, sizeof(header->magic)) ||
+	    header->version != IOTRACE_VERSION)
+		goto bad;
+	*count = (stat.st_size - sizeof(*header)) / sizeof(**records);
+	*records = calloc(*count + 1, sizeof(**records));
+	if (!*records) {
+		err = -ENOMEM;
+		goto out;
+	}
+	if ((err = diskread(fd, *records, *count * sizeof(**records), sizeof(*header))))
+		free(*records);
+	goto out;
+bad:
+	if (!err)
+		err = -EINVAL;
+out:
+	close(fd);
+	return err;
+}
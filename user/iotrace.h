@@ -0,0 +1,62 @@
+#ifndef TUX3_IOTRACE_H
+#define TUX3_IOTRACE_H
+
+#include <stdint.h>
+#include <sys/types.h>
+
+/*
+ * Block io trace
+ *
+ * While a trace is open every transfer that completes through devio(),
+ * blockio() or a buffer batch is appended to the trace file as one
+ * fixed size record.  A transfer of buffers that hold different kinds of
+ * block is split into one record per run of the same kind.  The records
+ * are in host byte order, the trace is for looking at on the machine
+ * that took it.  tux3trace reads it back.
+ *
+ * Programs that set up a buffer cache open a trace named by TUX3_IOTRACE,
+ * tux3 also takes --trace=<file>.
+ */
+
+#define IOTRACE_MAGIC "tux3iot"
+#define IOTRACE_VERSION 1
+#define IOTRACE_NOINODE ((uint64_t)-1)
+
+enum iotrace_kind {
+	IOTRACE_DATA,	/* file, directory and table blocks */
+	IOTRACE_BNODE,	/* btree index nodes */
+	IOTRACE_ILEAF,	/* inode table leaves */
+	IOTRACE_DLEAF,	/* data extent leaves */
+	IOTRACE_BITMAP,	/* allocation bitmap */
+	IOTRACE_LOG,	/* commit log */
+	IOTRACE_SUPER,	/* superblock and anything else outside the cache */
+	IOTRACE_KINDS
+};
+
+struct iotrace_header {
+	char magic[8];
+	uint32_t version, blockbits;
+};
+
+struct iotrace_record {
+	uint64_t time;		/* nsecs from opening the trace to submission */
+	uint64_t offset;	/* bytes from the start of the volume */
+	uint64_t inum;		/* inode owning the blocks, or IOTRACE_NOINODE */
+	uint32_t bytes;
+	uint8_t write, kind;
+	uint16_t usecs;		/* until completion, saturates */
+};
+
+struct buffer_head;
+struct dev;
+
+extern const char *iotrace_names[IOTRACE_KINDS];
+
+int iotrace_open(const char *path);
+void iotrace_close(void);
+void iotrace_io(int write, struct dev *dev, loff_t offset, unsigned bytes,
+		struct buffer_head **buffers, unsigned count, unsigned long long start);
+int iotrace_load(const char *path, struct iotrace_header *header,
+		 struct iotrace_record **records, unsigned long *count);
+
+#endif /* !TUX3_IOTRACE_H */
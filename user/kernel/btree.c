@@ -23,10 +23,33 @@ struct root no_root = {
 
 struct bnode
 {
-	be_u32 count, unused;
+	be_u32 count;
+	be_u16 format, unused;
 	struct index_entry { be_u64 key; be_u64 block; } __packed entries[];
 } __packed;
 
+/*
+ * Compact index node, told apart from the original layout by format.
+ * Keys are stored as 32 bit offsets from a base key and block pointers
+ * in 48 bits, ten bytes an entry instead of sixteen.  The base is the
+ * lowest key the node can ever hold, its first separator when it was
+ * made: keys only go in after the first entry, and removing the first
+ * entry only raises the lowest key.  A key too far above the base to
+ * store turns the node back into the original layout, splitting it
+ * first if it would not fit.  Volumes made with SB_COMPACT_BNODE get
+ * compact nodes wherever the keys allow, other volumes never see one.
+ */
+struct cnode
+{
+	be_u32 count;
+	be_u16 format, unused;
+	be_u64 base;
+	struct cnode_entry { be_u32 key; be_u16 hi; be_u32 lo; } __packed entries[];
+} __packed;
+
+#define BNODE_COMPACT 1
+#define CNODE_KEY_MAX ((u32)~0)
+
 /*
  * Note that the first key of an index block is never accessed.  This is
  * because for a btree, there is always one more key than nodes in each
@@ -41,11 +64,203 @@ unsigned calc_entries_per_node(unsigned blocksize)
 	return (blocksize - sizeof(struct bnode)) / sizeof(struct index_entry);
 }
 
+static unsigned calc_entries_per_cnode(unsigned blocksize)
+{
+	return (blocksize - sizeof(struct cnode)) / sizeof(struct cnode_entry);
+}
+
 static inline unsigned bcount(struct bnode *node)
 {
 	return from_be_u32(node->count);
 }
 
+static inline int bnode_compact(struct bnode *node)
+{
+	return node->format == to_be_u16(BNODE_COMPACT);
+}
+
+static inline struct cnode *cnode(struct bnode *node)
+{
+	return (struct cnode *)node;
+}
+
+static inline tuxkey_t bnode_key(struct bnode *node, unsigned i)
+{
+	if (bnode_compact(node))
+		return from_be_u64(cnode(node)->base) + from_be_u32(cnode(node)->entries[i].key);
+	return from_be_u64(node->entries[i].key);
+}
+
+static inline block_t bnode_block(struct bnode *node, unsigned i)
+{
+	if (bnode_compact(node)) {
+		struct cnode_entry *entry = cnode(node)->entries + i;
+		return (block_t)from_be_u16(entry->hi) << 32 | from_be_u32(entry->lo);
+	}
+	return from_be_u64(node->entries[i].block);
+}
+
+/* Can the node hold this key as it is */
+static inline int bnode_key_fits(struct bnode *node, tuxkey_t key)
+{
+	return !bnode_compact(node) || key - from_be_u64(cnode(node)->base) <= CNODE_KEY_MAX;
+}
+
+static inline void bnode_set_key(struct bnode *node, unsigned i, tuxkey_t key)
+{
+	if (bnode_compact(node))
+		cnode(node)->entries[i].key = to_be_u32(key - from_be_u64(cnode(node)->base));
+	else
+		node->entries[i].key = to_be_u64(key);
+}
+
+static inline void bnode_set_block(struct bnode *node, unsigned i, block_t block)
+{
+	if (bnode_compact(node)) {
+		struct cnode_entry *entry = cnode(node)->entries + i;
+		entry->hi = to_be_u16(block >> 32);
+		entry->lo = to_be_u32(block);
+	} else
+		node->entries[i].block = to_be_u64(block);
+}
+
+static inline void bnode_set(struct bnode *node, unsigned i, tuxkey_t key, block_t block)
+{
+	bnode_set_key(node, i, key);
+	bnode_set_block(node, i, block);
+}
+
+static inline unsigned bnode_entry_size(struct bnode *node)
+{
+	return bnode_compact(node) ? sizeof(struct cnode_entry) : sizeof(struct index_entry);
+}
+
+static inline void *bnode_entry(struct bnode *node, unsigned i)
+{
+	if (bnode_compact(node))
+		return cnode(node)->entries + i;
+	return node->entries + i;
+}
+
+/* Move count entries within a node from one position to another */
+static void bnode_move(struct bnode *node, unsigned to, unsigned from, unsigned count)
+{
+	memmove(bnode_entry(node, to), bnode_entry(node, from), count * bnode_entry_size(node));
+}
+
+/* Entries a node of either layout holds on this volume */
+static unsigned bnode_capacity(struct sb *sb, struct bnode *node)
+{
+	return bnode_compact(node) ? calc_entries_per_cnode(sb->blocksize) : sb->entries_per_node;
+}
+
+static inline int compact_bnodes(struct sb *sb)
+{
+	return !!(from_be_u64(sb->super.flags) & SB_COMPACT_BNODE);
+}
+
+/*
+ * Start an empty node for keys from base up to top, compact if the volume
+ * wants that and the range fits.
+ */
+static void bnode_init(struct sb *sb, struct bnode *node, tuxkey_t base, tuxkey_t top)
+{
+	node->count = 0;
+	node->format = 0;
+	if (compact_bnodes(sb) && top - base <= CNODE_KEY_MAX) {
+		node->format = to_be_u16(BNODE_COMPACT);
+		cnode(node)->base = to_be_u64(base);
+	}
+}
+
+/*
+ * Rewrite a compact node in the original layout, in place.  Wide entries
+ * from the third on only overlap compact entries at or above their own
+ * index, so those are done from the top down and the first two saved.
+ */
+static void bnode_widen(struct bnode *node)
+{
+	unsigned count = bcount(node);
+	tuxkey_t keys[2];
+	block_t blocks[2];
+
+	assert(bnode_compact(node));
+	for (unsigned i = 0; i < 2 && i < count; i++) {
+		keys[i] = bnode_key(node, i);
+		blocks[i] = bnode_block(node, i);
+	}
+	for (unsigned i = count; i-- > 2;) {
+		tuxkey_t key = bnode_key(node, i);
+		block_t block = bnode_block(node, i);
+		node->entries[i] = (struct index_entry){
+			.key = to_be_u64(key), .block = to_be_u64(block) };
+	}
+	for (unsigned i = 0; i < 2 && i < count; i++)
+		node->entries[i] = (struct index_entry){
+			.key = to_be_u64(keys[i]), .block = to_be_u64(blocks[i]) };
+	node->format = 0;
+}
+
+/*
+ * Make room to add key to a node if it can be done without a split,
+ * widening a compact node that cannot store the key.
+ */
+static int bnode_room(struct sb *sb, struct bnode *node, tuxkey_t key)
+{
+	unsigned count = bcount(node);
+
+	if (bnode_key_fits(node, key))
+		return count < bnode_capacity(sb, node);
+	if (count >= sb->entries_per_node)
+		return 0;
+	bnode_widen(node);
+	return 1;
+}
+
+/*
+ * Find the entry after the one whose subtree holds key: the first entry
+ * past the first with a greater key, or the end of the node.  The first
+ * key is never looked at.  Each step halves the range by adding the
+ * outcome of the compare instead of branching on it, so a lookup costs
+ * log2(count) key loads with no mispredicts however the keys fall.
+ * Compact nodes are searched the same way on the offsets from the base.
+ */
+static unsigned cnode_lookup(struct cnode *node, tuxkey_t key, unsigned count)
+{
+	struct cnode_entry *base = node->entries + 1;
+	tuxkey_t low = from_be_u64(node->base);
+
+	if (key < low)
+		return 1;
+	if (key - low > CNODE_KEY_MAX)
+		return count + 1;
+	u32 delta = key - low;
+	while (count > 1) {
+		unsigned half = count / 2;
+		base += half * (from_be_u32(base[half - 1].key) <= delta);
+		count -= half;
+	}
+	return base - node->entries + (from_be_u32(base->key) <= delta);
+}
+
+static unsigned bnode_lookup(struct bnode *node, tuxkey_t key)
+{
+	struct index_entry *base = node->entries + 1;
+	unsigned count = bcount(node);
+
+	if (count <= 1)
+		return 1;
+	count--;
+	if (bnode_compact(node))
+		return cnode_lookup(cnode(node), key, count);
+	while (count > 1) {
+		unsigned half = count / 2;
+		base += half * (from_be_u64(base[half - 1].key) <= key);
+		count -= half;
+	}
+	return base - node->entries + (from_be_u64(base->key) <= key);
+}
+
 static struct buffer_head *new_block(struct btree *btree)
 {
 	block_t block;
@@ -85,8 +300,8 @@ static struct buffer_head *new_node(struct btree *btree)
 /*
  * A btree cursor has n + 1 entries for a btree of depth n, with the first n
  * entries pointing at internal nodes and entry n + 1 pointing at a leaf.
- * The next field points at the next index entry that will be loaded in a left
- * to right tree traversal, not the current entry.  The next pointer is null
+ * The next field is the index of the next entry that will be loaded in a left
+ * to right tree traversal, not the current entry.  The next index is zero
  * for the leaf, which has its own specialized traversal algorithms.
  */
 
@@ -102,7 +317,7 @@ struct buffer_head *cursor_leafbuf(struct cursor *cursor)
 }
 
 static void level_root_add(struct cursor *cursor, struct buffer_head *buffer,
-			   struct index_entry *next)
+			   int next)
 {
 #ifdef CURSOR_DEBUG
 	assert(cursor->len < cursor->maxlen);
@@ -115,7 +330,7 @@ static void level_root_add(struct cursor *cursor, struct buffer_head *buffer,
 	cursor->path[0].next = next;
 }
 
-static void level_replace_blockput(struct cursor *cursor, int level, struct buffer_head *buffer, struct index_entry *next)
+static void level_replace_blockput(struct cursor *cursor, int level, struct buffer_head *buffer, int next)
 {
 #ifdef CURSOR_DEBUG
 	assert(buffer);
@@ -128,7 +343,7 @@ static void level_replace_blockput(struct cursor *cursor, int level, struct buff
 	cursor->path[level].next = next;
 }
 
-void level_push(struct cursor *cursor, struct buffer_head *buffer, struct index_entry *next)
+void level_push(struct cursor *cursor, struct buffer_head *buffer, int next)
 {
 #ifdef CURSOR_DEBUG
 	assert(cursor->len < cursor->maxlen);
@@ -163,9 +378,7 @@ static void level_pop_blockput(struct cursor *cursor)
 
 static inline int level_finished(struct cursor *cursor, int level)
 {
-	struct bnode *node = cursor_node(cursor, level);
-
-	return cursor->path[level].next == node->entries + bcount(node);
+	return cursor->path[level].next == bcount(cursor_node(cursor, level));
 }
 // also write level_beginning!!!
 
@@ -196,11 +409,12 @@ static void cursor_check(struct cursor *cursor)
 		if (!cursor->path[i].next)
 			break;
 		struct bnode *node = cursor_node(cursor, i);
-		assert(node->entries < cursor->path[i].next);
-		assert(cursor->path[i].next <= node->entries + bcount(node));
-		assert(from_be_u64((cursor->path[i].next - 1)->key) >= key);
-		block = from_be_u64((cursor->path[i].next - 1)->block);
-		key = from_be_u64((cursor->path[i].next - 1)->key);
+		int next = cursor->path[i].next;
+		assert(0 < next);
+		assert(next <= bcount(node));
+		assert(bnode_key(node, next - 1) >= key);
+		block = bnode_block(node, next - 1);
+		key = bnode_key(node, next - 1);
 	}
 }
 
@@ -217,8 +431,10 @@ struct cursor *alloc_cursor(struct btree *btree, int extra)
 	if (cursor) {
 		cursor->btree = btree;
 		cursor->len = 0;
-#ifdef CURSOR_DEBUG
+		cursor->prefetch = 0;
+		cursor->ahead = 0;
 		cursor->maxlen = maxlevel;
+#ifdef CURSOR_DEBUG
 		for (int i = 0; i < maxlevel; i++) {
 			cursor->path[i].buffer = FREE_BUFFER; /* for debug */
 			cursor->path[i].next = FREE_NEXT; /* for debug */
@@ -236,6 +452,110 @@ void free_cursor(struct cursor *cursor)
 	free(cursor);
 }
 
+/*
+ * Finger search.  Each btree keeps a copy of the path its last probe took,
+ * holding a reference to every block on it.  Most probes land next to the
+ * one before, so a probe starts from the deepest node of that path whose
+ * key range still covers the new key instead of from the root, and only
+ * reads and searches the levels below it.  Anything that changes an index
+ * node bumps btree->gen, and a finger taken at an older generation is not
+ * used again.  Whoever frees index blocks or the btree itself has to
+ * release the finger first, it would keep their buffers busy.
+ */
+static inline void btree_changed(struct btree *btree)
+{
+	btree->gen++;
+}
+
+void release_finger(struct btree *btree)
+{
+	struct cursor *finger;
+
+	if (!btree->finger)
+		return;
+	spin_lock(&btree->finger_lock);
+	finger = btree->finger;
+	btree->finger = NULL;
+	if (finger)
+		release_cursor(finger);
+	spin_unlock(&btree->finger_lock);
+	if (finger)
+		free_cursor(finger);
+}
+
+/*
+ * Push the levels of the finger above the deepest node covering key onto
+ * the cursor and return that node, or NULL to start from the root.  A
+ * child covers the keys from its own separator up to the next one, the
+ * first entry's key is never looked at, so a key inside both separators
+ * would take the same way down again.
+ */
+static struct buffer_head *finger_start(struct cursor *cursor, tuxkey_t key)
+{
+	struct btree *btree = cursor->btree;
+	struct buffer_head *buffer = NULL;
+	struct cursor *finger;
+	int level;
+
+	spin_lock(&btree->finger_lock);
+	finger = btree->finger;
+	if (!finger || btree->finger_gen != btree->gen ||
+	    finger->len != btree->root.depth + 1)
+		goto out;
+	for (level = 0; level < finger->len - 1; level++) {
+		struct bnode *node = cursor_node(finger, level);
+		int next = finger->path[level].next;
+		if ((next > 1 && key < bnode_key(node, next - 1)) ||
+		    (next < bcount(node) && key >= bnode_key(node, next)))
+			break;
+		get_bh(finger->path[level].buffer);
+		level_push(cursor, finger->path[level].buffer, next);
+	}
+	buffer = finger->path[level].buffer;
+	get_bh(buffer);
+	trace("finger covers %Lx from level %i", (L)key, level);
+out:
+	spin_unlock(&btree->finger_lock);
+	return buffer;
+}
+
+/* Make the finger the path just probed, keeping references it already has */
+static void finger_update(struct cursor *cursor)
+{
+	struct btree *btree = cursor->btree;
+	struct cursor *finger = btree->finger, *spare = NULL;
+
+	if (!finger || finger->maxlen < cursor->len)
+		if (!(spare = alloc_cursor(btree, 0)))
+			return;
+	spin_lock(&btree->finger_lock);
+	finger = btree->finger;
+	if (!finger || finger->maxlen < cursor->len) {
+		if (finger)
+			release_cursor(finger);
+		btree->finger = spare;
+		spare = finger;
+		finger = btree->finger;
+	}
+	while (finger->len > cursor->len)
+		level_pop_blockput(finger);
+	for (int i = 0; i < cursor->len; i++) {
+		struct path_level *at = cursor->path + i;
+		if (i == finger->len) {
+			get_bh(at->buffer);
+			level_push(finger, at->buffer, at->next);
+		} else if (finger->path[i].buffer != at->buffer) {
+			get_bh(at->buffer);
+			level_replace_blockput(finger, i, at->buffer, at->next);
+		} else
+			finger->path[i].next = at->next;
+	}
+	btree->finger_gen = btree->gen;
+	spin_unlock(&btree->finger_lock);
+	if (spare)
+		free_cursor(spare);
+}
+
 int probe(struct cursor *cursor, tuxkey_t key)
 {
 	struct btree *btree = cursor->btree;
@@ -243,31 +563,64 @@ int probe(struct cursor *cursor, tuxkey_t key)
 	struct buffer_head *buffer;
 
 	assert(has_root(btree));
-	buffer = vol_bread(btree->sb, btree->root.block);
-	if (!buffer)
+	cursor->ahead = 0;
+	buffer = finger_start(cursor, key);
+	if (!buffer && !(buffer = vol_bread(btree->sb, btree->root.block)))
 		return -EIO;
 	struct bnode *node = bufdata(buffer);
 
-	for (i = 0; i < depth; i++) {
-		struct index_entry *next = node->entries, *top = next + bcount(node);
-		while (++next < top) /* binary search goes here */
-			if (from_be_u64(next->key) > key)
-				break;
-		trace("probe level %i, %ti of %i", i, next - node->entries, bcount(node));
+	for (i = cursor->len; i < depth; i++) {
+		unsigned next = bnode_lookup(node, key);
+		trace("probe level %i, %u of %i", i, next, bcount(node));
 		level_push(cursor, buffer, next);
-		if (!(buffer = vol_bread(btree->sb, from_be_u64((next - 1)->block))))
+		if (!(buffer = vol_bread(btree->sb, bnode_block(node, next - 1))))
 			goto eek;
 		node = (struct bnode *)bufdata(buffer);
 	}
 	assert((btree->ops->leaf_sniff)(btree, bufdata(buffer)));
-	level_push(cursor, buffer, NULL);
+	level_push(cursor, buffer, 0);
 	cursor_check(cursor);
+	finger_update(cursor);
 	return 0;
 eek:
 	release_cursor(cursor);
 	return -EIO; /* stupid, it might have been NOMEM */
 }
 
+/*
+ * Leaf prefetch.  A cursor set to prefetch reads that many leaves ahead
+ * of a scan, through the entries of the index node above the leaves, and
+ * sends out the next batch when the scan has used up half the last one.
+ * The scan then mostly finds its next leaf already read or in flight.
+ * Prefetch does not look past the end of that index node, the next one
+ * is read when the scan gets there.
+ */
+void cursor_prefetch(struct cursor *cursor, unsigned leaves)
+{
+	cursor->prefetch = leaves < CURSOR_PREFETCH_MAX ? leaves : CURSOR_PREFETCH_MAX;
+	cursor->ahead = 0;
+}
+
+static void prefetch_leaves(struct cursor *cursor, int level)
+{
+	struct bnode *node = cursor_node(cursor, level);
+	int next = cursor->path[level].next, end = bcount(node);
+	int from = cursor->ahead, to = next + cursor->prefetch;
+	block_t blocks[CURSOR_PREFETCH_MAX];
+	unsigned count = 0;
+
+	if (!from || from < next || from > end)
+		from = next;
+	if (from - next > cursor->prefetch / 2)
+		return;
+	if (to > end)
+		to = end;
+	for (cursor->ahead = to; from < to; from++)
+		blocks[count++] = bnode_block(node, from);
+	if (count)
+		vol_prefetch(cursor->btree->sb, blocks, count);
+}
+
 int advance(struct cursor *cursor)
 {
 	struct btree *btree = cursor->btree;
@@ -280,17 +633,21 @@ int advance(struct cursor *cursor)
 			return 0;
 		level--;
 	} while (level_finished(cursor, level));
+	if (level + 1 < depth)
+		cursor->ahead = 0;
 	while (1) {
-		buffer = vol_bread(btree->sb, from_be_u64(cursor->path[level].next->block));
+		if (level + 1 == depth && cursor->prefetch)
+			prefetch_leaves(cursor, level);
+		buffer = vol_bread(btree->sb, bnode_block(cursor_node(cursor, level), cursor->path[level].next));
 		if (!buffer)
 			return -EIO;
 		cursor->path[level].next++;
 		if (level + 1 == depth)
 			break;
-		level_push(cursor, buffer, ((struct bnode *)bufdata(buffer))->entries);
+		level_push(cursor, buffer, 0);
 		level++;
 	}
-	level_push(cursor, buffer, NULL);
+	level_push(cursor, buffer, 0);
 	cursor_check(cursor);
 	return 1;
 }
@@ -300,19 +657,12 @@ int advance(struct cursor *cursor)
  * all the way to the end of the index block, there we find the key that
  * separates the subtree we are in (a leaf) from the next subtree to the right.
  */
-static be_u64 *next_keyp(struct cursor *cursor, int depth)
+tuxkey_t next_key(struct cursor *cursor, int depth)
 {
 	for (int level = depth; level--;)
 		if (!level_finished(cursor, level))
-			return &cursor->path[level].next->key;
-	return NULL;
-}
-
-tuxkey_t next_key(struct cursor *cursor, int depth)
-{
-	be_u64 *keyp = next_keyp(cursor, depth);
-
-	return keyp ? from_be_u64(*keyp) : -1;
+			return bnode_key(cursor_node(cursor, level), cursor->path[level].next);
+	return -1;
 }
 // also write this_key!!!
 
@@ -325,6 +675,7 @@ void show_tree_range(struct btree *btree, tuxkey_t start, unsigned count)
 	struct cursor *cursor = alloc_cursor(btree, 0);
 	if (!cursor)
 		error("out of memory");
+	cursor_prefetch(cursor, CURSOR_PREFETCH);
 	if (probe(cursor, start))
 		error("tell me why!!!");
 	struct buffer_head *buffer;
@@ -346,14 +697,9 @@ void show_tree(struct btree *btree)
 static void level_redirect_blockput(struct cursor *cursor, int level, struct buffer_head *clone)
 {
 	struct buffer_head *buffer = cursor->path[level].buffer;
-	struct index_entry *next = cursor->path[level].next;
-
-	/* If this level has ->next, update ->next to the clone buffer */
-	if (next)
-		next = bufdata(clone) + ((void *)next - bufdata(buffer));
 
 	memcpy(bufdata(clone), bufdata(buffer), bufsize(clone));
-	level_replace_blockput(cursor, level, clone, next);
+	level_replace_blockput(cursor, level, clone, cursor->path[level].next);
 }
 
 int cursor_redirect(struct cursor *cursor)
@@ -371,6 +717,7 @@ int cursor_redirect(struct cursor *cursor)
 		if (buffer_dirty(buffer))
 			return 0;
 
+		btree_changed(btree);
 		/* Redirect buffer before changing */
 		struct buffer_head *clone = new_block(btree);
 		if (IS_ERR(clone))
@@ -393,9 +740,10 @@ int cursor_redirect(struct cursor *cursor)
 
 		/* Update entry for the redirected child block */
 		trace("update parent");
-		struct index_entry *entry = cursor->path[level].next - 1;
-		entry->block = to_be_u64(child);
-		log_bnode_update(sb, newblock, child, from_be_u64(entry->key));
+		struct bnode *node = cursor_node(cursor, level);
+		int entry = cursor->path[level].next - 1;
+		bnode_set_block(node, entry, child);
+		log_bnode_update(sb, newblock, child, bnode_key(node, entry));
 
 parent_level:
 		if (!level--) {
@@ -415,11 +763,11 @@ parent_level:
 static void remove_index(struct cursor *cursor, int level)
 {
 	struct bnode *node = cursor_node(cursor, level);
-	int count = bcount(node), i;
+	int count = bcount(node), next = cursor->path[level].next, i;
 
+	btree_changed(cursor->btree);
 	/* stomps the node count (if 0th key holds count) */
-	memmove(cursor->path[level].next - 1, cursor->path[level].next,
-		(char *)&node->entries[count] - (char *)cursor->path[level].next);
+	bnode_move(node, next - 1, next, count - next);
 	node->count = to_be_u32(count - 1);
 	--(cursor->path[level].next);
 	mark_buffer_dirty(cursor->path[level].buffer);
@@ -434,20 +782,40 @@ static void remove_index(struct cursor *cursor, int level)
 	 * Climb the cursor while at first entry, bail out at root
 	 * find the node with the old sep, set it to deleted key
 	 */
-	if (cursor->path[level].next == node->entries && level) {
-		be_u64 sep = (cursor->path[level].next)->key;
-		for (i = level - 1; cursor->path[i].next - 1 == cursor_node(cursor, i)->entries; i--)
+	if (cursor->path[level].next == 0 && level) {
+		tuxkey_t sep = bnode_key(node, 0);
+		for (i = level - 1; cursor->path[i].next - 1 == 0; i--)
 			if (!i)
 				return;
-		(cursor->path[i].next - 1)->key = sep;
+		/* a separator left lower than it could be is still right */
+		struct bnode *parent = cursor_node(cursor, i);
+		if (!bnode_key_fits(parent, sep))
+			return;
+		bnode_set_key(parent, cursor->path[i].next - 1, sep);
 		mark_buffer_dirty(cursor->path[i].buffer);
 	}
 }
 
-static void merge_nodes(struct bnode *node, struct bnode *node2)
+/*
+ * Append node2 to node if all of it fits, in either layout.  The first
+ * entry of node2 gets sep, the key that separated it from node above.
+ */
+static int merge_nodes(struct sb *sb, struct bnode *node, struct bnode *node2, tuxkey_t sep)
 {
-	veccopy(&node->entries[bcount(node)], node2->entries, bcount(node2));
-	node->count = to_be_u32(bcount(node) + bcount(node2));
+	unsigned count = bcount(node), count2 = bcount(node2);
+	tuxkey_t top = count2 > 1 ? bnode_key(node2, count2 - 1) : sep;
+
+	if (count2 && !bnode_key_fits(node, top)) {
+		if (count + count2 > sb->entries_per_node)
+			return 0;
+		bnode_widen(node);
+	}
+	if (count + count2 > bnode_capacity(sb, node))
+		return 0;
+	for (unsigned i = 0; i < count2; i++)
+		bnode_set(node, count + i, i ? bnode_key(node2, i) : sep, bnode_block(node2, i));
+	node->count = to_be_u32(count + count2);
+	return 1;
 }
 
 static void blockput_free(struct btree *btree, struct buffer_head *buffer)
@@ -466,7 +834,12 @@ static void blockput_free(struct btree *btree, struct buffer_head *buffer)
 	set_buffer_empty(buffer); // free it!!! (and need a buffer free state)
 }
 
-int tree_chop(struct btree *btree, struct delete_info *info, millisecond_t deadline)
+/*
+ * Walk the leaves from start to the end of the tree, chopping each at
+ * info->key unless info is NULL, and merge each leaf and index node into
+ * the one before it when it fits there.
+ */
+static int chop_and_merge(struct btree *btree, tuxkey_t start, struct delete_info *info)
 {
 	int depth = btree->root.depth, level = depth - 1, suspend = 0;
 	struct cursor *cursor;
@@ -479,33 +852,39 @@ int tree_chop(struct btree *btree, struct delete_info *info, millisecond_t deadl
 		return 0;
 
 	cursor = alloc_cursor(btree, 0);
+	cursor_prefetch(cursor, CURSOR_PREFETCH);
 	prev = malloc(sizeof(*prev) * depth);
 	memset(prev, 0, sizeof(*prev) * depth);
 
 	down_write(&btree->lock);
-	probe(cursor, info->key);	/* FIXME: info->resume? */
+	probe(cursor, start);	/* FIXME: info->resume? */
+	release_finger(btree);	/* blocks on its path may be freed */
+	if (info && ops == &dtree_ops)
+		drop_extent_cache(btree_inode(btree));	/* and so may extents */
 	leafbuf = level_pop(cursor);
 
 	/* leaf walk */
 	while (1) {
 		if ((ret = cursor_redirect(cursor)))
 			goto error_leaf_chop;
-		ret = (ops->leaf_chop)(btree, info->key, bufdata(leafbuf));
-		if (ret) {
-			if (ret < 0)
-				goto error_leaf_chop;
-			mark_buffer_dirty(leafbuf);
+		if (info) {
+			ret = (ops->leaf_chop)(btree, info->key, bufdata(leafbuf));
+			if (ret) {
+				if (ret < 0)
+					goto error_leaf_chop;
+				mark_buffer_dirty(leafbuf);
+			}
 		}
 
 		/* try to merge this leaf with prev */
-		if (leafprev) {
+		if (leafprev && ops->leaf_merge) {
 			struct vleaf *this = bufdata(leafbuf);
 			struct vleaf *that = bufdata(leafprev);
 			/* try to merge leaf with prev */
-			if ((ops->leaf_need)(btree, this) <= (ops->leaf_free)(btree, that)) {
-				trace(">>> can merge leaf %p into leaf %p", leafbuf, leafprev);
-				(ops->leaf_merge)(btree, that, this);
+			if ((ops->leaf_merge)(btree, that, this)) {
+				trace(">>> merged leaf %p into leaf %p", leafbuf, leafprev);
 				remove_index(cursor, level);
+				cursor->ahead = 0;
 				mark_buffer_dirty(leafprev);
 				blockput_free(btree, leafbuf);
 				//dirty_buffer_count_check(sb);
@@ -520,7 +899,7 @@ keep_prev_leaf:
 		//printf("time remaining: %Lx\n", deadline - gettime());
 //		if (deadline && gettime() > deadline)
 //			suspend = -1;
-		if (info->blocks && info->freed >= info->blocks)
+		if (info && info->blocks && info->freed >= info->blocks)
 			suspend = -1;
 
 		/* pop and try to merge finished nodes */
@@ -533,9 +912,10 @@ keep_prev_leaf:
 				trace_off("check node %p against %p", this, that);
 				trace_off("this count = %i prev count = %i", bcount(this), bcount(that));
 				/* try to merge with node to left */
-				if (bcount(this) <= sb->entries_per_node - bcount(that)) {
-					trace(">>> can merge node %p into node %p", this, that);
-					merge_nodes(that, this);
+				struct bnode *parent = cursor_node(cursor, level - 1);
+				tuxkey_t sep = bnode_key(parent, cursor->path[level - 1].next - 1);
+				if (merge_nodes(sb, that, this, sep)) {
+					trace(">>> merged node %p into node %p", this, that);
 					remove_index(cursor, level - 1);
 					mark_buffer_dirty(prev[level]);
 					blockput_free(btree, level_pop(cursor));
@@ -550,7 +930,7 @@ keep_prev_node:
 			/* deepest key in the cursor is the resume address */
 			if (suspend == -1 && !level_finished(cursor, level)) {
 				suspend = 1; /* only set resume once */
-				info->resume = from_be_u64((cursor->path[level].next)->key);
+				info->resume = bnode_key(cursor_node(cursor, level), cursor->path[level].next);
 			}
 			if (!level) { /* remove depth if possible */
 				while (depth > 1 && bcount(bufdata(prev[0])) == 1) {
@@ -570,22 +950,26 @@ keep_prev_node:
 				goto out;
 			}
 			level--;
-			trace_off(printf("pop to level %i, block %Lx, %i of %i nodes\n", level, bufindex(cursor->path[level].buffer), cursor->path[level].next - cursor_node(cursor, level)->entries, bcount(cursor_node(cursor, level))););
+			trace_off(printf("pop to level %i, block %Lx, %i of %i nodes\n", level, bufindex(cursor->path[level].buffer), cursor->path[level].next, bcount(cursor_node(cursor, level))););
 		}
 
 		/* push back down to leaf level */
 		while (level < depth - 1) {
-			struct buffer_head *buffer = vol_bread(sb, from_be_u64(cursor->path[level++].next++->block));
+			struct bnode *node = cursor_node(cursor, level);
+			struct buffer_head *buffer = vol_bread(sb, bnode_block(node, cursor->path[level++].next++));
 			if (!buffer) {
 				ret = -EIO;
 				goto out;
 			}
-			level_push(cursor, buffer, ((struct bnode *)bufdata(buffer))->entries);
+			level_push(cursor, buffer, 0);
+			cursor->ahead = 0;
 			trace_off(printf("push to level %i, block %Lx, %i nodes\n", level, bufindex(buffer), bcount(cursor_node(cursor, level))););
 		}
 		//dirty_buffer_count_check(sb);
 		/* go to next leaf */
-		if (!(leafbuf = vol_bread(sb, from_be_u64(cursor->path[level].next++->block)))) {
+		if (cursor->prefetch)
+			prefetch_leaves(cursor, level);
+		if (!(leafbuf = vol_bread(sb, bnode_block(cursor_node(cursor, level), cursor->path[level].next++)))) {
 			ret = -EIO;
 			goto out;
 		}
@@ -607,13 +991,230 @@ out:
 	return ret;
 }
 
+int tree_chop(struct btree *btree, struct delete_info *info, millisecond_t deadline)
+{
+	return chop_and_merge(btree, info->key, info);
+}
+
+/*
+ * Offline compaction: repack a whole tree, merging every leaf and index
+ * node into its left neighbour wherever it fits and dropping levels the
+ * tree no longer needs.  Afterwards no two neighbours would fit in one
+ * block, so the tree is at least half full on average.
+ */
+int tree_compact(struct btree *btree)
+{
+	return chop_and_merge(btree, 0, NULL);
+}
+
+/*
+ * Rebalancing on delete.  A leaf that a delete leaves under REBALANCE_FILL
+ * percent full is merged with a neighbour under the same index node, the
+ * one to its right into it or it into the one to its left, whichever
+ * fits.  Each index node above it that is under the same fill gets the
+ * same treatment, up to the first that is not, and a root left with a
+ * single child is dropped, so deletes shrink the tree as inserts grew it.
+ * Neighbours under another parent are left for tree_compact().
+ */
+#define REBALANCE_FILL 25
+
+static int leaf_underfull(struct btree *btree, vleaf *leaf)
+{
+	unsigned need = (btree->ops->leaf_need)(btree, leaf);
+	unsigned free = (btree->ops->leaf_free)(btree, leaf);
+
+	return (u64)need * 100 < (u64)(need + free) * REBALANCE_FILL;
+}
+
+/* a node with a single child is only another level to read, whatever its size */
+static int node_underfull(struct sb *sb, struct bnode *node)
+{
+	return bcount(node) < 2 || bcount(node) * 100 < bnode_capacity(sb, node) * REBALANCE_FILL;
+}
+
+/* Merge from into into, leaves or index nodes, sep being the key of from */
+static int merge_blocks(struct btree *btree, int leaves, struct buffer_head *into,
+			struct buffer_head *from, tuxkey_t sep)
+{
+	if (leaves)
+		return (btree->ops->leaf_merge)(btree, bufdata(into), bufdata(from));
+	return merge_nodes(btree->sb, bufdata(into), bufdata(from), sep);
+}
+
+/*
+ * A neighbour is not on the cursor path, so cursor_redirect() left it
+ * alone.  Redirect it before merging into it, as the committed tree may
+ * still point at the old block.  The parent entry at is updated to the
+ * clone; the parent itself is on the path and already redirected.
+ */
+static struct buffer_head *redirect_neighbour(struct cursor *cursor, int level,
+					      unsigned at, struct buffer_head *buffer)
+{
+#ifndef ATOMIC
+	return buffer;
+#endif
+	struct btree *btree = cursor->btree;
+	struct sb *sb = btree->sb;
+	int parent = level - 1;
+
+	if (buffer_dirty(buffer))
+		return buffer;
+
+	struct buffer_head *clone = new_block(btree);
+	if (IS_ERR(clone)) {
+		blockput(buffer);
+		return clone;
+	}
+	block_t oldblock = bufindex(buffer), newblock = bufindex(clone);
+	trace("redirect block %Lx to %Lx", (L)oldblock, (L)newblock);
+	memcpy(bufdata(clone), bufdata(buffer), bufsize(clone));
+	blockput(buffer);
+	if (level == btree->root.depth) {
+		mark_buffer_dirty_atomic(clone);
+		log_leaf_redirect(sb, oldblock, newblock);
+		defer_bfree(&sb->defree, oldblock, 1);
+	} else {
+		mark_buffer_rollup_atomic(clone);
+		log_bnode_redirect(sb, oldblock, newblock);
+		defer_bfree(&sb->derollup, oldblock, 1);
+	}
+	struct bnode *node = cursor_node(cursor, parent);
+	bnode_set_block(node, at, newblock);
+	log_bnode_update(sb, bufindex(cursor->path[parent].buffer), newblock, bnode_key(node, at));
+	return clone;
+}
+
+/*
+ * Free a block merged away.  One not redirected in this delta is still
+ * in the committed tree, so only log the free and defer it, the way
+ * cursor_redirect() frees the blocks it replaces.
+ */
+static void blockput_free_merged(struct btree *btree, int leaves, struct buffer_head *buffer)
+{
+#ifdef ATOMIC
+	if (!buffer_dirty(buffer)) {
+		struct sb *sb = btree->sb;
+		block_t block = bufindex(buffer);
+
+		blockput(buffer);
+		if (leaves) {
+			log_bfree(sb, block, 1);
+			defer_bfree(&sb->defree, block, 1);
+		} else {
+			log_bfree_on_rollup(sb, block, 1);
+			defer_bfree(&sb->derollup, block, 1);
+		}
+		return;
+	}
+#endif
+	blockput_free(btree, buffer);
+}
+
+/*
+ * Merge the block at this level of the cursor with a neighbour, return 1
+ * if it did.  The cursor then holds the merged block at this level, with
+ * the entry above pointing at it.
+ */
+static int merge_neighbour(struct cursor *cursor, int level)
+{
+	struct btree *btree = cursor->btree;
+	int leaves = level == btree->root.depth, parent = level - 1;
+	struct bnode *node = cursor_node(cursor, parent);
+	unsigned at = cursor->path[parent].next - 1;
+	struct buffer_head *buffer = cursor->path[level].buffer, *sibling;
+
+	/* the right neighbour into this one */
+	if (at + 1 < bcount(node)) {
+		if (!(sibling = vol_bread(btree->sb, bnode_block(node, at + 1))))
+			return -EIO;
+		if (merge_blocks(btree, leaves, buffer, sibling, bnode_key(node, at + 1))) {
+			trace("merged block %Lx into %Lx", (L)bufindex(sibling), (L)bufindex(buffer));
+			cursor->path[parent].next++;
+			remove_index(cursor, parent);
+			mark_buffer_dirty(buffer);
+			blockput_free_merged(btree, leaves, sibling);
+			return 1;
+		}
+		blockput(sibling);
+	}
+	/* this one into the left neighbour */
+	if (at > 0) {
+		if (!(sibling = vol_bread(btree->sb, bnode_block(node, at - 1))))
+			return -EIO;
+		sibling = redirect_neighbour(cursor, level, at - 1, sibling);
+		if (IS_ERR(sibling))
+			return PTR_ERR(sibling);
+		unsigned count = leaves ? 0 : bcount(bufdata(sibling));
+		if (merge_blocks(btree, leaves, sibling, buffer, bnode_key(node, at))) {
+			trace("merged block %Lx into %Lx", (L)bufindex(buffer), (L)bufindex(sibling));
+			remove_index(cursor, parent);
+			mark_buffer_dirty(sibling);
+			if (!leaves)
+				cursor->path[level].next += count;
+			cursor->path[level].buffer = sibling;
+			blockput_free_merged(btree, leaves, buffer);
+			return 1;
+		}
+		blockput(sibling);
+	}
+	return 0;
+}
+
+/* Drop the root while it has a single child */
+static int collapse_root(struct btree *btree)
+{
+	while (btree->root.depth > 1) {
+		struct buffer_head *rootbuf = vol_bread(btree->sb, btree->root.block);
+		if (!rootbuf)
+			return -EIO;
+		struct bnode *root = bufdata(rootbuf);
+		if (bcount(root) > 1) {
+			blockput(rootbuf);
+			break;
+		}
+		trace("drop btree level");
+		btree_changed(btree);
+		btree->root.block = bnode_block(root, 0);
+		btree->root.depth--;
+		mark_btree_dirty(btree);
+		blockput_free(btree, rootbuf);
+	}
+	return 0;
+}
+
+/*
+ * Call with the cursor on a leaf just deleted from, redirected, and the
+ * btree locked for writing.  The cursor is released.
+ */
+int tree_rebalance(struct cursor *cursor)
+{
+	struct btree *btree = cursor->btree;
+	int level = btree->root.depth, err = 0;
+
+	if (!btree->ops->leaf_merge || !leaf_underfull(btree, bufdata(cursor_leafbuf(cursor)))) {
+		release_cursor(cursor);
+		return 0;
+	}
+	release_finger(btree);	/* blocks on its path may be freed */
+	for (; level > 0; level--) {
+		if (level < btree->root.depth &&
+		    !node_underfull(btree->sb, cursor_node(cursor, level)))
+			break;
+		if ((err = merge_neighbour(cursor, level)) < 0)
+			break;
+	}
+	release_cursor(cursor);
+	if (err >= 0)
+		err = collapse_root(btree);
+	return err;
+}
+
 /* Insertion */
 
-static void add_child(struct bnode *node, struct index_entry *p, block_t child, u64 childkey)
+static void add_child(struct bnode *node, unsigned at, block_t child, u64 childkey)
 {
-	vecmove(p + 1, p, node->entries + bcount(node) - p);
-	p->block = to_be_u64(child);
-	p->key = to_be_u64(childkey);
+	bnode_move(node, at + 1, at, bcount(node) - at);
+	bnode_set(node, at, childkey, child);
 	node->count = to_be_u32(bcount(node) + 1);
 }
 
@@ -629,11 +1230,12 @@ static int insert_leaf(struct cursor *cursor, tuxkey_t childkey, struct buffer_h
 	int depth = btree->root.depth;
 	block_t childblock = bufindex(leafbuf);
 
+	btree_changed(btree);
 	if (keep)
 		blockput(leafbuf);
 	else {
 		level_pop_blockput(cursor);
-		level_push(cursor, leafbuf, NULL);
+		level_push(cursor, leafbuf, 0);
 	}
 	while (depth--) {
 		struct path_level *at = cursor->path + depth;
@@ -641,7 +1243,7 @@ static int insert_leaf(struct cursor *cursor, tuxkey_t childkey, struct buffer_h
 		struct bnode *parent = bufdata(parentbuf);
 
 		/* insert and exit if not full */
-		if (bcount(parent) < btree->sb->entries_per_node) {
+		if (bnode_room(sb, parent, childkey)) {
 			add_child(parent, at->next, childblock, childkey);
 			if (!keep)
 				at->next++;
@@ -656,26 +1258,29 @@ static int insert_leaf(struct cursor *cursor, tuxkey_t childkey, struct buffer_h
 			return PTR_ERR(newbuf);
 
 		struct bnode *newnode = bufdata(newbuf);
-		unsigned half = bcount(parent) / 2;
-		u64 newkey = from_be_u64(parent->entries[half].key);
-		newnode->count = to_be_u32(bcount(parent) - half);
-		memcpy(&newnode->entries[0], &parent->entries[half], bcount(newnode) * sizeof(struct index_entry));
+		unsigned count = bcount(parent), half = count / 2;
+		u64 newkey = bnode_key(parent, half);
+		tuxkey_t top = max(bnode_key(parent, count - 1), childkey);
+		bnode_init(sb, newnode, newkey, top);
+		for (unsigned i = half; i < count; i++)
+			bnode_set(newnode, i - half, bnode_key(parent, i), bnode_block(parent, i));
+		newnode->count = to_be_u32(count - half);
 		parent->count = to_be_u32(half);
 		log_bnode_split(sb, bufindex(parentbuf), half, bufindex(newbuf));
 
 		/* if the cursor is in the new node, use that as the parent */
-		int child_is_left = at->next <= parent->entries + half;
+		int child_is_left = at->next <= half;
 		if (!child_is_left) {
-			struct index_entry *newnext;
 			mark_buffer_rollup_non(parentbuf);
-			newnext = newnode->entries + (at->next - &parent->entries[half]);
 			get_bh(newbuf);
-			level_replace_blockput(cursor, depth, newbuf, newnext);
+			level_replace_blockput(cursor, depth, newbuf, at->next - half);
 			parentbuf = newbuf;
 			parent = newnode;
 		} else
 			mark_buffer_rollup_non(newbuf);
 
+		/* either half has room, widened if it has to be */
+		assert(bnode_room(sb, parent, childkey));
 		add_child(parent, at->next, childblock, childkey);
 		if (!keep)
 			at->next++;
@@ -704,11 +1309,11 @@ static int insert_leaf(struct cursor *cursor, tuxkey_t childkey, struct buffer_h
 	block_t newrootblock = bufindex(newbuf);
 	block_t oldrootblock = btree->root.block;
 	int left_node = bufindex(cursor->path[0].buffer) != childblock;
+	bnode_init(sb, newroot, 0, childkey);
+	bnode_set(newroot, 0, 0, oldrootblock);
+	bnode_set(newroot, 1, childkey, childblock);
 	newroot->count = to_be_u32(2);
-	newroot->entries[0].block = to_be_u64(oldrootblock);
-	newroot->entries[1].key = to_be_u64(childkey);
-	newroot->entries[1].block = to_be_u64(childblock);
-	level_root_add(cursor, newbuf, newroot->entries + 1 + !left_node);
+	level_root_add(cursor, newbuf, 1 + !left_node);
 	log_bnode_root(sb, newrootblock, 2, oldrootblock, childblock, childkey);
 	/* Change btree to point the new root */
 	btree->root.block = newrootblock;
@@ -773,11 +1378,226 @@ error:
 	return ERR_PTR(err);
 }
 
+/*
+ * Bulk loading.  A btree is built bottom up from keys in ascending order:
+ * leaves are filled one after another to the fill factor and each full
+ * leaf goes to the index node being filled at the level above, which in
+ * turn goes to the level above that when it reaches the fill factor, and
+ * so on.  What is left when the input ends becomes the right edge of the
+ * tree, and the topmost node the root.  Nothing is ever split, and each
+ * block is allocated just as it is started (leaves) or completed (index
+ * nodes), so with a sequential allocator the tree comes out in the order
+ * a left to right walk reads it.
+ *
+ * Items go in through bulk_load_expand(), which like tree_expand() returns
+ * the space for the caller to fill, for leaves with a leaf_resize method.
+ * Leaves built by other means, say a dleaf filled by dwalk_add(), go in
+ * whole through bulk_load_leaf().  The btree must be empty to start with.
+ * Blocks already written are not given back if loading fails.
+ */
+
+void bulk_load_begin(struct bulk_load *load, struct btree *btree, unsigned fill)
+{
+	struct sb *sb = btree->sb;
+	unsigned entries = compact_bnodes(sb) ? calc_entries_per_cnode(sb->blocksize) : sb->entries_per_node;
+
+	assert(!has_root(btree));
+	assert(fill && fill <= 100);
+	*load = (struct bulk_load){
+		.btree = btree,
+		.fill = fill,
+		.node_fill = max(entries * fill / 100, 2U),
+	};
+}
+
+static int bulk_write_node(struct bulk_load *load, int level, block_t *block)
+{
+	struct bulk_level *at = load->level + level;
+	struct buffer_head *buffer = new_node(load->btree);
+	if (IS_ERR(buffer))
+		return PTR_ERR(buffer);
+
+	struct bnode *node = bufdata(buffer);
+	bnode_init(load->btree->sb, node, at->key, from_be_u64(at->entries[at->count - 1].key));
+	for (unsigned i = 0; i < at->count; i++)
+		bnode_set(node, i, from_be_u64(at->entries[i].key), from_be_u64(at->entries[i].block));
+	node->count = to_be_u32(at->count);
+	*block = bufindex(buffer);
+	trace("bulk node at %Lx, level %i, %u entries", (L)*block, level, at->count);
+	log_balloc(load->btree->sb, *block, 1);
+	mark_buffer_dirty_non(buffer);
+	blockput(buffer);
+	at->count = 0;
+	return 0;
+}
+
+static int bulk_add_index(struct bulk_load *load, int level, tuxkey_t key, block_t block)
+{
+	if (level == load->levels) {
+		struct bulk_level *more = realloc(load->level, (level + 1) * sizeof(*more));
+		if (!more)
+			return -ENOMEM;
+		load->level = more;
+		more[level] = (struct bulk_level){
+			.entries = malloc(load->node_fill * sizeof(struct index_entry)),
+		};
+		if (!more[level].entries)
+			return -ENOMEM;
+		load->levels++;
+	}
+
+	/* a node whose keys are too far apart to be compact has to fit wide */
+	struct bulk_level *at = load->level + level;
+	if (at->count == load->node_fill ||
+	    (at->count >= load->btree->sb->entries_per_node && key - at->key > CNODE_KEY_MAX)) {
+		tuxkey_t nodekey = at->key;
+		block_t nodeblock;
+		int err;
+		if ((err = bulk_write_node(load, level, &nodeblock)) ||
+		    (err = bulk_add_index(load, level + 1, nodekey, nodeblock)))
+			return err;
+		at = load->level + level;
+	}
+	if (!at->count)
+		at->key = key;
+	at->entries[at->count++] = (struct index_entry){
+		.key = to_be_u64(key),
+		.block = to_be_u64(block),
+	};
+	return 0;
+}
+
+static void bulk_put_leaf(struct bulk_load *load)
+{
+	struct buffer_head *leafbuf = load->leafbuf;
+
+	log_balloc(load->btree->sb, bufindex(leafbuf), 1);
+	mark_buffer_dirty_non(leafbuf);
+	blockput(leafbuf);
+	load->leafbuf = NULL;
+}
+
+static int bulk_close_leaf(struct bulk_load *load)
+{
+	block_t block = bufindex(load->leafbuf);
+
+	bulk_put_leaf(load);
+	return bulk_add_index(load, 0, load->leafkey, block);
+}
+
+/* Has the leaf reached the fill factor, in whatever units the leaf uses */
+static int bulk_leaf_full(struct bulk_load *load)
+{
+	struct btree *btree = load->btree;
+	vleaf *leaf = bufdata(load->leafbuf);
+	unsigned need = (btree->ops->leaf_need)(btree, leaf);
+	unsigned free = (btree->ops->leaf_free)(btree, leaf);
+
+	return (u64)need * 100 >= (u64)(need + free) * load->fill;
+}
+
+void *bulk_load_expand(struct bulk_load *load, tuxkey_t key, unsigned size)
+{
+	struct btree *btree = load->btree;
+	struct btree_ops *ops = btree->ops;
+	int err;
+
+	assert(ops->leaf_resize && ops->leaf_need && ops->leaf_free);
+	assert(!load->leafbuf || key >= load->key);
+	if (load->leafbuf && load->key != key && bulk_leaf_full(load))
+		if ((err = bulk_close_leaf(load)))
+			goto error;
+
+	for (int i = 0; i < 2; i++) {
+		if (!load->leafbuf) {
+			struct buffer_head *leafbuf = new_leaf(btree);
+			if (IS_ERR(leafbuf)) {
+				err = PTR_ERR(leafbuf);
+				goto error;
+			}
+			if (ops->leaf_start)
+				(ops->leaf_start)(btree, key, bufdata(leafbuf));
+			load->leafbuf = leafbuf;
+			load->leafkey = key;
+			load->items = 0;
+		}
+		void *space = (ops->leaf_resize)(btree, key, bufdata(load->leafbuf), size);
+		if (space) {
+			load->key = key;
+			load->items++;
+			return space;
+		}
+		/* does not fit even in an empty leaf */
+		if (!load->items)
+			break;
+		if ((err = bulk_close_leaf(load)))
+			goto error;
+	}
+	err = -EINVAL;
+error:
+	return ERR_PTR(err);
+}
+
+/* Add a leaf filled by the caller, who gives up its reference */
+int bulk_load_leaf(struct bulk_load *load, tuxkey_t key, struct buffer_head *leafbuf)
+{
+	int err;
+
+	assert(!load->leafbuf || key > load->key);
+	if (load->leafbuf && (err = bulk_close_leaf(load))) {
+		blockput(leafbuf);
+		return err;
+	}
+	load->leafbuf = leafbuf;
+	load->leafkey = load->key = key;
+	return bulk_close_leaf(load);
+}
+
+/* Write out the right edge of the tree and make the top node the root */
+int bulk_load_end(struct bulk_load *load)
+{
+	struct btree *btree = load->btree;
+	int err = 0;
+
+	if (load->leafbuf && (err = bulk_close_leaf(load)))
+		goto out;
+	if (!load->levels) {
+		err = alloc_empty_btree(btree);
+		goto out;
+	}
+	for (int level = 0; level < load->levels; level++) {
+		tuxkey_t key = load->level[level].key;
+		block_t block;
+		if ((err = bulk_write_node(load, level, &block)))
+			break;
+		if (level == load->levels - 1) {
+			btree_changed(btree);
+			btree->root = (struct root){ .block = block, .depth = level + 1 };
+			mark_btree_dirty(btree);
+			break;
+		}
+		if ((err = bulk_add_index(load, level + 1, key, block)))
+			break;
+	}
+out:
+	if (load->leafbuf)
+		bulk_put_leaf(load);
+	for (int level = 0; level < load->levels; level++)
+		free(load->level[level].entries);
+	free(load->level);
+	load->level = NULL;
+	load->levels = 0;
+	return err;
+}
+
 void init_btree(struct btree *btree, struct sb *sb, struct root root, struct btree_ops *ops)
 {
 	btree->sb = sb;
 	btree->ops = ops;
 	btree->root = root;
+	btree->gen = btree->finger_gen = 0;
+	btree->finger = NULL;
+	spin_lock_init(&btree->finger_lock);
 	init_rwsem(&btree->lock);
 	ops->btree_init(btree);
 }
@@ -793,12 +1613,14 @@ int alloc_empty_btree(struct btree *btree)
 		goto error_leafbuf;
 
 	assert(!has_root(btree));
+	btree_changed(btree);
 	struct bnode *rootnode = bufdata(rootbuf);
 	block_t rootblock = bufindex(rootbuf);
 	block_t leafblock = bufindex(leafbuf);
 	trace("root at %Lx", (L)rootblock);
 	trace("leaf at %Lx", (L)leafblock);
-	rootnode->entries[0].block = to_be_u64(leafblock);
+	bnode_init(sb, rootnode, 0, 0);
+	bnode_set(rootnode, 0, 0, leafblock);
 	rootnode->count = to_be_u32(1);
 	btree->root = (struct root){ .block = rootblock, .depth = 1 };
 
@@ -829,6 +1651,8 @@ int free_empty_btree(struct btree *btree)
 		return 0;
 
 	assert(btree->root.depth == 1);
+	release_finger(btree);
+	btree_changed(btree);
 	struct sb *sb = btree->sb;
 	struct buffer_head *rootbuf = vol_bread(sb, btree->root.block);
 	if (!rootbuf)
@@ -836,7 +1660,7 @@ int free_empty_btree(struct btree *btree)
 	struct bnode *rootnode = bufdata(rootbuf);
 	assert(bcount(rootnode) == 1);
 	/* FIXME: error check */
-	(btree->ops->bfree)(sb, from_be_u64(rootnode->entries[0].block), 1);
+	(btree->ops->bfree)(sb, bnode_block(rootnode, 0), 1);
 	(btree->ops->bfree)(sb, bufindex(rootbuf), 1);
 	blockput(rootbuf);
 	return 0;
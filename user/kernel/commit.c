@@ -16,7 +16,10 @@ int load_sb(struct sb *sb)
 
 	if (err)
 		return err;
-	if (memcmp(super->magic, TUX3_MAGIC, sizeof(super->magic)))
+	u64 flags = from_be_u64(super->flags);
+	if (flags & ~SB_INCOMPAT)
+		return -EINVAL;
+	if (memcmp(super->magic, sb_magic(flags), sizeof(super->magic)))
 		return -EINVAL;
 	sb->blockbits = from_be_u16(super->blockbits);
 	sb->blocksize = 1 << sb->blockbits;
@@ -85,18 +88,11 @@ void clean_buffer(struct buffer_head *buffer)
 static int flush_buffer_list(struct sb *sb, struct list_head *head)
 {
 #ifndef __KERNEL__
-	/* FIXME: code should be share with flush_buffers() */
-	struct buffer_head *buffer;
-
-	while (!list_empty(head)) {
-		buffer = list_entry(head->next, struct buffer_head, link);
-		trace(">>> flush buffer %Lx:%Lx", (L)tux_inode(buffer_inode(buffer))->inum, (L)bufindex(buffer));
-		// mapping, index set but not hashed in mapping
-		buffer->map->io(buffer, 1);
-		evict_buffer(buffer);
-	}
-#endif
+	/* mapping, index set but not hashed in mapping */
+	return flush_evict_list(head);
+#else
 	return 0;
+#endif
 }
 
 static int move_deferred(struct sb *sb, u64 val)
@@ -186,31 +182,38 @@ static int write_log(struct sb *sb)
 	/* Finish to logging in this delta */
 	log_finish(sb);
 
+	/* Log blocks go out together, the chain is already in the blocks */
+	unsigned count = sb->lognext - sb->logthis, n = 0;
+	struct bufvec *vec = malloc(count * sizeof(*vec));
+	if (count && !vec)
+		return -ENOMEM;
+	int err = 0;
 	for (unsigned index = sb->logthis; index < sb->lognext; index++) {
 		block_t block;
-		int err = balloc(sb, 1, &block);
-		if (err)
-			return err;
+		if ((err = balloc(sb, 1, &block)))
+			break;
 		struct buffer_head *buffer = blockget(mapping(sb->logmap), index);
 		if (!buffer) {
 			bfree(sb, block, 1);
-			return -ENOMEM;
+			err = -ENOMEM;
+			break;
 		}
 		struct logblock *log = bufdata(buffer);
 		assert(log->magic == to_be_u16(TUX3_MAGIC_LOG));
 		log->logchain = to_be_u64(sb->logchain);
-		err = blockio(WRITE, buffer, block);
-		if (err) {
-			blockput(buffer);
-			bfree(sb, block, 1);
-			return err;
-		}
-
 		defer_bfree(&sb->new_decycle, block, 1);
-
-		blockput(buffer);
+		vec[n++] = (struct bufvec){ .buffer = buffer, .block = block };
 		sb->logchain = block;
 	}
+	struct iobatch batch = IOBATCH_INIT;
+	if (!err)
+		err = submit_bufvec(vec, n, WRITE, &batch, 0);
+	for (unsigned i = 0; i < n; i++)
+		blockput(vec[i].buffer);
+	free(vec);
+	int ioerr = wait_iobatch(&batch);
+	if (err || (err = ioerr))
+		return err;
 	sb->logthis = sb->lognext;
 
 	return 0;
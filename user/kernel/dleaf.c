@@ -61,6 +61,13 @@
  * index is suited to binary search.  A sequence of inserts in ascending order
  * in the same group requires no existing entries to be relocated, the reason
  * the entry list is stored in reverse.
+ *
+ * A wide leaf, marked by TUX3_MAGIC_DLEAF_WIDE, has the same layout but
+ * gives the ten version bits of each extent to the count, so one extent
+ * can cover up to MAX_WIDE_EXTENT blocks instead of MAX_EXTENT.  Volumes
+ * made with SB_WIDE_DLEAF get wide leaves, others keep the original
+ * format.  Extents are only ever built and decoded through the leaf they
+ * belong to, see make_leaf_extent() and leaf_extent_count().
  */
 
 static inline struct dleaf *to_dleaf(vleaf *leaf)
@@ -73,10 +80,27 @@ static void dleaf_btree_init(struct btree *btree)
 	btree->entries_per_leaf = 64; /* FIXME: should depend on blocksize */
 }
 
+static int wide_dleaves(struct sb *sb)
+{
+	return !!(from_be_u64(sb->super.flags) & SB_WIDE_DLEAF);
+}
+
+/*
+ * Longest extent to create on this volume.  A free run never crosses a
+ * bitmap block, so a wide extent is also held to what one of those maps.
+ */
+unsigned dtree_max_extent(struct sb *sb)
+{
+	if (!wide_dleaves(sb))
+		return MAX_EXTENT;
+	return min(MAX_WIDE_EXTENT, 1 << (sb->blockbits + 3));
+}
+
 int dleaf_init(struct btree *btree, vleaf *leaf)
 {
+	unsigned magic = wide_dleaves(btree->sb) ? TUX3_MAGIC_DLEAF_WIDE : TUX3_MAGIC_DLEAF;
 	*to_dleaf(leaf) = (struct dleaf){
-		.magic = to_be_u16(TUX3_MAGIC_DLEAF),
+		.magic = to_be_u16(magic),
 		.free = to_be_u16(sizeof(struct dleaf)),
 		.used = to_be_u16(btree->sb->blocksize) };
 	return 0;
@@ -84,7 +108,7 @@ int dleaf_init(struct btree *btree, vleaf *leaf)
 
 static int dleaf_sniff(struct btree *btree, vleaf *leaf)
 {
-	return to_dleaf(leaf)->magic == to_be_u16(TUX3_MAGIC_DLEAF);
+	return to_dleaf(leaf)->magic == to_be_u16(TUX3_MAGIC_DLEAF) || dleaf_wide(to_dleaf(leaf));
 }
 
 unsigned dleaf_free(struct btree *btree, vleaf *leaf)
@@ -130,8 +154,8 @@ void dleaf_dump(struct btree *btree, vleaf *vleaf)
 			else for (int i = 0; i < count; i++) {
 				struct diskextent extent = extents[offset + i];
 				printf(" %Lx", (L)extent_block(extent));
-				if (extent_count(extent))
-					printf("/%x", extent_count(extent));
+				if (leaf_extent_count(leaf, extent))
+					printf("/%x", leaf_extent_count(leaf, extent));
 			}
 			//printf(" {%u}", entry_limit(entry));
 			printf(";");
@@ -236,6 +260,7 @@ int dleaf_split_at(vleaf *from, vleaf *into, struct entry *entry, unsigned block
 	printf("split %i entries at group %i, entry %x\n", entries, grsplit, cut);
 	printf("split extents at %i\n", exsplit);
 	/* copy extents */
+	leaf2->magic = leaf->magic;
 	unsigned size = from + from_be_u16(leaf->free) - (void *)(leaf->table + exsplit);
 	memcpy(leaf2->table, leaf->table + exsplit, size);
 
@@ -291,7 +316,7 @@ static tuxkey_t dleaf_split(struct btree *btree, tuxkey_t key, vleaf *from, vlea
 	return get_index(gdict2 - 1, (struct entry *)(gdict2 - groups2) - 1);
 }
 
-void dleaf_merge(struct btree *btree, vleaf *vinto, vleaf *vfrom)
+int dleaf_merge(struct btree *btree, vleaf *vinto, vleaf *vfrom)
 {
 	struct dleaf *leaf = to_dleaf(vinto), *from = to_dleaf(vfrom);
 	struct group *gdict = (void *)leaf + btree->sb->blocksize;
@@ -307,14 +332,19 @@ void dleaf_merge(struct btree *btree, vleaf *vinto, vleaf *vfrom)
 
 	/* Source is empty, so we do nothing */
 	if (dleaf_groups(from) == 0)
-		return;
+		return 1;
+	if (dleaf_need(btree, from) > dleaf_free(btree, leaf))
+		return 0;
+	/* Extents of different formats cannot share a leaf */
+	if (dleaf_groups(leaf) && leaf->magic != from->magic)
+		return 0;
 
 	/* Destination is empty, so we just copy */
 	if (dleaf_groups(leaf) == 0) {
 		unsigned used = from_be_u16(from->used);
 		memcpy(leaf, from, from_be_u16(from->free));
 		memcpy((void *)leaf + used, (void *)from + used, btree->sb->blocksize - used);
-		return;
+		return 1;
 	}
 
 	/* Try to merge group, and prepare to adjust */
@@ -372,6 +402,7 @@ void dleaf_merge(struct btree *btree, vleaf *vinto, vleaf *vfrom)
 		}
 	}
 	assert(!dleaf_check(leaf, btree->sb->blocksize));
+	return 1;
 }
 
 /*
@@ -434,7 +465,7 @@ block_t dwalk_block(struct dwalk *walk)
 
 unsigned dwalk_count(struct dwalk *walk)
 {
-	return extent_count(*walk->extent);
+	return leaf_extent_count(walk->leaf, *walk->extent);
 }
 
 /* unused */
@@ -530,23 +561,56 @@ int dwalk_back(struct dwalk *walk)
 	return 1;
 }
 
+/*
+ * Both index tables are stored in reverse, so keys descend as addresses
+ * rise.  These return the lowest address holding a key not above the
+ * one given, or the end of the table if there is none, halving the range
+ * by adding the outcome of each compare rather than branching on it.
+ */
+static struct group *group_search(struct group *base, unsigned count, unsigned keyhi)
+{
+	if (!count)
+		return base;
+	while (count > 1) {
+		unsigned half = count / 2;
+		base += half * (group_keyhi(base + half - 1) > keyhi);
+		count -= half;
+	}
+	return base + (group_keyhi(base) > keyhi);
+}
+
+static struct entry *entry_search(struct group *group, struct entry *base, unsigned count, tuxkey_t key)
+{
+	while (count > 1) {
+		unsigned half = count / 2;
+		base += half * (get_index(group, base + half - 1) > key);
+		count -= half;
+	}
+	return base + (get_index(group, base) > key);
+}
+
 /*
  * Probe the extent position with key. If not found, position is next
  * extent of key.  If probed all extents return 0, otherwise return 1
  * (I.e. current extent is valid. IOW, !dwalk_end()).
+ *
+ * Binary search finds the last group with keyhi not above the key, then
+ * the last entry in it not above the key, backing up a group while one
+ * with the same keyhi starts above the key.  Groups record no offsets,
+ * so exbase is still the sum of the extent counts of the groups before.
  */
 int dwalk_probe(struct dleaf *leaf, unsigned blocksize, struct dwalk *walk, tuxkey_t key)
 {
 	trace("probe for 0x%Lx", (L)key);
-	unsigned keylo = key & 0xffffff, keyhi = key >> 24;
+	unsigned groups = dleaf_groups(leaf), count;
 
 	walk->leaf = leaf;
 	walk->gdict = (void *)leaf + blocksize;
-	walk->gstop = walk->gdict - dleaf_groups(leaf);
+	walk->gstop = walk->gdict - groups;
 	walk->group = walk->gdict;
 	walk->estop = (struct entry *)walk->gstop;
 	walk->exbase = leaf->table;
-	if (!dleaf_groups(leaf)) {
+	if (!groups) {
 		/* dwalk_first() and dwalk_end() will return true */
 		walk->entry = (struct entry *)walk->gstop;
 		walk->extent = leaf->table;
@@ -555,51 +619,39 @@ int dwalk_probe(struct dleaf *leaf, unsigned blocksize, struct dwalk *walk, tuxk
 		return 0;
 	}
 
-	while (walk->group > walk->gstop) {
+	struct group *group = group_search(walk->gstop, groups, key >> 24);
+	if (group == walk->gdict)
+		group--;
+	while (1) {
 		walk->group--;
-		walk->entry = walk->estop - 1;
 		walk->estop -= group_count(walk->group);
-		if (group_keyhi(walk->group) > keyhi)
-			goto no_group;
-		if (group_keyhi(walk->group) == keyhi) {
-			if (entry_keylo(walk->entry) > keylo)
-				goto no_group;
-			if (walk->group == walk->gstop)
-				goto probe_entry;
-			if (group_keyhi(walk->group - 1) > keyhi)
-				goto probe_entry;
-			if (entry_keylo(walk->estop - 1) > keylo)
-				goto probe_entry;
-		}
+		if (walk->group == group)
+			break;
 		walk->exbase += entry_limit(walk->estop);
 	}
-	/* There is no group after this key */
-	walk->entry = walk->estop;
-	walk->exstop = walk->exbase;
-	walk->extent = walk->exbase;
-	walk->exbase = walk->exbase - entry_limit(walk->estop);
-	dwalk_check(walk);
-	return 0;
-
-no_group:
-	/* There is no interesting group, set first extent in this group */
+	while (1) {
+		count = group_count(walk->group);
+		walk->entry = entry_search(walk->group, walk->estop, count, key);
+		if (walk->entry < walk->estop + count)
+			break;
+		if (walk->group + 1 == walk->gdict) {
+			/* Key is before the first extent, set the first extent */
+			walk->entry = walk->estop + count - 1;
+			walk->extent = walk->exbase;
+			walk->exstop = walk->exbase + entry_limit(walk->entry);
+			dwalk_check(walk);
+			return 1;
+		}
+		walk->group++;
+		walk->estop += count;
+		walk->exbase -= entry_limit(walk->estop);
+	}
+	/* Now, entry has the nearest key (<= key), probe extent */
 	walk->extent = walk->exbase;
+	if (walk->entry + 1 < walk->estop + count)
+		walk->extent += entry_limit(walk->entry + 1);
 	walk->exstop = walk->exbase + entry_limit(walk->entry);
 	dwalk_check(walk);
-	return 1;
-
-probe_entry:
-	/* There is interesting group, next is probe interesting entry */
-	walk->extent = walk->exbase;
-	walk->exstop = walk->exbase + entry_limit(walk->entry);
-	while (walk->entry > walk->estop) {
-		if (entry_keylo(walk->entry - 1) > keylo)
-			break;
-		walk->entry--;
-		walk->extent = walk->exstop;
-		walk->exstop = walk->exbase + entry_limit(walk->entry);
-	}
-	/* Now, entry has the nearest keylo (<= key), probe extent */
 	/* FIXME: this is assuming the entry has only one extent */
 	if (key < dwalk_index(walk) + dwalk_count(walk))
 		return 1;
@@ -624,7 +676,7 @@ int dwalk_mock(struct dwalk *walk, tuxkey_t index, struct diskextent extent)
 		walk->mock.entry = make_entry(keylo, walk->extent - walk->exbase);
 		inc_group_count(&walk->mock.group, 1);
 	}
-	trace("add extent 0x%Lx => 0x%Lx/%x", (L)index, (L)extent_block(extent), extent_count(extent));
+	trace("add extent 0x%Lx => 0x%Lx/%x", (L)index, (L)extent_block(extent), leaf_extent_count(walk->leaf, extent));
 	walk->mock.free += sizeof(*walk->extent);
 	walk->extent++;
 	inc_entry_limit(&walk->mock.entry, 1);
@@ -666,6 +718,7 @@ void dwalk_copy(struct dwalk *walk, struct dleaf *dest)
 	veccopy(gdict2 - groups2, walk->gstop, groups2);
 	veccopy(edict2 - entries, ebase, entries);
 	veccopy(dest->table, entry_exbase, extents);
+	dest->magic = leaf->magic;
 
 	unsigned gcount2 = (walk->entry + 1) - walk->estop;
 	set_dleaf_groups(dest, groups2);
@@ -731,7 +784,7 @@ int dwalk_add(struct dwalk *walk, tuxkey_t index, struct diskextent extent)
 
 	/* FIXME: assume entry has only one extent */
 	assert(!groups || dwalk_index(walk) != index);
-	assert(extent_block(extent) > 0 && extent_count(extent) > 0);
+	assert(extent_block(extent) > 0 && leaf_extent_count(leaf, extent) > 0);
 
 	trace("group %ti/%i", walk->gstop + groups - 1 - walk->group, groups);
 	if (!groups || dwalk_index(walk) != index) {
@@ -808,7 +861,7 @@ static int dleaf_chop(struct btree *btree, tuxkey_t chop, vleaf *vleaf)
 
 		/* FIXME: err check? */
 		(btree->ops->bfree)(sb, block + count, dwalk_count(&walk) - count);
-		dwalk_update(&walk, make_extent(block, count));
+		dwalk_update(&walk, make_leaf_extent(leaf, block, count));
 		if (!dwalk_next(&walk))
 			goto out;
 	}
@@ -97,6 +97,158 @@ static int map_bfree(struct inode *inode, block_t block, unsigned count)
 	return 0;
 }
 
+/*
+ * Extent cache.  Each inode keeps the mappings its dtree gave out lately,
+ * holes included, as a short array of runs sorted by logical index that
+ * never overlap.  A read covered end to end by cached runs takes its segs
+ * from here and does not probe the btree at all.  Reads fill the cache from
+ * the dleaf walk, allocation and redirect rewrite the runs they change, and
+ * chopping the dtree drops the lot.  New runs that do not fit in what is
+ * left of the cache start it over.
+ */
+#define EXCACHE_RUNS 32
+
+struct excache {
+	unsigned used;
+	block_t index[EXCACHE_RUNS];	/* Logical start of each run */
+	struct seg map[EXCACHE_RUNS];
+};
+
+/* Last run starting at or below index, -1 if none */
+static int excache_find(struct excache *cache, block_t index)
+{
+	unsigned lo = 0, hi = cache->used;
+
+	while (lo < hi) {
+		unsigned mid = (lo + hi) / 2;
+		if (cache->index[mid] <= index)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return (int)lo - 1;
+}
+
+static block_t excache_end(struct excache *cache, int i)
+{
+	return cache->index[i] + cache->map[i].count;
+}
+
+/* Segs for the region if the cache covers all of it, else zero */
+static int excache_lookup(struct inode *inode, block_t start, unsigned count, struct seg map[], unsigned max_segs)
+{
+	tuxnode_t *tuxnode = tux_inode(inode);
+	block_t index = start, limit = start + count;
+	struct excache *cache;
+	int i, segs = 0;
+
+	spin_lock(&tuxnode->excache_lock);
+	if (!(cache = tuxnode->excache) || (i = excache_find(cache, start)) < 0)
+		goto out;
+	while (index < limit && segs < max_segs) {
+		if (i == cache->used || cache->index[i] > index ||
+		    excache_end(cache, i) <= index) {
+			segs = 0;
+			break;
+		}
+		unsigned skip = index - cache->index[i];
+		struct seg seg = cache->map[i++];
+		if (seg.state != SEG_HOLE)
+			seg.block += skip;
+		seg.count = min_t(block_t, seg.count - skip, limit - index);
+		index += seg.count;
+		map[segs++] = seg;
+	}
+out:
+	spin_unlock(&tuxnode->excache_lock);
+	if (segs)
+		trace("cached %Lx/%x in %i segs", (L)start, count, segs);
+	return segs;
+}
+
+/* Record the region as mapped by map[], replacing whatever covered it */
+static void excache_update(struct inode *inode, block_t start, struct seg map[], int segs)
+{
+	tuxnode_t *tuxnode = tux_inode(inode);
+	struct excache *cache, *spare = NULL;
+	block_t limit = start;
+
+	for (int i = 0; i < segs; i++)
+		limit += map[i].count;
+	if (!tuxnode->excache && !(spare = malloc(sizeof(*spare))))
+		return;
+
+	spin_lock(&tuxnode->excache_lock);
+	if (!(cache = tuxnode->excache)) {
+		cache = tuxnode->excache = spare;
+		cache->used = 0;
+		spare = NULL;
+	}
+	/* Runs lo up to hi overlap the region, the outer two maybe partly */
+	int lo = excache_find(cache, start), hi = excache_find(cache, limit - 1) + 1;
+	if (lo < 0 || excache_end(cache, lo) <= start)
+		lo++;
+	int head = lo < hi && cache->index[lo] < start;
+	int tail = lo < hi && excache_end(cache, hi - 1) > limit;
+	struct seg headseg = { }, tailseg = { };
+	block_t headindex = 0;
+	if (head) {
+		headindex = cache->index[lo];
+		headseg = cache->map[lo];
+		headseg.count = start - headindex;
+	}
+	if (tail) {
+		unsigned skip = limit - cache->index[hi - 1];
+		tailseg = cache->map[hi - 1];
+		if (tailseg.state != SEG_HOLE)
+			tailseg.block += skip;
+		tailseg.count -= skip;
+	}
+	unsigned runs = head + segs + tail;
+	if (cache->used - (hi - lo) + runs > EXCACHE_RUNS) {
+		cache->used = lo = hi = head = tail = 0;
+		if ((runs = segs) > EXCACHE_RUNS)
+			goto out;
+	}
+	memmove(cache->index + lo + runs, cache->index + hi, (cache->used - hi) * sizeof(*cache->index));
+	memmove(cache->map + lo + runs, cache->map + hi, (cache->used - hi) * sizeof(*cache->map));
+	cache->used += runs - (hi - lo);
+	if (head) {
+		cache->index[lo] = headindex;
+		cache->map[lo++] = headseg;
+	}
+	for (int i = 0; i < segs; i++, lo++) {
+		cache->index[lo] = start;
+		cache->map[lo] = (struct seg){
+			.block = map[i].block,
+			.count = map[i].count,
+			.state = map[i].state & SEG_HOLE,
+		};
+		start += map[i].count;
+	}
+	if (tail) {
+		cache->index[lo] = limit;
+		cache->map[lo] = tailseg;
+	}
+out:
+	spin_unlock(&tuxnode->excache_lock);
+	if (spare)
+		free(spare);
+}
+
+void drop_extent_cache(struct inode *inode)
+{
+	tuxnode_t *tuxnode = tux_inode(inode);
+	struct excache *cache;
+
+	spin_lock(&tuxnode->excache_lock);
+	cache = tuxnode->excache;
+	tuxnode->excache = NULL;
+	spin_unlock(&tuxnode->excache_lock);
+	if (cache)
+		free(cache);
+}
+
 static int map_region(struct inode *inode, block_t start, unsigned count, struct seg map[], unsigned max_segs, int create)
 {
 	struct sb *sb = tux_sb(inode->i_sb);
@@ -113,6 +265,8 @@ static int map_region(struct inode *inode, block_t start, unsigned count, struct
 	} else {
 		if (!is_bitmap_write(sb))
 			down_read_nested(&btree->lock, inode == sb->bitmap);
+		if ((segs = excache_lookup(inode, start, count, map, max_segs)))
+			goto out_unlock;
 	}
 
 	if (!has_root(btree) && create) {
@@ -154,6 +308,9 @@ static int map_region(struct inode *inode, block_t start, unsigned count, struct
 	/* do not overlap next leaf */
 	if (limit > next_key(cursor, btree->root.depth))
 		limit = next_key(cursor, btree->root.depth);
+	/* nor create a hole longer than one extent can be */
+	if (create && limit - start > dtree_max_extent(sb))
+		limit = start + dtree_max_extent(sb);
 	trace("--- index %Lx, limit %Lx ---", (L)start, (L)limit);
 
 	block_t index = start, seg_start, block;
@@ -190,8 +347,10 @@ static int map_region(struct inode *inode, block_t start, unsigned count, struct
 	map[0].count -= below;
 	map[segs - 1].count -= above;
 
-	if (!create)
+	if (!create) {
+		excache_update(inode, start, map, segs);
 		goto out_release;
+	}
 
 	/* Save blocks before change map[] for below or above. */
 	block_t below_block, above_block;
@@ -214,7 +373,17 @@ static int map_region(struct inode *inode, block_t start, unsigned count, struct
 	for (int i = 0; i < segs; i++) {
 		if (map[i].state == SEG_HOLE) {
 			count = map[i].count;
-			if ((err = balloc(sb, count, &block))) { // goal ???
+			/*
+			 * On a fragmented volume a hole may not fit in one
+			 * free run.  Take it as two extents then, while the
+			 * caller has room for more segs.
+			 */
+			while ((err = balloc(sb, count, &block)) == -ENOSPC && count > 1 && segs < max_segs) {
+				memmove(map + i + 1, map + i, (segs++ - i) * sizeof(*map));
+				map[i].count = count /= 2;
+				map[i + 1].count -= count;
+			}
+			if (err) { // goal ???
 				/*
 				 * Out of space on file data allocation.  It happens.  Tread
 				 * carefully.  We have not stored anything in the btree yet,
@@ -281,17 +450,17 @@ static int map_region(struct inode *inode, block_t start, unsigned count, struct
 		}
 		if (i < 0) {
 			trace("emit below");
-			dwalk_add(&headwalk, seg_start, make_extent(below_block, below));
+			dwalk_add(&headwalk, seg_start, make_leaf_extent(leaf, below_block, below));
 			continue;
 		}
 		if (i == segs) {
 			trace("emit above");
-			dwalk_add(&headwalk, index, make_extent(above_block, above));
+			dwalk_add(&headwalk, index, make_leaf_extent(leaf, above_block, above));
 			continue;
 		}
 		trace("pack 0x%Lx => %Lx/%x", (L)index, (L)map[i].block, map[i].count);
 		dleaf_dump(btree, leaf);
-		dwalk_add(&headwalk, index, make_extent(map[i].block, map[i].count));
+		dwalk_add(&headwalk, index, make_leaf_extent(leaf, map[i].block, map[i].count));
 		dleaf_dump(btree, leaf);
 		index += map[i].count;
 	}
@@ -323,6 +492,10 @@ out_release:
 		release_cursor(cursor);
 out_unlock:
 	if (create) {
+		if (segs > 0)
+			excache_update(inode, start, map, segs);
+		else
+			drop_extent_cache(inode);
 		up_write(&btree->lock);
 		if (inode == sb->bitmap)
 			put_bitmap_write(sb);
@@ -502,6 +675,19 @@ error:
 	return NULL;
 }
 
+/* Start reading blocks that will be wanted soon, without waiting for them */
+void prefetch_blocks(struct address_space *mapping, block_t *blocks, unsigned count)
+{
+	struct inode *inode = mapping->host;
+	struct file_ra_state ra;
+
+	file_ra_state_init(&ra, mapping);
+	for (unsigned i = 0; i < count; i++) {
+		pgoff_t index = blocks[i] >> (PAGE_CACHE_SHIFT - inode->i_blkbits);
+		page_cache_sync_readahead(mapping, &ra, NULL, index, 1);
+	}
+}
+
 struct buffer_head *blockget(struct address_space *mapping, block_t iblock)
 {
 	struct inode *inode = mapping->host;
@@ -69,6 +69,11 @@ static int ileaf_init(struct btree *btree, vleaf *leaf)
 	return 0;
 }
 
+static void ileaf_start(struct btree *btree, tuxkey_t inum, vleaf *leaf)
+{
+	to_ileaf(leaf)->ibase = to_be_u64(inum);
+}
+
 static int ileaf_sniff(struct btree *btree, vleaf *leaf)
 {
 	return ((struct ileaf *)leaf)->magic == to_be_u16(TUX3_MAGIC_ILEAF);
@@ -225,14 +230,28 @@ static tuxkey_t ileaf_split(struct btree *btree, tuxkey_t inum, vleaf *from, vle
 	return ibase(dest);
 }
 
-/* userland only */
-void ileaf_merge(struct btree *btree, struct ileaf *leaf, struct ileaf *from)
+/*
+ * Inums between the last one in leaf and the base of from become empty
+ * slots, the merged leaf has to span them all and hold their offsets.
+ */
+static int ileaf_merge(struct btree *btree, vleaf *into, vleaf *vfrom)
 {
+	struct ileaf *leaf = into, *from = vfrom;
 	if (!icount(from))
-		return;
+		return 1;
+	assert(ibase(from) >= ibase(leaf) + icount(leaf));
+	if (ibase(from) - ibase(leaf) + icount(from) > btree->entries_per_leaf)
+		return 0;
 	be_u16 *dict = (void *)leaf + btree->sb->blocksize;
 	be_u16 *fromdict = (void *)from + btree->sb->blocksize;
-	unsigned at = icount(leaf), free = atdict(dict, at), size = atdict(fromdict, icount(from));
+	unsigned at = ibase(from) - ibase(leaf), free = atdict(dict, icount(leaf));
+	unsigned size = atdict(fromdict, icount(from));
+	unsigned gap = at - icount(leaf);
+
+	if (gap * sizeof(*dict) + ileaf_need(btree, from) > ileaf_free(btree, leaf))
+		return 0;
+	for (unsigned i = icount(leaf) + 1; i <= at; i++)
+		*(dict - i) = to_be_u16(free);
 
 	trace("copy in %i bytes", size);
 	memcpy(leaf->table + free, from->table, size);
@@ -240,6 +259,7 @@ void ileaf_merge(struct btree *btree, struct ileaf *leaf, struct ileaf *from)
 	veccopy(dict - icount(leaf), fromdict - icount(from), icount(from));
 	for (int i = at + 1; at && i <= at + icount(from); i++)
 		add_idict(dict - i, __atdict(dict, at));
+	return 1;
 }
 
 static void *ileaf_resize(struct btree *btree, tuxkey_t inum, vleaf *base, unsigned newsize)
@@ -321,5 +341,9 @@ struct btree_ops itable_ops = {
 	.leaf_init = ileaf_init,
 	.leaf_split = ileaf_split,
 	.leaf_resize = ileaf_resize,
+	.leaf_start = ileaf_start,
+	.leaf_need = ileaf_need,
+	.leaf_free = ileaf_free,
+	.leaf_merge = ileaf_merge,
 	.balloc = balloc,
 };
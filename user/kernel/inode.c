@@ -395,12 +395,13 @@ static int purge_inum(struct inode *inode)
 	down_write(&cursor->btree->lock);
 	if (!(err = probe(cursor, inum))) {
 		if (!(err = cursor_redirect(cursor))) {
-			/* FIXME: truncate the bnode and leaf if empty. */
 			struct ileaf *ileaf = to_ileaf(bufdata(cursor_leafbuf(cursor)));
 			ileaf_purge(itable, inum, ileaf);
 			mark_buffer_dirty(cursor_leafbuf(cursor));
-		}
-		release_cursor(cursor);
+			/* merge a leaf left nearly empty, releases the cursor */
+			err = tree_rebalance(cursor);
+		} else
+			release_cursor(cursor);
 	}
 	up_write(&cursor->btree->lock);
 	free_cursor(cursor);
@@ -475,6 +476,8 @@ void tux3_delete_inode(struct inode *inode)
 
 void tux3_clear_inode(struct inode *inode)
 {
+	release_finger(&tux_inode(inode)->btree);
+	drop_extent_cache(inode);
 	if (tux_inode(inode)->xcache)
 		kfree(tux_inode(inode)->xcache);
 }
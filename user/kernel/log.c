@@ -107,29 +107,44 @@ void log_end(struct sb *sb, void *pos)
 	mutex_unlock(&sb->loglock);
 }
 
-static void log_extent(struct sb *sb, u8 intent, block_t block, unsigned count)
+/*
+ * An extent record has a one byte count.  Only extents of wide dleaves
+ * can be longer, they get a record of their own with a two byte count.
+ */
+static void log_extent(struct sb *sb, u8 intent, u8 wide, block_t block, unsigned count)
 {
-	assert(count < 256);	/* FIXME: extent max is 64 for now */
-	unsigned char *data = log_begin(sb, 8);
-
-	*data++ = intent;
-	*data++ = count;
+	/* A wide extent can be one block longer than the count field holds */
+	while (count > 0xffff) {
+		log_extent(sb, intent, wide, block, 0xffff);
+		block += 0xffff;
+		count -= 0xffff;
+	}
+	unsigned char *data;
+	if (count < 256) {
+		data = log_begin(sb, 8);
+		*data++ = intent;
+		*data++ = count;
+	} else {
+		data = log_begin(sb, 9);
+		*data++ = wide;
+		data = encode16(data, count);
+	}
 	log_end(sb, encode48(data, block));
 }
 
 void log_balloc(struct sb *sb, block_t block, unsigned count)
 {
-	log_extent(sb, LOG_BALLOC, block, count);
+	log_extent(sb, LOG_BALLOC, LOG_BALLOC_WIDE, block, count);
 }
 
 void log_bfree(struct sb *sb, block_t block, unsigned count)
 {
-	log_extent(sb, LOG_BFREE, block, count);
+	log_extent(sb, LOG_BFREE, LOG_BFREE_WIDE, block, count);
 }
 
 void log_bfree_on_rollup(struct sb *sb, block_t block, unsigned count)
 {
-	log_extent(sb, LOG_BFREE_ON_ROLLUP, block, count);
+	log_extent(sb, LOG_BFREE_ON_ROLLUP, LOG_BFREE_ON_ROLLUP_WIDE, block, count);
 }
 
 static void log_redirect(struct sb *sb, u8 intent, block_t oldblock, block_t newblock)
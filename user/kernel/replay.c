@@ -18,6 +18,9 @@ static unsigned logsize[LOG_TYPES] = {
 	[LOG_BNODE_SPLIT] = 15,
 	[LOG_BNODE_ADD] = 19,
 	[LOG_BNODE_UPDATE] = 19,
+	[LOG_BALLOC_WIDE] = 9,
+	[LOG_BFREE_WIDE] = 9,
+	[LOG_BFREE_ON_ROLLUP_WIDE] = 9,
 };
 
 int replay(struct sb *sb)
@@ -66,6 +69,9 @@ int replay(struct sb *sb)
 			case LOG_BALLOC:
 			case LOG_BFREE:
 			case LOG_BFREE_ON_ROLLUP:
+			case LOG_BALLOC_WIDE:
+			case LOG_BFREE_WIDE:
+			case LOG_BFREE_ON_ROLLUP_WIDE:
 				data += logsize[code] - 1;
 				break;
 			case LOG_LEAF_REDIRECT:
@@ -89,12 +95,20 @@ int replay(struct sb *sb)
 			case LOG_BALLOC:
 			case LOG_BFREE:
 			case LOG_BFREE_ON_ROLLUP:
+			case LOG_BALLOC_WIDE:
+			case LOG_BFREE_WIDE:
+			case LOG_BFREE_ON_ROLLUP_WIDE:
 			{
 				u64 block;
-				unsigned count = *data++;
+				unsigned count;
+				int set = code == LOG_BALLOC || code == LOG_BALLOC_WIDE;
+				if (code >= LOG_BALLOC_WIDE)
+					data = decode16(data, &count);
+				else
+					count = *data++;
 				data = decode48(data, &block);
-				trace("%s bits 0x%Lx/%x", code == LOG_BALLOC ? "set" : "clear", (L)block, count);
-				int err = update_bitmap(sb, block, count, code == LOG_BALLOC);
+				trace("%s bits 0x%Lx/%x", set ? "set" : "clear", (L)block, count);
+				int err = update_bitmap(sb, block, count, set);
 				warn(">>> bitmap err = %i", err);
 				break;
 			}
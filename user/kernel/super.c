@@ -54,6 +54,8 @@ static struct inode *tux3_alloc_inode(struct super_block *sb)
 	tuxi->btree = (struct btree){ };
 	tuxi->present = 0;
 	tuxi->xcache = NULL;
+	tuxi->excache = NULL;
+	spin_lock_init(&tuxi->excache_lock);
 
 	/* uninitialized stuff by alloc_inode() */
 	tuxi->vfs_inode.i_version = 1;
@@ -90,6 +92,7 @@ static void tux3_put_super(struct super_block *sb)
 	destroy_defer_bfree(&sbi->decycle);
 	destroy_defer_bfree(&sbi->derollup);
 	destroy_defer_bfree(&sbi->defree);
+	release_finger(itable_btree(sbi));
 	iput(sbi->atable);
 	iput(sbi->bitmap);
 	iput(sbi->volmap);
@@ -126,6 +126,7 @@ static inline void *decode48(void *at, u64 *val)
 /* Tux3 disk format */
 
 #define TUX3_MAGIC		"tux3" "\xdd\x09\x03\x10"
+#define TUX3_MAGIC_INCOMPAT	"tux3" "\xdd\x26\x10\x16"
 /*
  * TUX3_LABEL includes the date of the last incompatible disk format change
  * NOTE: Always update this history for each incompatible change!
@@ -137,10 +138,12 @@ static inline void *decode48(void *at, u64 *val)
  * 2008-12-12: Atom dictionary size in disksuper instead of atable->i_size
  * 2009-02-28: Attributes renumbered, rdev added
  * 2009-03-10: Alignment fix of disksuper
+ * 2026-10-16: TUX3_MAGIC_INCOMPAT labels volumes with SB_INCOMPAT flags
  */
 
 #define TUX3_MAGIC_LOG		0x10ad
 #define TUX3_MAGIC_DLEAF	0x1eaf
+#define TUX3_MAGIC_DLEAF_WIDE	0x1ea6
 #define TUX3_MAGIC_ILEAF	0x90de
 
 #define MAX_INODES_BITS 48
@@ -148,6 +151,7 @@ static inline void *decode48(void *at, u64 *val)
 #define MAX_FILESIZE_BITS 60
 #define MAX_FILESIZE (1LL << MAX_FILESIZE_BITS)
 #define MAX_EXTENT (1 << 6)
+#define MAX_WIDE_EXTENT (1 << 16)
 #define SB_LOC (1 << 12)
 #define SB_LEN (1 << 12)	/* this is maximum blocksize */
 
@@ -164,7 +168,7 @@ struct disksuper {
 	/* Update magic on any incompatible format change */
 	char magic[8];		/* Contains TUX3_LABEL magic string */
 	be_u64 birthdate;	/* Volume creation date */
-	be_u64 flags;		/* Need to assign some flags */
+	be_u64 flags;		/* SB_* flags below */
 	be_u64 iroot;		/* Root of the inode table btree */
 	be_u16 blockbits;	/* Shift to get volume block size */
 	be_u16 unused[3];	/* Padding for alignment */
@@ -180,6 +184,21 @@ struct disksuper {
 	be_u32 next_logcount;	/* sb->logcount for the next rollup cycle */
 } __packed;
 
+#define SB_COMPACT_BNODE (1 << 0)	/* New index nodes may use the compact layout */
+#define SB_WIDE_DLEAF (1 << 1)		/* New data leaves hold wide extents */
+
+/*
+ * Older code misreads a volume with any of these flags, so such a volume
+ * gets TUX3_MAGIC_INCOMPAT, which older code does not load.  load_sb()
+ * refuses flags not in this mask.
+ */
+#define SB_INCOMPAT	(SB_COMPACT_BNODE | SB_WIDE_DLEAF)
+
+static inline const char *sb_magic(u64 flags)
+{
+	return flags & SB_INCOMPAT ? TUX3_MAGIC_INCOMPAT : TUX3_MAGIC;
+}
+
 struct root {
 	unsigned depth; /* btree levels not including leaf level */
 	block_t block; /* disk location of btree root */
@@ -191,6 +210,10 @@ struct btree {
 	struct btree_ops *ops;	/* Generic btree low level operations */
 	struct root root;	/* Cached description of btree root */
 	u16 entries_per_leaf;	/* Used in btree leaf splitting */
+	unsigned gen;		/* Bumped by every change to the index */
+	spinlock_t finger_lock;	/* Protects finger and finger_gen */
+	struct cursor *finger;	/* Path of the last probe, see probe() */
+	unsigned finger_gen;	/* Index generation the finger was taken at */
 };
 
 /* Define layout of btree root on disk, endian conversion is elsewhere. */
@@ -212,16 +235,37 @@ struct cursor {
 #define CURSOR_DEBUG
 #ifdef CURSOR_DEBUG
 #define FREE_BUFFER	((void *)0xdbc06505)
-#define FREE_NEXT	((void *)0xdbc06507)
-	int maxlen;
+#define FREE_NEXT	(-1)
 #endif
+	int maxlen;			/* Levels path[] has room for */
 	int len;
+	unsigned prefetch;		/* Leaves to read ahead of advance() */
+	int ahead;			/* Leaf entry prefetched up to */
 	struct path_level {
 		struct buffer_head *buffer;
-		struct index_entry *next;
+		int next;		/* Index of the next entry */
 	} path[];
 };
 
+#define CURSOR_PREFETCH 16	/* Leaves a full scan reads ahead */
+#define CURSOR_PREFETCH_MAX 64
+
+/* State of a btree being built bottom up from keys in order, see btree.c */
+struct bulk_load {
+	struct btree *btree;
+	unsigned fill;			/* Percent of each block to use */
+	unsigned node_fill;		/* Index entries per node at that fill */
+	struct buffer_head *leafbuf;	/* Leaf being filled, or NULL */
+	tuxkey_t leafkey, key;		/* First and last key in the leaf */
+	unsigned items;			/* Items in the leaf */
+	int levels;			/* Index levels started so far */
+	struct bulk_level {
+		tuxkey_t key;		/* First key under the node */
+		unsigned count;
+		struct index_entry *entries;
+	} *level;			/* Index node being filled at each level */
+};
+
 struct stash { struct flink_head head; u64 *pos, *top; };
 
 /* Tux3-specific sb is a handle for the entire volume state */
@@ -297,6 +341,9 @@ enum {
 	LOG_BNODE_SPLIT,	/* Log of spliting bnode to new bnode */
 	LOG_BNODE_ADD,		/* Log of adding bnode entry */
 	LOG_BNODE_UPDATE,	/* Log of bnode entry update */
+	LOG_BALLOC_WIDE,	/* LOG_BALLOC of a wide extent */
+	LOG_BFREE_WIDE,		/* LOG_BFREE of a wide extent */
+	LOG_BFREE_ON_ROLLUP_WIDE, /* LOG_BFREE_ON_ROLLUP of a wide extent */
 	LOG_TYPES
 };
 
@@ -316,6 +363,8 @@ typedef struct {
 	inum_t inum;		/* Inode number */
 	unsigned present;	/* Attributes decoded from or to be encoded to inode table */
 	struct xcache *xcache;	/* Extended attribute cache */
+	struct excache *excache; /* Recent logical to physical mappings */
+	spinlock_t excache_lock; /* Protects excache */
 	struct list_head alloc_list; /* link for deferred inum allocation */
 	struct inode vfs_inode;	/* Generic kernel inode */
 } tuxnode_t;
@@ -368,6 +417,8 @@ typedef struct inode {
 	inum_t inum;
 	unsigned present;
 	struct xcache *xcache;
+	struct excache *excache;
+	spinlock_t excache_lock;
 	struct list_head alloc_list; /* link for deferred inum allocation */
 	/* generic part of inode */
 	struct sb *i_sb;
@@ -438,7 +489,7 @@ typedef struct {
 	char name[];
 } tux_dirent;
 
-/* version:10, count:6, block:48 */
+/* version:10, count:6, block:48, or count:16, block:48 in a wide dleaf */
 struct diskextent { be_u64 block_count_version; };
 #define MAX_GROUP_ENTRIES 255
 /* count:8, keyhi:24 */
@@ -535,6 +586,17 @@ static inline unsigned extent_version(struct diskextent extent)
 	return from_be_u64(*(be_u64 *)&extent) >> 54;
 }
 
+static inline struct diskextent make_wide_extent(block_t block, unsigned count)
+{
+	assert(block < (1ULL << 48) && count - 1 < (1 << 16));
+	return (struct diskextent){ to_be_u64(((u64)(count - 1) << 48) | block) };
+}
+
+static inline unsigned wide_extent_count(struct diskextent extent)
+{
+	return (from_be_u64(*(be_u64 *)&extent) >> 48) + 1;
+}
+
 /* dleaf wrappers */
 
 static inline unsigned dleaf_groups(struct dleaf *leaf)
@@ -552,6 +614,28 @@ static inline void inc_dleaf_groups(struct dleaf *leaf, int n)
 	leaf->groups = to_be_u16(from_be_u16(leaf->groups) + n);
 }
 
+static inline int dleaf_wide(struct dleaf *leaf)
+{
+	return leaf->magic == to_be_u16(TUX3_MAGIC_DLEAF_WIDE);
+}
+
+/* Longest extent the leaf can hold */
+static inline unsigned dleaf_max_extent(struct dleaf *leaf)
+{
+	return dleaf_wide(leaf) ? MAX_WIDE_EXTENT : MAX_EXTENT;
+}
+
+/* Extent in the format of the leaf it goes into */
+static inline struct diskextent make_leaf_extent(struct dleaf *leaf, block_t block, unsigned count)
+{
+	return dleaf_wide(leaf) ? make_wide_extent(block, count) : make_extent(block, count);
+}
+
+static inline unsigned leaf_extent_count(struct dleaf *leaf, struct diskextent extent)
+{
+	return dleaf_wide(leaf) ? wide_extent_count(extent) : extent_count(extent);
+}
+
 typedef void vleaf;
 
 struct btree_ops {
@@ -560,12 +644,15 @@ struct btree_ops {
 	int (*leaf_init)(struct btree *btree, vleaf *leaf);
 	tuxkey_t (*leaf_split)(struct btree *btree, tuxkey_t key, vleaf *from, vleaf *into);
 	void *(*leaf_resize)(struct btree *btree, tuxkey_t key, vleaf *leaf, unsigned size);
+	/* optional: a new leaf holds keys from key up, for bulk loading */
+	void (*leaf_start)(struct btree *btree, tuxkey_t key, vleaf *leaf);
 	void (*leaf_dump)(struct btree *btree, vleaf *leaf);
 	unsigned (*leaf_need)(struct btree *btree, vleaf *leaf);
 	unsigned (*leaf_free)(struct btree *btree, vleaf *leaf);
 	/* return value: 1 - modified, 0 - not modified, < 0 - error */
 	int (*leaf_chop)(struct btree *btree, tuxkey_t key, vleaf *leaf);
-	void (*leaf_merge)(struct btree *btree, vleaf *into, vleaf *from);
+	/* return value: 1 - merged, 0 - does not fit, neither leaf changed */
+	int (*leaf_merge)(struct btree *btree, vleaf *into, vleaf *from);
 	int (*balloc)(struct sb *sb, unsigned blocks, block_t *block);
 	int (*bfree)(struct sb *sb, block_t block, unsigned blocks);
 };
@@ -771,6 +858,7 @@ int devio(int rw, struct block_device *dev, loff_t offset, void *data,
 /* temporary hack for buffer */
 struct buffer_head *blockread(struct address_space *mapping, block_t iblock);
 struct buffer_head *blockget(struct address_space *mapping, block_t iblock);
+void prefetch_blocks(struct address_space *mapping, block_t *blocks, unsigned count);
 
 static inline void blockput(struct buffer_head *buffer)
 {
@@ -807,18 +895,26 @@ struct buffer_head *cursor_leafbuf(struct cursor *cursor);
 void release_cursor(struct cursor *cursor);
 struct cursor *alloc_cursor(struct btree *btree, int);
 void free_cursor(struct cursor *cursor);
-void level_push(struct cursor *cursor, struct buffer_head *buffer, struct index_entry *next);
+void cursor_prefetch(struct cursor *cursor, unsigned leaves);
+void level_push(struct cursor *cursor, struct buffer_head *buffer, int next);
 
 void init_btree(struct btree *btree, struct sb *sb, struct root root, struct btree_ops *ops);
 int alloc_empty_btree(struct btree *btree);
 int free_empty_btree(struct btree *btree);
 struct buffer_head *new_leaf(struct btree *btree);
+void release_finger(struct btree *btree);
 int probe(struct cursor *cursor, tuxkey_t key);
 int advance(struct cursor *cursor);
 tuxkey_t next_key(struct cursor *cursor, int depth);
 int tree_chop(struct btree *btree, struct delete_info *info, millisecond_t deadline);
+int tree_compact(struct btree *btree);
+int tree_rebalance(struct cursor *cursor);
 int btree_insert_leaf(struct cursor *cursor, tuxkey_t key, struct buffer_head *leafbuf);
 void *tree_expand(struct cursor *cursor, tuxkey_t key, unsigned newsize);
+void bulk_load_begin(struct bulk_load *load, struct btree *btree, unsigned fill);
+void *bulk_load_expand(struct bulk_load *load, tuxkey_t key, unsigned size);
+int bulk_load_leaf(struct bulk_load *load, tuxkey_t key, struct buffer_head *leafbuf);
+int bulk_load_end(struct bulk_load *load);
 void show_tree_range(struct btree *btree, tuxkey_t start, unsigned count);
 void show_tree(struct btree *btree);
 int cursor_redirect(struct cursor *cursor);
@@ -846,8 +942,9 @@ unsigned dleaf_free(struct btree *btree, vleaf *leaf);
 void dleaf_dump(struct btree *btree, vleaf *vleaf);
 int dleaf_split_at(vleaf *from, vleaf *into, struct entry *entry,
 		   unsigned blocksize);
-void dleaf_merge(struct btree *btree, vleaf *vinto, vleaf *vfrom);
+int dleaf_merge(struct btree *btree, vleaf *vinto, vleaf *vfrom);
 unsigned dleaf_need(struct btree *btree, vleaf *vleaf);
+unsigned dtree_max_extent(struct sb *sb);
 extern struct btree_ops dtree_ops;
 
 int dwalk_end(struct dwalk *walk);
@@ -862,6 +959,9 @@ void dwalk_copy(struct dwalk *walk, struct dleaf *dest);
 void dwalk_chop(struct dwalk *walk);
 int dwalk_add(struct dwalk *walk, tuxkey_t index, struct diskextent extent);
 
+/* filemap.c */
+void drop_extent_cache(struct inode *inode);
+
 /* iattr.c */
 unsigned encode_asize(unsigned bits);
 void dump_attrs(struct inode *inode);
@@ -943,4 +1043,9 @@ static inline struct buffer_head *vol_bread(struct sb *sb, block_t block)
 {
 	return blockread(mapping(sb->volmap), block);
 }
+
+static inline void vol_prefetch(struct sb *sb, block_t *blocks, unsigned count)
+{
+	prefetch_blocks(mapping(sb->volmap), blocks, count);
+}
 #endif
@@ -0,0 +1,318 @@
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include "trace.h"
+#include "diskio.h"
+#include "buffer.h"
+#include "simdev.h"
+
+#define simtrace trace_off
+
+/*
+ * Simulated block device
+ *
+ * The model keeps one clock per service slot saying when that slot comes
+ * free.  A request takes the slot that frees first, starts when both the
+ * slot and the request are ready, and is busy for latency + seek +
+ * transfer time.  Seek time grows linearly with the distance from the end
+ * of the request scheduled before it, up to the full stroke time for the
+ * whole device, so a depth of one with a big seek looks like a disk and a
+ * deep queue without seek looks like flash.  Requests are scheduled in
+ * the order they are submitted.
+ *
+ * Simulated descriptors are looked up by fd on every submission, which is
+ * a single load while nothing is simulated.  Attach and detach are not
+ * safe against io in flight.
+ */
+
+#define SIM_MAX 8
+#define SIM_DEFAULT_SPAN (1ULL << 30) /* seek span for an empty image */
+
+struct simdev {
+	int fd;
+	struct simconfig config;
+	unsigned long long span, base;
+	pthread_mutex_t lock;
+	off_t head;
+	unsigned long long *slot; /* when each slot comes free */
+	unsigned long long *pending; /* completion times not yet passed */
+	unsigned queued, maxqueued;
+	struct simstats stats;
+	struct simrecord *records;
+	unsigned long recorded;
+};
+
+static pthread_mutex_t sim_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct simdev *sims[SIM_MAX];
+static unsigned sim_count;
+
+static struct { const char *name; struct simconfig config; } sim_presets[] = {
+	{ "hdd", { .latency = 100, .seek = 8000, .bandwidth = 150, .depth = 1 } },
+	{ "ssd", { .latency = 80, .bandwidth = 500, .depth = 32 } },
+	{ "nvme", { .latency = 20, .bandwidth = 3000, .depth = 128 } },
+	{ "ram", { .depth = 1 } },
+};
+
+/* Parse "preset,key=value,...", later settings override earlier ones */
+int sim_config(struct simconfig *config, const char *spec)
+{
+	char *copy = strdup(spec), *save, *token;
+	int err = 0;
+	if (!copy)
+		return -ENOMEM;
+	*config = sim_presets[ARRAY_SIZE(sim_presets) - 1].config;
+	for (token = strtok_r(copy, ",", &save); token; token = strtok_r(NULL, ",", &save)) {
+		char *value = strchr(token, '=');
+		if (!value) {
+			int i;
+			for (i = 0; i < ARRAY_SIZE(sim_presets); i++)
+				if (!strcmp(token, sim_presets[i].name))
+					break;
+			if (i == ARRAY_SIZE(sim_presets)) {
+				err = -EINVAL;
+				break;
+			}
+			*config = sim_presets[i].config;
+			continue;
+		}
+		*value++ = 0;
+		char *end;
+		unsigned long number = strtoul(value, &end, 0);
+		if (!*value || *end) {
+			err = -EINVAL;
+			break;
+		}
+		if (!strcmp(token, "latency"))
+			config->latency = number;
+		else if (!strcmp(token, "seek"))
+			config->seek = number;
+		else if (!strcmp(token, "bandwidth"))
+			config->bandwidth = number;
+		else if (!strcmp(token, "depth"))
+			config->depth = number;
+		else {
+			err = -EINVAL;
+			break;
+		}
+	}
+	if (!config->depth)
+		config->depth = 1;
+	free(copy);
+	return err;
+}
+
+unsigned long long sim_clock(void)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+void sim_sleep(unsigned long long until)
+{
+	struct timespec when = { .tv_sec = until / 1000000000, .tv_nsec = until % 1000000000 };
+	while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &when, NULL) == EINTR)
+		;
+}
+
+struct simdev *sim_lookup(int fd)
+{
+	if (!__atomic_load_n(&sim_count, __ATOMIC_ACQUIRE))
+		return NULL;
+	for (int i = 0; i < SIM_MAX; i++)
+		if (sims[i] && sims[i]->fd == fd)
+			return sims[i];
+	return NULL;
+}
+
+static void free_sim(struct simdev *sim)
+{
+	free(sim->slot);
+	free(sim->pending);
+	free(sim->records);
+	pthread_mutex_destroy(&sim->lock);
+	free(sim);
+}
+
+int sim_attach(int fd, struct simconfig *config)
+{
+	struct simdev *sim = malloc(sizeof(*sim));
+	if (!sim)
+		return -ENOMEM;
+	uint64_t size = 0;
+	fdsize64(fd, &size);
+	*sim = (struct simdev){
+		.fd = fd, .config = *config,
+		.span = size ? size : SIM_DEFAULT_SPAN,
+		.base = sim_clock(),
+		.slot = calloc(config->depth, sizeof(*sim->slot)),
+		.pending = malloc(sizeof(*sim->pending)),
+		.maxqueued = 1,
+		.records = malloc(SIM_RECORDS * sizeof(*sim->records)),
+	};
+	pthread_mutex_init(&sim->lock, NULL);
+	if (!sim->slot || !sim->pending || !sim->records) {
+		free_sim(sim);
+		return -ENOMEM;
+	}
+	pthread_mutex_lock(&sim_lock);
+	int i;
+	for (i = 0; i < SIM_MAX; i++)
+		if (!sims[i] || sims[i]->fd == fd)
+			break;
+	if (i == SIM_MAX) {
+		pthread_mutex_unlock(&sim_lock);
+		free_sim(sim);
+		return -EBUSY;
+	}
+	if (sims[i])
+		free_sim(sims[i]);
+	else
+		sim_count++;
+	sims[i] = sim;
+	pthread_mutex_unlock(&sim_lock);
+	simtrace("fd %i: latency %u, seek %u, bandwidth %u, depth %u", fd,
+		config->latency, config->seek, config->bandwidth, config->depth);
+	return 0;
+}
+
+void sim_detach(int fd)
+{
+	pthread_mutex_lock(&sim_lock);
+	for (int i = 0; i < SIM_MAX; i++) {
+		if (sims[i] && sims[i]->fd == fd) {
+			free_sim(sims[i]);
+			sims[i] = NULL;
+			sim_count--;
+		}
+	}
+	pthread_mutex_unlock(&sim_lock);
+}
+
+int sim_dev(struct dev *dev, const char *spec)
+{
+	struct simconfig config;
+	int err = sim_config(&config, spec);
+	if (err)
+		return err;
+	return sim_attach(dev->fd, &config);
+}
+
+/* A ram image to simulate on, so nothing but the model costs time */
+int sim_ramdisk(loff_t size)
+{
+	int fd = memfd_create("tux3sim", 0);
+	if (fd < 0)
+		return -errno;
+	if (ftruncate(fd, size)) {
+		int err = -errno;
+		close(fd);
+		return err;
+	}
+	return fd;
+}
+
+/* Return when a request submitted now completes */
+unsigned long long sim_schedule(struct simdev *sim, int write, off_t offset, size_t bytes)
+{
+	struct simconfig *config = &sim->config;
+	unsigned long long now = sim_clock(), service = config->latency * 1000ULL;
+	pthread_mutex_lock(&sim->lock);
+	unsigned long long distance = offset > sim->head ? offset - sim->head : sim->head - offset;
+	if (distance) {
+		unsigned long long span = distance < sim->span ? distance : sim->span;
+		service += config->seek * 1000ULL * span / sim->span;
+		sim->stats.seeks++;
+		sim->stats.seek_bytes += distance;
+	}
+	if (config->bandwidth)
+		service += bytes * 1000ULL / config->bandwidth;
+	unsigned which = 0;
+	for (unsigned i = 1; i < config->depth; i++)
+		if (sim->slot[i] < sim->slot[which])
+			which = i;
+	unsigned long long start = sim->slot[which] > now ? sim->slot[which] : now;
+	unsigned long long done = sim->slot[which] = start + service;
+	sim->head = offset + bytes;
+
+	/* queue depth as the device sees it: requests not complete yet */
+	unsigned queued = 0;
+	for (unsigned i = 0; i < sim->queued; i++)
+		if (sim->pending[i] > now)
+			sim->pending[queued++] = sim->pending[i];
+	if (queued == sim->maxqueued) {
+		void *pending = realloc(sim->pending, 2 * sim->maxqueued * sizeof(*sim->pending));
+		if (pending) {
+			sim->pending = pending;
+			sim->maxqueued *= 2;
+		}
+	}
+	if (queued < sim->maxqueued)
+		sim->pending[queued++] = done;
+	sim->queued = queued;
+	if (queued > sim->stats.max_queue)
+		sim->stats.max_queue = queued;
+
+	if (write) {
+		sim->stats.writes++;
+		sim->stats.write_bytes += bytes;
+	} else {
+		sim->stats.reads++;
+		sim->stats.read_bytes += bytes;
+	}
+	sim->stats.service += service;
+	sim->stats.queued += start - now;
+	sim->records[sim->recorded++ % SIM_RECORDS] = (struct simrecord){
+		.submit = now - sim->base, .start = start - sim->base, .done = done - sim->base,
+		.offset = offset, .bytes = bytes, .write = write,
+	};
+	pthread_mutex_unlock(&sim->lock);
+	simtrace("%s %Lx/%zx: start +%Lu, service %Lu", write ? "write" : "read",
+		(long long)offset, bytes, start - now, service);
+	return done;
+}
+
+int get_sim_stats(int fd, struct simstats *stats)
+{
+	struct simdev *sim = sim_lookup(fd);
+	if (!sim)
+		return -ENOENT;
+	pthread_mutex_lock(&sim->lock);
+	*stats = sim->stats;
+	pthread_mutex_unlock(&sim->lock);
+	return 0;
+}
+
+/* Copy out the most recent requests, oldest first */
+unsigned get_sim_records(int fd, struct simrecord *records, unsigned max)
+{
+	struct simdev *sim = sim_lookup(fd);
+	if (!sim)
+		return 0;
+	pthread_mutex_lock(&sim->lock);
+	unsigned long have = sim->recorded < SIM_RECORDS ? sim->recorded : SIM_RECORDS;
+	unsigned count = have < max ? have : max;
+	for (unsigned i = 0; i < count; i++)
+		records[i] = sim->records[(sim->recorded - count + i) % SIM_RECORDS];
+	pthread_mutex_unlock(&sim->lock);
+	return count;
+}
+
+void show_sim_stats(int fd)
+{
+	struct simstats stats;
+	if (get_sim_stats(fd, &stats))
+		return;
+	unsigned long requests = stats.reads + stats.writes;
+	printf("simulated device: %lu reads (%Lu bytes), %lu writes (%Lu bytes)\n",
+		stats.reads, stats.read_bytes, stats.writes, stats.write_bytes);
+	printf("simulated device: %lu seeks over %Lu bytes, queue up to %u\n",
+		stats.seeks, stats.seek_bytes, stats.max_queue);
+	if (requests)
+		printf("simulated device: %Lu us service, %Lu us queued per request\n",
+			stats.service / requests / 1000, stats.queued / requests / 1000);
+}
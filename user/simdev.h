@@ -0,0 +1,61 @@
+#ifndef TUX3_SIMDEV_H
+#define TUX3_SIMDEV_H
+
+#include <sys/types.h>
+
+/*
+ * Simulated block device
+ *
+ * Io to a simulated file descriptor still goes to the file or ram image
+ * behind it, but completes when a simple device model says it would: a
+ * fixed cost per request, a seek in proportion to the distance from where
+ * the last request ended, and a transfer at the configured bandwidth.  The
+ * device works on at most depth requests at once, the rest wait for a
+ * free slot.  Synchronous devio() sleeps until then, asynchronous requests
+ * are held back from their waiter until then.
+ *
+ * Tools attach a model with their own option, anything else that sets up
+ * a buffer cache picks one up from TUX3_SIM, for example TUX3_SIM=hdd or
+ * TUX3_SIM=ssd,depth=4, so the unit tests run on a simulated device too.
+ */
+
+struct simconfig {
+	unsigned latency; /* usecs per request */
+	unsigned seek; /* usecs to seek across the whole device */
+	unsigned bandwidth; /* MB/s, zero for no limit */
+	unsigned depth; /* requests in service at once */
+};
+
+struct simstats {
+	unsigned long reads, writes, seeks;
+	unsigned long long read_bytes, write_bytes, seek_bytes;
+	unsigned long long service, queued; /* nsecs spent in and waiting for service */
+	unsigned max_queue;
+};
+
+/* One request as the model saw it, times in nsecs since the device attached */
+struct simrecord {
+	unsigned long long submit, start, done;
+	off_t offset;
+	unsigned bytes, write;
+};
+
+#define SIM_RECORDS 4096 /* most recent requests kept */
+
+struct simdev;
+struct dev;
+
+int sim_config(struct simconfig *config, const char *spec);
+int sim_attach(int fd, struct simconfig *config);
+void sim_detach(int fd);
+int sim_dev(struct dev *dev, const char *spec);
+int sim_ramdisk(loff_t size);
+struct simdev *sim_lookup(int fd);
+unsigned long long sim_schedule(struct simdev *sim, int write, off_t offset, size_t bytes);
+void sim_sleep(unsigned long long until);
+unsigned long long sim_clock(void);
+int get_sim_stats(int fd, struct simstats *stats);
+unsigned get_sim_records(int fd, struct simrecord *records, unsigned max);
+void show_sim_stats(int fd);
+
+#endif /* !TUX3_SIMDEV_H */
@@ -0,0 +1,219 @@
+/*
+ * Asynchronous io engines
+ *
+ * Licensed under the GPL version 3
+ *
+ * By contributing changes to this file you grant the original copyright holder
+ * the right to distribute those changes under any license.
+ */
+
+#include "tux3user.h"
+#include "diskio.h"
+
+#define BLOCKS 256
+
+static unsigned ended;
+
+static void count_end(struct iorequest *req, int err)
+{
+	ended++;
+}
+
+static void fill(void *data, unsigned size, unsigned seed)
+{
+	for (unsigned i = 0; i < size / sizeof(unsigned); i++)
+		((unsigned *)data)[i] = seed * 0x9e3779b9 + i;
+}
+
+static int check(void *data, unsigned size, unsigned seed)
+{
+	for (unsigned i = 0; i < size / sizeof(unsigned); i++)
+		if (((unsigned *)data)[i] != seed * 0x9e3779b9 + i)
+			return 0;
+	return 1;
+}
+
+static void test_engine(const char *name, int fd)
+{
+	if (init_io_engine(name, 16)) {
+		printf("%s engine not available here\n", name);
+		return;
+	}
+	printf("%s engine\n", io_engine_name());
+	unsigned size = 1 << 12;
+	char *data = malloc(BLOCKS * size), *back = malloc(BLOCKS * size);
+
+	/* many more requests than queue depth, two vectors each */
+	struct iorequest reqs[BLOCKS / 2];
+	struct iovec vecs[BLOCKS];
+	struct iobatch batch = IOBATCH_INIT;
+	ended = 0;
+	for (int i = 0; i < BLOCKS; i++)
+		fill(data + i * size, size, i);
+	for (int i = 0; i < BLOCKS / 2; i++) {
+		vecs[2 * i] = (struct iovec){ data + 2 * i * size, size };
+		vecs[2 * i + 1] = (struct iovec){ data + (2 * i + 1) * size, size };
+		reqs[i] = (struct iorequest){
+			.fd = fd, .rw = 1, .iov = vecs + 2 * i, .iovcnt = 2,
+			.offset = 2 * i * size, .end_io = count_end };
+		assert(!submit_io(reqs + i, &batch));
+	}
+	assert(!wait_iobatch(&batch));
+	assert(ended == BLOCKS / 2 && !batch.inflight);
+	assert(!diskread(fd, back, BLOCKS * size, 0));
+	for (int i = 0; i < BLOCKS; i++)
+		assert(check(back + i * size, size, i));
+
+	/* read back in reverse, one vector per request */
+	memset(back, 0, BLOCKS * size);
+	for (int i = 0; i < BLOCKS / 2; i++) {
+		int block = BLOCKS - 1 - i;
+		vecs[i] = (struct iovec){ back + block * size, size };
+		reqs[i] = (struct iorequest){
+			.fd = fd, .iov = vecs + i, .iovcnt = 1,
+			.offset = block * size };
+		assert(!submit_io(reqs + i, &batch));
+	}
+	assert(!wait_iobatch(&batch));
+	for (int i = BLOCKS / 2; i < BLOCKS; i++)
+		assert(check(back + i * size, size, i));
+
+	/* reading past the end fails the batch, not the other requests */
+	struct iobatch bad = IOBATCH_INIT;
+	vecs[0] = (struct iovec){ back, size };
+	vecs[1] = (struct iovec){ back + size, size };
+	reqs[0] = (struct iorequest){ .fd = fd, .iov = vecs, .iovcnt = 1, .offset = 1LL << 40 };
+	reqs[1] = (struct iorequest){ .fd = fd, .iov = vecs + 1, .iovcnt = 1 };
+	assert(!submit_io(reqs, &bad));
+	assert(!submit_io(reqs + 1, &bad));
+	assert(wait_iobatch(&bad) == -EIO);
+	assert(check(back + size, size, 0));
+
+	/* dirty buffers flushed with many writes in flight */
+	struct dev *dev = &(struct dev){ .fd = fd, .bits = 12 };
+	map_t *map = new_map(dev, NULL);
+	for (block_t block = 0; block < BLOCKS; block++) {
+		struct buffer_head *buffer = blockget(map, block);
+		fill(bufdata(buffer), size, block + 1000);
+		blockput(set_buffer_dirty(buffer));
+	}
+	assert(!flush_buffers(map));
+	assert(list_empty(&map->dirty));
+	for (block_t block = 0; block < BLOCKS; block++) {
+		struct buffer_head *buffer = peekblk(map, block);
+		assert(buffer && buffer_clean(buffer));
+		blockput(buffer);
+	}
+	assert(!diskread(fd, back, BLOCKS * size, 0));
+	for (int i = 0; i < BLOCKS; i++)
+		assert(check(back + i * size, size, i + 1000));
+
+	/* and read back through the same path */
+	invalidate_buffers(map);
+	struct iobatch reads = IOBATCH_INIT;
+	for (block_t block = 0; block < BLOCKS; block++) {
+		struct buffer_head *buffer = blockget(map, block);
+		assert(buffer_empty(buffer));
+		assert(!submit_bufio(buffer, 0, block, &reads, 1));
+		blockput(buffer);
+	}
+	assert(!wait_iobatch(&reads));
+	for (block_t block = 0; block < BLOCKS; block++) {
+		struct buffer_head *buffer = peekblk(map, block);
+		assert(buffer && buffer_clean(buffer));
+		assert(check(bufdata(buffer), size, block + 1000));
+		blockput(buffer);
+	}
+	free_map(map);
+	free(data);
+	free(back);
+}
+
+/* writeback goes out in block order, in runs no bigger than the limit */
+static void test_flush(int fd)
+{
+	unsigned size = 1 << 12, limit = 16 * size;
+	struct dev *dev = &(struct dev){ .fd = fd, .bits = 12 };
+	map_t *map = new_map(dev, NULL);
+	char *back = malloc(BLOCKS * size);
+	for (block_t i = 0; i < BLOCKS; i++) {
+		block_t block = (i * 97) % BLOCKS;
+		if (block == 100)
+			continue;
+		struct buffer_head *buffer = blockget(map, block);
+		fill(bufdata(buffer), size, block + 2000);
+		blockput(set_buffer_dirty(buffer));
+	}
+	struct flush_stats before, after;
+	get_flush_stats(&before);
+	set_flush_limit(limit);
+	assert(!flush_buffers(map));
+	set_flush_limit(FLUSH_LIMIT);
+	get_flush_stats(&after);
+	unsigned writes = after.writes - before.writes;
+	printf("%lu buffers in %u writes\n", after.buffers - before.buffers, writes);
+	assert(after.buffers - before.buffers == BLOCKS - 1);
+	assert(writes == (100 + 15) / 16 + (BLOCKS - 101 + 15) / 16);
+	assert(list_empty(&map->dirty));
+	assert(!diskread(fd, back, BLOCKS * size, 0));
+	for (int i = 0; i < BLOCKS; i++)
+		assert(i == 100 || check(back + i * size, size, i + 2000));
+	free_map(map);
+	free(back);
+}
+
+/* buffer batches go out sorted, to blocks other than their index */
+static void test_batch(int fd)
+{
+	unsigned size = 1 << 12;
+	char *back = malloc(BLOCKS * size);
+	struct dev *dev = &(struct dev){ .fd = fd, .bits = 12 };
+	map_t *map = new_map(dev, NULL);
+	struct bufvec vec[BLOCKS];
+	for (unsigned i = 0; i < BLOCKS; i++) {
+		struct buffer_head *buffer = blockget(map, i);
+		fill(bufdata(buffer), size, i + 4000);
+		vec[i] = (struct bufvec){ .buffer = buffer, .block = BLOCKS - 1 - i };
+	}
+	struct iobatch batch = IOBATCH_INIT;
+	assert(!submit_bufvec(vec, BLOCKS, 1, &batch, 0));
+	for (unsigned i = 0; i < BLOCKS; i++)
+		blockput(vec[i].buffer);
+	assert(!wait_iobatch(&batch));
+	assert(!diskread(fd, back, BLOCKS * size, 0));
+	for (int i = 0; i < BLOCKS; i++)
+		assert(check(back + i * size, size, BLOCKS - 1 - i + 4000));
+	invalidate_buffers(map);
+	for (unsigned i = 0; i < BLOCKS; i++)
+		vec[i] = (struct bufvec){ .buffer = blockget(map, i), .block = BLOCKS - 1 - i };
+	assert(!submit_bufvec(vec, BLOCKS, 0, &batch, 1));
+	for (unsigned i = 0; i < BLOCKS; i++)
+		blockput(vec[i].buffer);
+	assert(!wait_iobatch(&batch));
+	for (block_t block = 0; block < BLOCKS; block++) {
+		struct buffer_head *buffer = peekblk(map, block);
+		assert(buffer_clean(buffer) && check(bufdata(buffer), size, block + 4000));
+		blockput(buffer);
+	}
+	free_map(map);
+	free(back);
+}
+
+int main(int argc, char *argv[])
+{
+	char *name = argc > 1 ? argv[1] : "asyncio.img";
+	int fd = open(name, O_CREAT|O_TRUNC|O_RDWR, S_IRUSR|S_IWUSR);
+	assert(fd >= 0);
+	init_buffers(&(struct dev){ .fd = fd, .bits = 12 }, 1 << 22, 0);
+	test_engine("uring", fd);
+	test_engine("threads", fd);
+	test_engine("sync", fd);
+	test_engine(NULL, fd);
+	test_flush(fd);
+	test_batch(fd);
+	assert(init_io_engine("bogus", 0) == -EINVAL);
+	exit_io_engine();
+	close(fd);
+	unlink(name);
+	return 0;
+}
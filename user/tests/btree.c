@@ -107,8 +107,14 @@ out:
 	return leaf->entries + at;
 }
 
-static void uleaf_merge(struct btree *btree, vleaf *into, vleaf *from)
+static int uleaf_merge(struct btree *btree, vleaf *into, vleaf *from)
 {
+	struct uleaf *leaf = into, *leaf2 = from;
+	if (leaf2->count > uleaf_free(btree, leaf))
+		return 0;
+	veccopy(leaf->entries + leaf->count, leaf2->entries, leaf2->count);
+	leaf->count += leaf2->count;
+	return 1;
 }
 
 static struct btree_ops ops = {
@@ -156,6 +162,231 @@ static void tree_expand_test(struct cursor *cursor, tuxkey_t key)
 	release_cursor(cursor);
 }
 
+/* probe key from the path to another key, then from the root */
+static void finger_test(struct btree *btree, tuxkey_t from, tuxkey_t key)
+{
+	struct cursor *cursor = alloc_cursor(btree, 0), *cursor2 = alloc_cursor(btree, 0);
+	assert(!probe(cursor, from));
+	release_cursor(cursor);
+	assert(btree->finger && btree->finger->len == btree->root.depth + 1);
+	assert(!probe(cursor, key));
+	release_finger(btree);
+	assert(!probe(cursor2, key));
+	assert(cursor->len == cursor2->len);
+	for (int i = 0; i < cursor->len; i++) {
+		assert(cursor->path[i].buffer == cursor2->path[i].buffer);
+		assert(cursor->path[i].next == cursor2->path[i].next);
+	}
+	release_cursor(cursor);
+	release_cursor(cursor2);
+	free_cursor(cursor);
+	free_cursor(cursor2);
+}
+
+/*
+ * The tree under test stands in for the inode table, the one btree that
+ * is not embedded in an inode, so marking it dirty touches no inode.
+ */
+static struct btree *test_btree(struct sb *sb)
+{
+	struct btree *btree = itable_btree(sb);
+	*btree = (struct btree){ };
+	init_btree(btree, sb, no_root, &ops);
+	return btree;
+}
+
+/* bulk load keys in order and check them all, and the layout */
+static void bulk_load_test(struct sb *sb, unsigned count, unsigned fill)
+{
+	struct btree *btree = test_btree(sb);
+	struct bulk_load load;
+	bulk_load_begin(&load, btree, fill);
+	for (unsigned i = 0; i < count; i++) {
+		struct uentry *entry = bulk_load_expand(&load, 3 * i, 1);
+		assert(!IS_ERR(entry));
+		*entry = (struct uentry){ .key = 3 * i, .val = i };
+	}
+	assert(!bulk_load_end(&load));
+	assert(has_root(btree));
+
+	/* leaves are full to the fill factor, in order on disk */
+	unsigned perleaf = (btree->entries_per_leaf * fill + 99) / 100, leaves = 0, seen = 0;
+	block_t last = 0;
+	struct cursor *cursor = alloc_cursor(btree, 0);
+	assert(!probe(cursor, 0));
+	do {
+		struct buffer_head *leafbuf = cursor_leafbuf(cursor);
+		struct uleaf *leaf = bufdata(leafbuf);
+		assert(bufindex(leafbuf) > last);
+		last = bufindex(leafbuf);
+		assert(leaf->count == min(perleaf, count - seen));
+		for (unsigned i = 0; i < leaf->count; i++, seen++)
+			assert(leaf->entries[i].key == 3 * seen && leaf->entries[i].val == seen);
+		leaves++;
+	} while (advance(cursor));
+	assert(seen == count);
+	printf("bulk load %u keys at %u%%: %u leaves, depth %i\n", count, fill, leaves, btree->root.depth);
+
+	/* every key probes to the leaf holding it, keys between to the one before */
+	for (unsigned i = 0; i < 3 * count; i++) {
+		assert(!probe(cursor, i));
+		struct uleaf *leaf = bufdata(cursor_leafbuf(cursor));
+		assert(leaf->entries[0].key <= i);
+		assert(leaf->entries[leaf->count - 1].key >= i - i % 3);
+		release_cursor(cursor);
+	}
+	free_cursor(cursor);
+	release_finger(btree);
+}
+
+/*
+ * Compact index nodes: leaves added in order at keys step apart, probed
+ * back, then chopped.  Steps too wide for a compact node make the nodes
+ * holding them go back to the original layout.
+ */
+static void compact_test(struct sb *sb, tuxkey_t step, unsigned count)
+{
+	struct btree *btree = test_btree(sb);
+	assert(!alloc_empty_btree(btree));
+	struct cursor *cursor = alloc_cursor(btree, count); /* tiny nodes, deep tree */
+	block_t blocks[count + 1];
+	assert(!probe(cursor, 0));
+	blocks[0] = bufindex(cursor_leafbuf(cursor));
+	for (unsigned i = 1; i <= count; i++) {
+		struct buffer_head *buffer = new_leaf(btree);
+		assert(!IS_ERR(buffer));
+		mark_buffer_dirty_non(buffer);
+		blocks[i] = bufindex(buffer);
+		assert(!btree_insert_leaf(cursor, i * step, buffer));
+	}
+	release_cursor(cursor);
+	for (unsigned i = 0; i <= count; i++) {
+		assert(!probe(cursor, i * step));
+		assert(bufindex(cursor_leafbuf(cursor)) == blocks[i]);
+		assert(next_key(cursor, btree->root.depth) == (i < count ? (i + 1) * step : -1));
+		release_cursor(cursor);
+		assert(!probe(cursor, i * step + step / 2));
+		assert(bufindex(cursor_leafbuf(cursor)) == blocks[i]);
+		release_cursor(cursor);
+	}
+	printf("%u leaves %Lx apart: depth %i\n", count + 1, (L)step, btree->root.depth);
+	free_cursor(cursor);
+	release_finger(btree);
+	tree_chop(btree, &(struct delete_info){ .key = 0 }, 0);
+	assert(btree->root.depth == 1);
+}
+
+/* walk the leaves checking every key left is in order, return the leaf count */
+static unsigned check_leaves(struct btree *btree, char *gone, unsigned count)
+{
+	struct cursor *cursor = alloc_cursor(btree, 0);
+	unsigned leaves = 0, key = 0;
+	assert(!probe(cursor, 0));
+	do {
+		struct uleaf *leaf = bufdata(cursor_leafbuf(cursor));
+		for (unsigned i = 0; i < leaf->count; i++, key++) {
+			while (gone[key])
+				key++;
+			assert(leaf->entries[i].key == key && leaf->entries[i].val == key);
+		}
+		leaves++;
+	} while (advance(cursor));
+	while (key < count)
+		assert(gone[key++]);
+	free_cursor(cursor);
+	return leaves;
+}
+
+static void delete_key(struct cursor *cursor, unsigned key)
+{
+	assert(!probe(cursor, key));
+	assert(!cursor_redirect(cursor));
+	struct buffer_head *leafbuf = cursor_leafbuf(cursor);
+	struct uleaf *leaf = bufdata(leafbuf);
+	unsigned at = uleaf_seek(cursor->btree, key, leaf);
+	assert(at < leaf->count && leaf->entries[at].key == key);
+	vecmove(leaf->entries + at, leaf->entries + at + 1, --leaf->count - at);
+	mark_buffer_dirty_non(leafbuf);
+}
+
+/*
+ * Delete keys in a scattered order, rebalancing after each, until the
+ * tree is empty.  Then thin out a full tree without rebalancing and
+ * compact it: no two neighbouring leaves are left that would fit in one.
+ */
+static void rebalance_test(struct sb *sb, unsigned count)
+{
+	struct btree *btree = test_btree(sb);
+	struct bulk_load load;
+	bulk_load_begin(&load, btree, 100);
+	for (unsigned i = 0; i < count; i++) {
+		struct uentry *entry = bulk_load_expand(&load, i, 1);
+		assert(!IS_ERR(entry));
+		*entry = (struct uentry){ .key = i, .val = i };
+	}
+	assert(!bulk_load_end(&load));
+	char gone[count + 1];
+	memset(gone, 0, sizeof(gone));
+	int depth = btree->root.depth;
+	unsigned leaves = check_leaves(btree, gone, count);
+
+	struct cursor *cursor = alloc_cursor(btree, 0);
+	assert(count % 11);
+	for (unsigned i = 0, key = 0; i < count; i++, key = (key + 11) % count) {
+		delete_key(cursor, key);
+		gone[key] = 1;
+		assert(!tree_rebalance(cursor));
+		if (i == count * 7 / 8) {
+			unsigned now = check_leaves(btree, gone, count);
+			printf("rebalance %u of %u keys: %u leaves, depth %i\n",
+			       count - i - 1, count, now, btree->root.depth);
+			assert(now < leaves);
+		}
+	}
+	check_leaves(btree, gone, count);
+	printf("rebalance 0 of %u keys: depth %i\n", count, btree->root.depth);
+	assert(btree->root.depth < depth);
+	assert(!tree_compact(btree));
+	assert(btree->root.depth == 1 && check_leaves(btree, gone, count) == 1);
+	release_finger(btree);
+	tree_chop(btree, &(struct delete_info){ .key = 0 }, 0);
+
+	btree = test_btree(sb);
+	bulk_load_begin(&load, btree, 100);
+	for (unsigned i = 0; i < count; i++) {
+		struct uentry *entry = bulk_load_expand(&load, i, 1);
+		assert(!IS_ERR(entry));
+		*entry = (struct uentry){ .key = i, .val = i };
+	}
+	assert(!bulk_load_end(&load));
+	memset(gone, 0, sizeof(gone));
+	for (unsigned key = 0; key < count; key++) {
+		if (!(key % 4))
+			continue;
+		delete_key(cursor, key);
+		gone[key] = 1;
+		release_cursor(cursor);
+	}
+	release_finger(btree);
+	assert(check_leaves(btree, gone, count) == leaves);
+	assert(!tree_compact(btree));
+	unsigned compacted = check_leaves(btree, gone, count);
+	printf("compact %u of %u keys: %u leaves, depth %i\n",
+	       (count + 3) / 4, count, compacted, btree->root.depth);
+	assert(compacted <= (leaves + 2) / 3);
+	assert(btree->root.depth <= depth);
+	assert(!probe(cursor, 0));
+	unsigned prev = btree->entries_per_leaf;
+	do {
+		struct uleaf *leaf = bufdata(cursor_leafbuf(cursor));
+		assert(prev + leaf->count > btree->entries_per_leaf);
+		prev = leaf->count;
+	} while (advance(cursor));
+	free_cursor(cursor);
+	release_finger(btree);
+	tree_chop(btree, &(struct delete_info){ .key = 0 }, 0);
+}
+
 int main(int argc, char *argv[])
 {
 	struct dev *dev = &(struct dev){ .bits = 6 };
@@ -165,39 +396,47 @@ int main(int argc, char *argv[])
 	init_buffers(dev, 1 << 20, 0);
 	sb->entries_per_node = calc_entries_per_node(sb->blocksize),
 	printf("entries_per_node = %i\n", sb->entries_per_node);
-	struct btree btree = { };
-	init_btree(&btree, sb, no_root, &ops);
-	int err = alloc_empty_btree(&btree);
+	struct btree *btree = test_btree(sb);
+	int err = alloc_empty_btree(btree);
 	assert(!err);
 
 	if (0) {
-		struct buffer_head *buffer = new_leaf(&btree);
+		struct buffer_head *buffer = new_leaf(btree);
 		for (int i = 0; i < 7; i++)
-			uleaf_insert(&btree, bufdata(buffer), i, i + 0x100);
+			uleaf_insert(btree, bufdata(buffer), i, i + 0x100);
 		mark_buffer_dirty_non(buffer);
-		uleaf_dump(&btree, bufdata(buffer));
+		uleaf_dump(btree, bufdata(buffer));
 		exit(0);
 	}
 
 	/* tree_expand() test, and reverse order */
-	struct cursor *cursor = alloc_cursor(&btree, 8); /* +8 for new depth */
-	int until_new_depth = sb->entries_per_node * btree.entries_per_leaf + 1;
+	struct cursor *cursor = alloc_cursor(btree, 8); /* +8 for new depth */
+	int until_new_depth = sb->entries_per_node * btree->entries_per_leaf + 1;
 	for (int key = 0; key < until_new_depth; key++)
 		tree_expand_test(cursor, key);
-	show_tree(&btree);
-	tree_chop(&btree, &(struct delete_info){ .key = 0 }, 0);
+	show_tree(btree);
+	/* finger search: same leaf, neighbours and anywhere */
+	assert(btree->root.depth > 1);
+	for (int key = 0; key < until_new_depth; key++) {
+		finger_test(btree, key, key);
+		finger_test(btree, key, key + 1);
+		finger_test(btree, key + 1, key);
+		finger_test(btree, key, rand() % (until_new_depth + 10));
+	}
+	finger_test(btree, 0, -1);
+	tree_chop(btree, &(struct delete_info){ .key = 0 }, 0);
 
 	for (int key = until_new_depth * 100; key >= 0; key -= 100)
 		tree_expand_test(cursor, key);
-	show_tree(&btree);
+	show_tree(btree);
 	free_cursor(cursor);
-	tree_chop(&btree, &(struct delete_info){ .key = 0 }, 0);
+	tree_chop(btree, &(struct delete_info){ .key = 0 }, 0);
 
 	/* insert_node test */
-	cursor = alloc_cursor(&btree, 1); /* +1 for new depth */
+	cursor = alloc_cursor(btree, 1); /* +1 for new depth */
 	assert(!probe(cursor, 0));
 	for (int i = 0; i < sb->entries_per_node - 1; i++) {
-		struct buffer_head *buffer = new_leaf(&btree);
+		struct buffer_head *buffer = new_leaf(btree);
 		trace("buffer: index %Lx", (L)buffer->index);
 		assert(!IS_ERR(buffer));
 		mark_buffer_dirty_non(buffer);
@@ -206,12 +445,12 @@ int main(int argc, char *argv[])
 	release_cursor(cursor);
 	/* insert key=1 after key=0 */
 	assert(!probe(cursor, 0));
-	struct buffer_head *buffer = new_leaf(&btree);
+	struct buffer_head *buffer = new_leaf(btree);
 	assert(!IS_ERR(buffer));
 	mark_buffer_dirty_non(buffer);
 	btree_insert_leaf(cursor, 1, buffer);
 	/* probe same key with cursor2 */
-	struct cursor *cursor2 = alloc_cursor(&btree, 0);
+	struct cursor *cursor2 = alloc_cursor(btree, 0);
 	assert(!probe(cursor2, 1));
 	for (int i = 0; i < cursor->len; i++) {
 		assert(cursor->path[i].buffer == cursor2->path[i].buffer);
@@ -221,6 +460,20 @@ int main(int argc, char *argv[])
 	release_cursor(cursor2);
 	free_cursor(cursor);
 	free_cursor(cursor2);
-	tree_chop(&btree, &(struct delete_info){ .key = 0 }, 0);
+	tree_chop(btree, &(struct delete_info){ .key = 0 }, 0);
+
+	bulk_load_test(sb, 0, 100);
+	bulk_load_test(sb, 1, 100);
+	bulk_load_test(sb, sb->entries_per_node * btree->entries_per_leaf * 5, 100);
+	bulk_load_test(sb, sb->entries_per_node * btree->entries_per_leaf * 5, 70);
+	rebalance_test(sb, sb->entries_per_node * btree->entries_per_leaf * 5);
+
+	/* the same on a volume that wants compact index nodes */
+	sb->super.flags = to_be_u64(SB_COMPACT_BNODE);
+	bulk_load_test(sb, sb->entries_per_node * btree->entries_per_leaf * 5, 100);
+	compact_test(sb, 1, 100);
+	compact_test(sb, 1ULL << 30, 100);
+	compact_test(sb, 1ULL << 40, 100);
+	rebalance_test(sb, sb->entries_per_node * btree->entries_per_leaf * 5);
 	exit(0);
 }
@@ -0,0 +1,90 @@
+/*
+ * Buffer cache under concurrent use
+ *
+ * Licensed under the GPL version 3
+ *
+ * By contributing changes to this file you grant the original copyright holder
+ * the right to distribute those changes under any license.
+ */
+
+#include <sys/time.h>
+#include "tux3user.h"
+
+#define MAX_THREADS 8
+
+/* Fake device: every block reads back as its own block number */
+static int fake_io(struct buffer_head *buffer, int write)
+{
+	if (!write)
+		*(block_t *)bufdata(buffer) = bufindex(buffer);
+	set_buffer_clean(buffer);
+	return 0;
+}
+
+struct worker {
+	pthread_t thread;
+	map_t *map;
+	unsigned seed, ops, span;
+};
+
+static void *lookups(void *arg)
+{
+	struct worker *worker = arg;
+	for (unsigned i = 0; i < worker->ops; i++) {
+		block_t block = rand_r(&worker->seed) % worker->span;
+		struct buffer_head *buffer = blockread(worker->map, block);
+		assert(buffer);
+		assert(bufindex(buffer) == block);
+		assert(*(block_t *)bufdata(buffer) == block);
+		blockput(buffer);
+	}
+	return NULL;
+}
+
+static double run(map_t *map, int threads, unsigned ops, unsigned span)
+{
+	struct worker workers[MAX_THREADS];
+	struct timeval start, stop;
+
+	gettimeofday(&start, NULL);
+	for (int i = 0; i < threads; i++) {
+		workers[i] = (struct worker){ .map = map, .seed = i + 1, .ops = ops, .span = span };
+		assert(!pthread_create(&workers[i].thread, NULL, lookups, workers + i));
+	}
+	for (int i = 0; i < threads; i++)
+		assert(!pthread_join(workers[i].thread, NULL));
+	gettimeofday(&stop, NULL);
+	return (stop.tv_sec - start.tv_sec) + (stop.tv_usec - start.tv_usec) / 1e6;
+}
+
+int main(int argc, char *argv[])
+{
+	struct dev *dev = &(struct dev){ .bits = 8 };
+	init_buffers(dev, 1 << 20, 0);
+	struct pool_stats stats;
+	get_pool_stats(BUFFER_POOL_DATA, &stats);
+	unsigned max = stats.max_buffers, ops = argc > 1 ? atoi(argv[1]) : 200000;
+
+	/* Stress: working set three times the pool, so lookups race with eviction */
+	map_t *map = new_map(dev, fake_io);
+	for (int threads = 1; threads <= MAX_THREADS; threads *= 2) {
+		double secs = run(map, threads, ops / 4, 3 * max);
+		printf("stress %i threads: %.0f lookups/sec\n", threads, threads * (ops / 4) / secs);
+	}
+	assert(!count_buffers());
+	get_pool_stats(BUFFER_POOL_DATA, &stats);
+	assert(stats.evictions && stats.buffers <= stats.max_buffers);
+	free_map(map);
+
+	/* Benchmark: all hits, each thread doing the same number of lookups */
+	map = new_map(dev, fake_io);
+	run(map, 1, max / 2, max / 2);
+	for (int threads = 1; threads <= MAX_THREADS; threads *= 2) {
+		double secs = run(map, threads, ops, max / 2);
+		printf("hits %i threads: %.0f lookups/sec\n", threads, threads * ops / secs);
+	}
+	assert(!count_buffers());
+	free_map(map);
+	show_buffer_pools();
+	exit(0);
+}
@@ -1,4 +1,5 @@
 #include "tux3user.h"
+#include "diskio.h"
 
 int main(int argc, char *argv[])
 {
@@ -13,5 +14,265 @@ int main(int argc, char *argv[])
 	printf("get %p\n", blockget(map, 2));
 	printf("get %p\n", blockget(map, 1));
 	show_dirty_buffers(map);
+
+	struct pool_stats data, before, after;
+	get_pool_stats(BUFFER_POOL_DATA, &data);
+	unsigned max = data.max_buffers, many = max / 2 < 1000 ? max / 2 : 1000;
+
+	/* hash grows incrementally and every buffer stays reachable */
+	map_t *map2 = new_map(dev, NULL);
+	for (block_t block = 0; block < many; block++) {
+		struct buffer_head *buffer = blockget(map2, block * 7);
+		assert(buffer && bufindex(buffer) == block * 7);
+		for (block_t i = 0; i <= block; i += 7) {
+			struct buffer_head *found = peekblk(map2, i * 7);
+			assert(found && bufindex(found) == i * 7);
+			blockput(found);
+		}
+		blockput(buffer);
+	}
+	int grown = 0;
+	for (int i = 0; i < BUFFER_SHARDS; i++)
+		grown |= map2->shard[i].hashbits > BUFFER_HASH_BITS;
+	assert(map_buffers(map2) == many && grown);
+	for (block_t block = 0; block < many; block++) {
+		struct buffer_head *buffer = blockget(map2, block * 7);
+		assert(map_buffers(map2) == many);
+		blockput(buffer);
+	}
+	free_map(map2);
+
+	/* 2q: blocks used more than once survive big scans, pinned blocks stay put */
+	map_t *hot = new_map(dev, NULL), *scan = new_map(dev, NULL);
+	unsigned hotset = max / 64, pins = max / 128;
+	struct buffer_head *pinned[pins];
+	for (int i = 0; i < pins; i++)
+		pinned[i] = blockget(hot, max + i);
+	block_t next = 0;
+	for (int round = 0; round < 3; round++) {
+		for (block_t block = 0; block < hotset; block++)
+			blockput(blockget(hot, block));
+		for (int i = 0; i < (round < 2 ? max + max / 8 : 5 * max); i++)
+			blockput(blockget(scan, next++));
+	}
+	for (block_t block = 0; block < hotset; block++) {
+		struct buffer_head *buffer = peekblk(hot, block);
+		assert(buffer);
+		blockput(buffer);
+	}
+	for (int i = 0; i < pins; i++) {
+		assert(peekblk(hot, max + i) == pinned[i]);
+		blockput(pinned[i]);
+		blockput(pinned[i]);
+	}
+
+	/* plain lru lets the same scan flush them */
+	assert(!set_buffer_policy("lru"));
+	for (int i = 0; i < 2 * max; i++)
+		blockput(blockget(scan, next++));
+	assert(!peekblk(hot, 0) && !peekblk(hot, max));
+
+	/* metadata has its own budget, data streaming can not evict it */
+	map_t *meta = new_map(dev, NULL);
+	set_map_pool(meta, BUFFER_POOL_META);
+	get_pool_stats(BUFFER_POOL_META, &before);
+	unsigned metaset = before.max_buffers / 2 < 100 ? before.max_buffers / 2 : 100;
+	for (block_t block = 0; block < metaset; block++)
+		blockput(blockget(meta, block));
+	for (int i = 0; i < 3 * max; i++)
+		blockput(blockget(scan, next++));
+	for (block_t block = 0; block < metaset; block++)
+		blockput(blockget(meta, block));
+	get_pool_stats(BUFFER_POOL_META, &after);
+	assert(after.hits - before.hits == metaset);
+	assert(after.misses - before.misses == metaset);
+	assert(after.evictions == before.evictions);
+	get_pool_stats(BUFFER_POOL_DATA, &after);
+	assert(after.evictions && after.buffers <= after.max_buffers);
+	show_buffer_pools();
+	free_map(meta);
+	free_map(hot);
+	free_map(scan);
+
+	/* mapped volume: reads borrow the mapping, writes still reach the disk */
+	unsigned pagesize = sysconf(_SC_PAGESIZE), blocks = 16;
+	int fd = open("buffer.img", O_CREAT|O_TRUNC|O_RDWR, S_IRUSR|S_IWUSR);
+	unsigned char *block = malloc(pagesize);
+	for (int i = 0; i < blocks; i++) {
+		memset(block, i, pagesize);
+		assert(!diskwrite(fd, block, pagesize, i * pagesize));
+	}
+	struct dev *vol = &(struct dev){ .fd = fd, .bits = ffs(pagesize) - 1 };
+	assert(!map_dev(vol) && !(vol->flags & DEV_RDONLY));
+	map_t *volmap = new_map(vol, NULL);
+	struct buffer_head *buffer = blockread(volmap, 5);
+	assert(bufdata(buffer) == vol->mapping + 5 * pagesize);
+	assert(*(unsigned char *)bufdata(buffer) == 5);
+	memset(bufdata(buffer), 0xaa, pagesize);
+	blockput(set_buffer_dirty(buffer));
+	assert(!flush_buffers(volmap));
+	assert(!diskread(fd, block, pagesize, 5 * pagesize) && block[0] == 0xaa);
+	memset(block, 0x55, pagesize);
+	assert(!diskwrite(fd, block, pagesize, 5 * pagesize));
+	dev_written(vol, 5 * pagesize, pagesize);
+	buffer = peekblk(volmap, 5);
+	assert(*(unsigned char *)bufdata(buffer) == 0x55);
+	blockput(buffer);
+	/* evicted buffers get their own memory back, new blocks never borrow */
+	invalidate_buffers(volmap);
+	assert(!map_buffers(volmap));
+	for (block_t i = 0; i < blocks; i++) {
+		buffer = blockget(volmap, i);
+		assert(bufdata(buffer) < vol->mapping || bufdata(buffer) >= vol->mapping + vol->mapsize);
+		blockput(buffer);
+	}
+	/* other maps only borrow from a read-only volume */
+	struct iobatch batch = IOBATCH_INIT;
+	map_t *file = new_map(vol, dev_errio);
+	buffer = blockget(file, 0);
+	assert(!submit_bufio(buffer, 0, 3, &batch, 1) && !wait_iobatch(&batch));
+	assert(bufdata(buffer) != vol->mapping + 3 * pagesize);
+	assert(*(unsigned char *)bufdata(buffer) == 3);
+	blockput(buffer);
+	free_map(file);
+	free_map(volmap);
+	unmap_dev(vol);
+	int rofd = open("buffer.img", O_RDONLY);
+	struct dev *ro = &(struct dev){ .fd = rofd, .bits = vol->bits };
+	assert(!map_dev(ro) && (ro->flags & DEV_RDONLY));
+	file = new_map(ro, dev_errio);
+	buffer = blockget(file, 0);
+	assert(!submit_bufio(buffer, 0, 3, &batch, 1) && !wait_iobatch(&batch));
+	assert(bufdata(buffer) == ro->mapping + 3 * pagesize);
+	assert(buffer_clean(buffer));
+	blockput(buffer);
+	free_map(file);
+	unmap_dev(ro);
+	close(rofd);
+
+	/* stats: per map and global counts, state counts, io latency */
+	struct dev *plain = &(struct dev){ .fd = fd, .bits = vol->bits };
+	struct map_stats mstats;
+	struct buffer_stats base, stats;
+	clear_buffer_stats();
+	get_buffer_stats(&base);
+	assert(!base.pool[BUFFER_POOL_DATA].hits && !base.write.count);
+	map_t *smap = new_map(plain, NULL);
+	for (block_t i = 0; i < 4; i++)
+		blockput(blockget(smap, i));
+	blockput(set_buffer_dirty(blockget(smap, 0)));
+	buffer = blockget(smap, 1);
+	set_buffer_state_list(buffer, BUFFER_DIRTY + 1, &smap->dirty);
+	blockput(buffer);
+	get_map_stats(smap, &mstats);
+	assert(mstats.hits == 2 && mstats.misses == 4 && mstats.buffers == 4);
+	assert(mstats.dirty[0] == 1 && mstats.dirty[1] == 1 && !mstats.dirty[2]);
+	get_buffer_stats(&stats);
+	assert(stats.pool[BUFFER_POOL_DATA].hits == 2);
+	assert(stats.pool[BUFFER_POOL_DATA].misses == 4);
+	assert(stats.state[BUFFER_DIRTY] == base.state[BUFFER_DIRTY] + 1);
+	assert(stats.state[BUFFER_DIRTY + 1] == base.state[BUFFER_DIRTY + 1] + 1);
+	assert(!flush_buffers(smap));
+	invalidate_buffers(smap);
+	buffer = blockget(smap, 1);
+	assert(!submit_bufio(buffer, 0, 1, &batch, 1) && !wait_iobatch(&batch));
+	blockput(buffer);
+	assert(!devio(READ, plain, 0, block, pagesize));
+	show_map_stats(smap, "stats");
+	show_buffer_stats();
+	get_buffer_stats(&stats);
+	assert(stats.state[BUFFER_DIRTY] == base.state[BUFFER_DIRTY]);
+	assert(stats.flush.buffers == 2 && stats.flush.writes == 1);
+	assert(stats.read.count == 2 && stats.write.count == 1);
+	unsigned long sum = 0;
+	for (int i = 0; i < LATENCY_BUCKETS; i++)
+		sum += stats.read.bucket[i];
+	assert(sum == stats.read.count);
+	free_map(smap);
+
+	/* readahead: sequential reads mostly hit, random reads read nothing extra */
+	for (int i = 0; i < 64; i++) {
+		memset(block, i, pagesize);
+		assert(!diskwrite(fd, block, pagesize, i * pagesize));
+	}
+	map_t *seq = new_map(plain, NULL);
+	for (block_t i = 0; i < 64; i++) {
+		buffer = blockread(seq, i);
+		assert(buffer && *(unsigned char *)bufdata(buffer) == i);
+		blockput(buffer);
+	}
+	get_map_stats(seq, &mstats);
+	show_map_stats(seq, "sequential");
+	assert(mstats.rahits == 63 && mstats.readahead >= 63);
+	assert(mstats.window > READAHEAD_MIN);
+	free_map(seq);
+	map_t *rnd = new_map(plain, NULL);
+	for (block_t i = 0; i < 32; i++) {
+		block_t where = (i * 37 + 5) % 64;
+		buffer = blockread(rnd, where);
+		assert(buffer && *(unsigned char *)bufdata(buffer) == where);
+		blockput(buffer);
+	}
+	get_map_stats(rnd, &mstats);
+	assert(!mstats.readahead && !mstats.window && mstats.buffers == 32);
+	/* readahead nobody reads shrinks the window */
+	for (block_t i = 0; i < 3; i++)
+		blockput(blockread(rnd, 32 + i));
+	get_map_stats(rnd, &mstats);
+	unsigned window = mstats.window;
+	invalidate_buffers(rnd);
+	get_map_stats(rnd, &mstats);
+	assert(mstats.rawasted);
+	blockput(blockread(rnd, 0));
+	blockput(blockread(rnd, 1));
+	get_map_stats(rnd, &mstats);
+	assert(mstats.window < 2 * window);
+	free_map(rnd);
+
+	/* a pool full of pinned buffers refuses more and counts it */
+	map_t *full = new_map(dev, NULL);
+	set_map_pool(full, BUFFER_POOL_META);
+	get_pool_stats(BUFFER_POOL_META, &before);
+	struct buffer_head **pin = malloc(before.max_buffers * sizeof(*pin));
+	for (unsigned i = 0; i < before.max_buffers; i++)
+		assert((pin[i] = blockget(full, i)));
+	assert(!blockget(full, before.max_buffers));
+	get_pool_stats(BUFFER_POOL_META, &after);
+	assert(after.exceeded == before.exceeded + 1);
+	for (unsigned i = 0; i < before.max_buffers; i++)
+		blockput(pin[i]);
+	free(pin);
+	free_map(full);
+
+	/* direct io: aligned buffers and block io, unaligned devio bounces */
+	struct dev *direct = &(struct dev){ .fd = fd, .bits = vol->bits };
+	if (direct_dev(direct)) {
+		printf("no O_DIRECT here (%s)\n", strerror(errno));
+		goto out;
+	}
+	assert(fcntl(fd, F_GETFL) & O_DIRECT);
+	map_t *dmap = new_map(direct, NULL);
+	buffer = blockget(dmap, 2);
+	assert(!((unsigned long)bufdata(buffer) % pagesize));
+	memset(bufdata(buffer), 0x77, pagesize);
+	blockput(set_buffer_dirty(buffer));
+	assert(!flush_buffers(dmap));
+	invalidate_buffers(dmap);
+	buffer = blockget(dmap, 2);
+	assert(!submit_bufio(buffer, 0, 2, &batch, 1) && !wait_iobatch(&batch));
+	assert(*(unsigned char *)bufdata(buffer) == 0x77);
+	blockput(buffer);
+	free_map(dmap);
+	char odd[100];
+	memset(odd, 0x33, sizeof(odd));
+	assert(!devio(WRITE, direct, 3 * pagesize + 10, odd, sizeof(odd)));
+	memset(odd, 0, sizeof(odd));
+	assert(!devio(READ, direct, 3 * pagesize + 9, odd, sizeof(odd)));
+	assert(odd[0] == 3 && odd[1] == 0x33 && odd[99] == 0x33);
+	assert(!devio(READ, direct, 3 * pagesize + 110, odd, 1) && odd[0] == 3);
+out:
+	close(fd);
+	unlink("buffer.img");
+	free(block);
 	exit(0);
 }
@@ -64,5 +64,50 @@ int main(int argc, char *argv[])
 		destroy_defer_bfree(&sb->derollup);
 		destroy_defer_bfree(&sb->defree);
 	}
+	if (1) { /* one byte counts as old logs have them, two for wide extents */
+		unsigned shift = sb->blockbits + 3;
+		block_t start = sb->volblocks - (1 << shift), logblock = start - 1;
+		struct buffer_head *buffer = blockget(mapping(sb->logmap), 0);
+		struct logblock *log = bufdata(buffer);
+		*log = (struct logblock){ .magic = to_be_u16(TUX3_MAGIC_LOG) };
+		unsigned char *data = log->data;
+		*data++ = LOG_BALLOC;
+		*data++ = 0x10;
+		data = encode48(data, start);
+		*data++ = LOG_BALLOC_WIDE;
+		data = encode16(data, 0x300);
+		data = encode48(data, start + 0x100);
+		*data++ = LOG_BFREE;
+		*data++ = 8;
+		data = encode48(data, start);
+		log->bytes = to_be_u16(data - log->data);
+		assert(!blockio(WRITE, buffer, logblock));
+		blockput(buffer);
+		invalidate_buffers(mapping(sb->logmap));
+		sb->logchain = logblock;
+		sb->super.logcount = to_be_u32(1);
+		assert(!replay(sb));
+
+		buffer = blockread(mapping(sb->bitmap), start >> shift);
+		assert(buffer);
+		for (unsigned i = 0; i < 0x400; i++)
+			assert(!get_bit(bufdata(buffer), i) == (i < 8 || (i >= 0x10 && i < 0x100)));
+		blockput(buffer);
+	}
+	if (1) { /* incompatible flags need their own magic */
+		struct disksuper *super = &sb->super;
+		super->flags = to_be_u64(SB_COMPACT_BNODE);
+		assert(!save_sb(sb));
+		assert(load_sb(sb) == -EINVAL);
+		memcpy(super->magic, TUX3_MAGIC_INCOMPAT, sizeof(super->magic));
+		assert(!save_sb(sb));
+		assert(!load_sb(sb));
+		super->flags = to_be_u64(SB_WIDE_DLEAF);
+		assert(!save_sb(sb));
+		assert(!load_sb(sb));
+		super->flags = to_be_u64(SB_COMPACT_BNODE | 1ULL << 63);
+		assert(!save_sb(sb));
+		assert(load_sb(sb) == -EINVAL);
+	}
 	exit(0);
 }
@@ -70,7 +70,7 @@ static void dwalk_probe_check(struct dwalk *walk, block_t index, struct diskexte
 int main(int argc, char *argv[])
 {
 	printf("--- leaf test ---\n");
-	struct sb *sb = &(struct sb){ .blocksize = 1 << 10 };
+	struct sb *sb = &(struct sb){ .blocksize = 1 << 10, .blockbits = 10 };
 	unsigned blocksize = sb->blocksize;
 	struct btree *btree = &(struct btree){ .sb = sb, .ops = &dtree_ops };
 	struct dleaf *leaf = dleaf_create(btree);
@@ -323,5 +323,36 @@ int main(int argc, char *argv[])
 		assert(nr == 5);
 		dleaf_destroy(btree, leaf1);
 	}
+	if (1) {
+		/* wide extents on a volume that wants wide leaves */
+		sb->super.flags = to_be_u64(SB_WIDE_DLEAF);
+		struct dleaf *leaf1 = dleaf_create(btree);
+		struct dwalk *walk1 = &(struct dwalk){ };
+		assert(dleaf_wide(leaf1) && dleaf_sniff(btree, leaf1));
+		assert(dtree_max_extent(sb) == 1 << (sb->blockbits + 3));
+		dwalk_probe(leaf1, blocksize, walk1, 0);
+		dwalk_add(walk1, 0, make_leaf_extent(leaf1, 0x100, MAX_WIDE_EXTENT));
+		dwalk_add(walk1, 0x20000, make_leaf_extent(leaf1, 0x20000, 0x1234));
+		dwalk_add(walk1, 0x30000, make_leaf_extent(leaf1, 0x30000, 1));
+		assert(dwalk_probe(leaf1, blocksize, walk1, 0xffff));
+		assert(dwalk_index(walk1) == 0 && dwalk_count(walk1) == MAX_WIDE_EXTENT);
+		assert(dwalk_probe(leaf1, blocksize, walk1, 0x10000));
+		assert(dwalk_index(walk1) == 0x20000 && dwalk_count(walk1) == 0x1234);
+		/* copies keep the format of their source */
+		struct dleaf *leaf2 = malloc(blocksize);
+		sb->super.flags = 0;
+		dleaf_init(btree, leaf2);
+		dwalk_copy(walk1, leaf2);
+		assert(dleaf_wide(leaf2));
+		dwalk_probe(leaf2, blocksize, walk1, 0);
+		assert(dwalk_block(walk1) == 0x20000 && dwalk_count(walk1) == 0x1234);
+		free(leaf2);
+		/* chop into the middle of a wide extent */
+		dleaf_chop(btree, 0x20100, leaf1);
+		dwalk_probe(leaf1, blocksize, walk1, 0x20000);
+		assert(dwalk_block(walk1) == 0x20000 && dwalk_count(walk1) == 0x100);
+		assert(!dwalk_next(walk1));
+		dleaf_destroy(btree, leaf1);
+	}
 	return 0;
 }
@@ -219,6 +219,141 @@ int main(int argc, char *argv[])
 		assert(segs == 1 && seg.count == INT_MAX && seg.state == SEG_HOLE);
 		sb->nextalloc = nextalloc;
 	}
+	if (1) { /* wide leaves map a large region as one extent */
+		sb->super.flags = to_be_u64(SB_WIDE_DLEAF);
+		struct inode *wide = rapid_open_inode(sb, filemap_extent_io, 0);
+		init_btree(&wide->btree, sb, no_root, &dtree_ops);
+		unsigned count = 0x400;
+		assert(count > MAX_EXTENT && count <= dtree_max_extent(sb));
+		segs = map_region(wide, 0x100, count, map, 10, 1);
+		assert(segs == 1 && map[0].count == count && map[0].state == SEG_NEW);
+		block_t block = map[0].block;
+		segs = map_region(wide, 0, 0x100 + count + 1, map, 10, 0);
+		assert(segs == 3 && map[1].block == block && map[1].count == count);
+		assert(map[0].state == SEG_HOLE && map[2].state == SEG_HOLE);
+		/* truncate inside the extent */
+		struct delete_info delinfo = { .key = 0x300, };
+		segs = tree_chop(&wide->btree, &delinfo, 0);
+		assert(!segs);
+		segs = map_region(wide, 0x100, count, map, 10, 0);
+		assert(segs == 2 && map[0].block == block && map[0].count == 0x200);
+		assert(map[1].state == SEG_HOLE);
+		/* a hole longer than a bitmap block covers is mapped up to that */
+		count = 1 << (sb->blockbits + 3);
+		segs = map_region(wide, 0x1000, 4 * count, map, 1, 1);
+		assert(segs == 1 && map[0].count == count && map[0].state == SEG_NEW);
+		delinfo = (struct delete_info){ .key = 0, };
+		segs = tree_chop(&wide->btree, &delinfo, 0);
+		assert(!segs);
+		sb->super.flags = 0;
+		sb->nextalloc = nextalloc;
+	}
+	if (1) { /* extent cache */
+		struct inode *cached = rapid_open_inode(sb, filemap_extent_io, 0);
+		init_btree(&cached->btree, sb, no_root, &dtree_ops);
+		segs = map_region(cached, 0x10, 0x10, map, 10, 1);
+		assert(segs == 1);
+		block_t block = map[0].block;
+		assert(cached->excache && cached->excache->used == 1);
+		segs = map_region(cached, 0, 0x30, map, 10, 0);
+		assert(segs == 3 && map[1].block == block);
+		assert(cached->excache->used == 3);
+		/* covered reads do not look at the btree */
+		struct root root = cached->btree.root;
+		cached->btree.root = no_root;
+		segs = map_region(cached, 0x8, 0x10, map, 10, 0);
+		assert(segs == 2 && map[0].state == SEG_HOLE && map[0].count == 8);
+		assert(map[1].block == block && map[1].count == 8);
+		/* but partly covered ones do */
+		segs = map_region(cached, 0x28, 0x10, map, 10, 0);
+		assert(segs == 1 && map[0].state == SEG_HOLE && map[0].count == 0x10);
+		cached->btree.root = root;
+		/* redirect splits the cached extent around the new one */
+		segs = map_region(cached, 0x14, 4, map, 10, 2);
+		assert(segs == 1);
+		block_t moved = map[0].block;
+		struct seg hit[10];
+		int hits = map_region(cached, 0x10, 0x10, hit, 10, 0);
+		assert(hits == 3 && hit[1].block == moved);
+		drop_extent_cache(cached);
+		segs = map_region(cached, 0x10, 0x10, map, 10, 0);
+		assert(segs == hits && !memcmp(map, hit, segs * sizeof(*map)));
+		/* runs with a gap between them do not cover what spans it */
+		drop_extent_cache(cached);
+		segs = map_region(cached, 0, 0x8, map, 10, 0);
+		segs = map_region(cached, 0x18, 0x8, map, 10, 0);
+		assert(cached->excache->used == 2);
+		hits = map_region(cached, 0x4, 0x18, hit, 10, 0);
+		drop_extent_cache(cached);
+		segs = map_region(cached, 0x4, 0x18, map, 10, 0);
+		assert(segs == hits && !memcmp(map, hit, segs * sizeof(*map)));
+		/* truncate drops it */
+		struct delete_info delinfo = { .key = 0, };
+		segs = tree_chop(&cached->btree, &delinfo, 0);
+		assert(!segs && !cached->excache);
+		segs = map_region(cached, 0x10, 0x10, map, 10, 0);
+		assert(segs == 1 && map[0].state == SEG_HOLE);
+		sb->nextalloc = nextalloc;
+	}
+	if (1) { /* map a region of many leaves into a growing seg vector */
+		struct inode *big = rapid_open_inode(sb, filemap_extent_io, 0);
+		init_btree(&big->btree, sb, no_root, &dtree_ops);
+		unsigned count = 0x1000;
+		struct segvec vec = { };
+		segs = map_segvec(big, 0, count, &vec, 1);
+		assert(segs == vec.segs && segs >= count / MAX_EXTENT);
+		assert(big->btree.root.depth > 1 || segs > 10);
+		block_t total = 0;
+		for (int i = 0; i < segs; i++) {
+			assert(vec.map[i].state == SEG_NEW);
+			assert(vec.map[i].count <= MAX_EXTENT);
+			total += vec.map[i].count;
+		}
+		assert(total == count);
+		struct segvec back = { };
+		segs = map_segvec(big, 0, count + 0x10, &back, 0);
+		assert(back.map[segs - 1].state == SEG_HOLE && back.map[segs - 1].count == 0x10);
+		/* the same blocks come back, wherever the segs break */
+		block_t *blocks = malloc(count * sizeof(*blocks)), *at = blocks;
+		for (int i = 0; i < vec.segs; i++)
+			for (unsigned j = 0; j < vec.map[i].count; j++)
+				*at++ = vec.map[i].block + j;
+		at = blocks;
+		for (int i = 0; i < segs - 1; i++)
+			for (unsigned j = 0; j < back.map[i].count; j++)
+				assert(*at++ == back.map[i].block + j);
+		assert(at == blocks + count);
+		free(blocks);
+		free(vec.map);
+		free(back.map);
+		struct delete_info delinfo = { .key = 0, };
+		segs = tree_chop(&big->btree, &delinfo, 0);
+		assert(!segs);
+		sb->nextalloc = nextalloc;
+	}
+	if (1) { /* a chunk that fails keeps the segs mapped before it */
+		struct inode *part = rapid_open_inode(sb, filemap_extent_io, 0);
+		init_btree(&part->btree, sb, no_root, &dtree_ops);
+		assert(!alloc_empty_btree(&part->btree));
+		block_t volblocks = sb->volblocks, spare, used[0x400];
+		unsigned full = 0;
+		sb->volblocks = 0x400;
+		assert(!balloc(sb, MAX_EXTENT, &spare));
+		while (!balloc(sb, 1, used + full))
+			full++;
+		assert(!bfree(sb, spare, MAX_EXTENT));
+		struct segvec vec = { };
+		segs = map_segvec(part, 0, 4 * MAX_EXTENT, &vec, 1);
+		assert(segs == 1 && vec.map[0].count == MAX_EXTENT && vec.err == -ENOSPC);
+		free(vec.map);
+		struct delete_info delinfo = { .key = 0, };
+		segs = tree_chop(&part->btree, &delinfo, 0);
+		assert(!segs);
+		for (unsigned i = 0; i < full; i++)
+			assert(!bfree(sb, used[i], 1));
+		sb->volblocks = volblocks;
+		sb->nextalloc = nextalloc;
+	}
 #if 1
 	assert(balloc_from_range(sb, 0x10, 1, 1) >= 0);
 	sb->nextalloc = 0xf;
@@ -66,7 +66,7 @@ int main(int argc, char *argv[])
 	ileaf_split(btree, 0x10, leaf, dest);
 	ileaf_dump(btree, leaf);
 	ileaf_dump(btree, dest);
-	ileaf_merge(btree, leaf, dest);
+	assert(ileaf_merge(btree, leaf, dest));
 	ileaf_dump(btree, leaf);
 	test_append(btree, leaf, 0x13, 3, 'x');
 	ileaf_dump(btree, leaf);
@@ -85,5 +85,32 @@ int main(int argc, char *argv[])
 	ileaf_dump(btree, leaf);
 	ileaf_destroy(btree, leaf);
 	ileaf_destroy(btree, dest);
+
+	/* a leaf started for bulk loading takes inums from its first one */
+	leaf = ileaf_create(btree);
+	ileaf_start(btree, 0x1000, leaf);
+	assert(!ileaf_resize(btree, 0x1000 + btree->entries_per_leaf, leaf, 1));
+	test_append(btree, leaf, 0x1000, 3, 'z');
+	assert(ibase(leaf) == 0x1000 && icount(leaf) == 1);
+	assert(ileaf_need(btree, leaf) + ileaf_free(btree, leaf) == sb->blocksize - sizeof(struct ileaf));
+
+	/* merging leaves with inums missing between them, or too far apart */
+	dest = ileaf_create(btree);
+	ileaf_start(btree, 0x1005, dest);
+	test_append(btree, dest, 0x1006, 4, 'w');
+	assert(ileaf_merge(btree, leaf, dest));
+	assert(ibase(leaf) == 0x1000 && icount(leaf) == 7);
+	assert(ileaf_lookup(btree, 0x1000, leaf, &size) && size == 3);
+	for (inum_t inum = 0x1001; inum < 0x1006; inum++)
+		assert(!ileaf_lookup(btree, inum, leaf, &size) && !size);
+	assert(!memcmp(ileaf_lookup(btree, 0x1006, leaf, &size), "wwww", 4) && size == 4);
+	ileaf_destroy(btree, dest);
+	dest = ileaf_create(btree);
+	ileaf_start(btree, 0x1000 + btree->entries_per_leaf, dest);
+	test_append(btree, dest, 0x1000 + btree->entries_per_leaf, 1, 'v');
+	assert(!ileaf_merge(btree, leaf, dest));
+	assert(icount(leaf) == 7);
+	ileaf_destroy(btree, dest);
+	ileaf_destroy(btree, leaf);
 	exit(0);
 }
@@ -0,0 +1,91 @@
+/*
+ * Block io trace
+ *
+ * Licensed under the GPL version 3
+ *
+ * By contributing changes to this file you grant the original copyright holder
+ * the right to distribute those changes under any license.
+ */
+
+#include "tux3user.h"
+#include "diskio.h"
+
+int main(int argc, char *argv[])
+{
+	if (argc < 2)
+		error("usage: %s <volname>", argv[0]);
+	char name[PATH_MAX];
+	snprintf(name, sizeof(name), "%s.trace", argv[1]);
+	int fd = open(argv[1], O_CREAT|O_TRUNC|O_RDWR, S_IRUSR|S_IWUSR);
+	assert(fd >= 0);
+	u64 volsize = 1 << 24;
+	assert(!ftruncate(fd, volsize));
+	struct dev *dev = &(struct dev){ .fd = fd, .bits = 12 };
+	init_buffers(dev, 1 << 20, 0);
+	assert(!iotrace_open(name));
+	assert(iotrace_open(name) == -EBUSY);
+
+	/* device blocks outside any inode */
+	map_t *map = new_map(dev, NULL);
+	for (block_t block = 0; block < 4; block++)
+		blockput(set_buffer_dirty(blockget(map, 1000 + block)));
+	assert(!flush_buffers(map));
+	free_map(map);
+
+	/* a filesystem, a file and a commit */
+	struct sb *sb = rapid_sb(dev,
+		.max_inodes_per_block = 64,
+		.entries_per_node = calc_entries_per_node(1 << dev->bits),
+		.volblocks = volsize >> dev->bits,
+		.freeblocks = volsize >> dev->bits);
+	sb->super = (struct disksuper){ .magic = TUX3_MAGIC, .volblocks = to_be_u64(sb->blockbits) };
+	assert(sb->volmap = tux_new_volmap(sb));
+	assert(sb->logmap = tux_new_logmap(sb));
+	assert(!make_tux3(sb));
+	struct inode *inode = tuxcreate(sb->rootdir, "foo", 3, &(struct tux_iattr){ .mode = S_IFREG | S_IRWXU });
+	assert(!IS_ERR(inode));
+	inum_t inum = inode->inum;
+	char text[1 << 14];
+	memset(text, 'x', sizeof(text));
+	struct file *file = &(struct file){ .f_inode = inode };
+	assert(tuxwrite(file, text, sizeof(text)) == sizeof(text));
+	iput(inode);
+	assert(!sync_super(sb));
+	iotrace_close();
+
+	struct iotrace_header header;
+	struct iotrace_record *records;
+	unsigned long count;
+	assert(!iotrace_load(name, &header, &records, &count));
+	assert(header.blockbits == 12 && count > 4);
+	unsigned long bytes[IOTRACE_KINDS] = {}, filebytes = 0;
+	for (unsigned long i = 0; i < count; i++) {
+		struct iotrace_record *record = records + i;
+		assert(record->kind < IOTRACE_KINDS && record->bytes);
+		if (record->write)
+			bytes[record->kind] += record->bytes;
+		if (record->inum == inum) {
+			assert(record->kind == IOTRACE_DATA);
+			filebytes += record->bytes;
+		}
+		if (record->kind == IOTRACE_SUPER)
+			assert(record->inum == IOTRACE_NOINODE);
+	}
+	/* the bare blocks go out as one transfer */
+	assert(records[0].write && records[0].kind == IOTRACE_DATA);
+	assert(records[0].offset == 1000 << 12 && records[0].bytes == 4 << 12);
+	assert(records[0].inum == IOTRACE_NOINODE);
+	assert(filebytes == sizeof(text));
+	assert(bytes[IOTRACE_ILEAF] && bytes[IOTRACE_DLEAF] && bytes[IOTRACE_BITMAP]);
+	/* the commit ends with the superblock */
+	struct iotrace_record *last = records + count - 1;
+	assert(last->write && last->kind == IOTRACE_SUPER && last->offset == SB_LOC);
+	for (int kind = 0; kind < IOTRACE_KINDS; kind++)
+		printf("%s: %lu bytes written\n", iotrace_names[kind], bytes[kind]);
+	free(records);
+
+	/* not a trace */
+	assert(iotrace_load(argv[1], &header, &records, &count) == -EINVAL);
+	unlink(name);
+	return 0;
+}
@@ -0,0 +1,119 @@
+/*
+ * Simulated block device
+ *
+ * Licensed under the GPL version 3
+ *
+ * By contributing changes to this file you grant the original copyright holder
+ * the right to distribute those changes under any license.
+ */
+
+#include "tux3user.h"
+#include "diskio.h"
+
+#define MSEC 1000000ULL
+
+static void test_config(void)
+{
+	struct simconfig config;
+	assert(!sim_config(&config, "hdd"));
+	assert(config.seek && config.depth == 1);
+	assert(!sim_config(&config, "nvme,depth=4,latency=7"));
+	assert(config.depth == 4 && config.latency == 7 && !config.seek && config.bandwidth == 3000);
+	assert(!sim_config(&config, "bandwidth=10"));
+	assert(config.bandwidth == 10 && config.depth == 1 && !config.latency);
+	assert(sim_config(&config, "floppy") == -EINVAL);
+	assert(sim_config(&config, "latency=fast") == -EINVAL);
+	assert(sim_config(&config, "rpm=5400") == -EINVAL);
+}
+
+/* synchronous io waits out the model, which charges latency, seek and transfer */
+static void test_model(void)
+{
+	unsigned size = 1 << 12, span = 1 << 20;
+	int fd = sim_ramdisk(span);
+	assert(fd >= 0);
+	struct dev *dev = &(struct dev){ .fd = fd, .bits = 12 };
+	assert(!sim_dev(dev, "latency=1000,seek=2000,bandwidth=4,depth=1"));
+	assert(sim_lookup(fd));
+	char *data = malloc(size);
+	memset(data, 0x5a, size);
+	unsigned long long start = sim_clock();
+	assert(!devio(WRITE, dev, 0, data, size));
+	assert(!devio(WRITE, dev, span / 2 + size, data, size));
+	memset(data, 0, size);
+	assert(!devio(READ, dev, span / 2 + size, data, size));
+	assert(data[0] == 0x5a && data[size - 1] == 0x5a);
+	unsigned long long took = sim_clock() - start;
+
+	/* 4096 bytes at 4 MB/s take 1024 usecs, seeking half way across 1000 */
+	struct simrecord records[4];
+	unsigned long long back = 2000 * 1000ULL * size / span;
+	assert(get_sim_records(fd, records, 4) == 3);
+	assert(records[0].done - records[0].start == 2024 * 1000);
+	assert(records[1].done - records[1].start == 3024 * 1000);
+	assert(records[2].done - records[2].start == 2024 * 1000 + back);
+	assert(!records[2].write && records[2].offset == span / 2 + size);
+	assert(took >= 7072 * 1000 + back);
+
+	struct simstats stats;
+	assert(!get_sim_stats(fd, &stats));
+	assert(stats.reads == 1 && stats.writes == 2 && stats.seeks == 2);
+	assert(stats.read_bytes == size && stats.write_bytes == 2 * size);
+	assert(stats.max_queue == 1);
+	show_sim_stats(fd);
+	sim_detach(fd);
+	assert(get_sim_stats(fd, &stats) == -ENOENT);
+	free(data);
+	close(fd);
+}
+
+/* asynchronous requests are served depth at a time and complete in order of time */
+static void test_depth(void)
+{
+	unsigned size = 1 << 12, count = 8;
+	int fd = sim_ramdisk(count * size);
+	struct dev *dev = &(struct dev){ .fd = fd, .bits = 12 };
+	assert(!sim_dev(dev, "latency=2000,depth=4"));
+	map_t *map = new_map(dev, NULL);
+	unsigned long long start = sim_clock();
+	for (block_t i = 0; i < count; i++) {
+		struct buffer_head *buffer = blockget(map, i * 3 % count);
+		memset(bufdata(buffer), i, size);
+		blockput(set_buffer_dirty(buffer));
+	}
+	set_flush_limit(size);
+	assert(!flush_buffers(map));
+	set_flush_limit(FLUSH_LIMIT);
+	unsigned long long took = sim_clock() - start;
+	assert(took >= 4 * MSEC);
+	struct simrecord records[8];
+	assert(get_sim_records(fd, records, count) == count);
+	for (int i = 0; i < 4; i++) {
+		assert(records[i + 4].start == records[i].done);
+		assert(records[i].offset == i * size);
+	}
+	struct simstats stats;
+	assert(!get_sim_stats(fd, &stats));
+	assert(stats.writes == count && stats.max_queue == count);
+	assert(stats.queued >= 4 * MSEC);
+
+	/* one vectored request when runs may be long */
+	invalidate_buffers(map);
+	for (block_t block = 0; block < count; block++)
+		blockput(set_buffer_dirty(blockget(map, block)));
+	assert(!flush_buffers(map));
+	assert(!get_sim_stats(fd, &stats));
+	assert(stats.writes == count + 1);
+	free_map(map);
+	sim_detach(fd);
+	close(fd);
+}
+
+int main(int argc, char *argv[])
+{
+	init_buffers(&(struct dev){ .bits = 12 }, 1 << 20, 0);
+	test_config();
+	test_model();
+	test_depth();
+	return 0;
+}
@@ -14,12 +14,15 @@
 
 static void usage(void)
 {
-	printf("tux3 [-s|--seek=<offset>] [-b|--blocksize=<size>] [-h|--help]\n"
+	printf("tux3 [-s|--seek=<offset>] [-b|--blocksize=<size>] [-m|--mmap] [-d|--direct]\n"
+	       "     [-p|--poolsize=<bytes>] [-S|--stats] [-D|--sim=<device>] [-c|--compact]\n"
+	       "     [-w|--wide] [-T|--trace=<file>] [-h|--help]\n"
 	       "     <command> <volume> [<file>]\n");
 	exit(1);
 }
 
-static int mkfs(int fd, const char *volname, unsigned blocksize)
+static int mkfs(int fd, const char *volname, unsigned blocksize, unsigned devflags, unsigned poolsize,
+		u64 sbflags)
 {
 	u64 volsize = 0;
 	if (fdsize64(fd, &volsize))
@@ -30,15 +33,17 @@ static int mkfs(int fd, const char *volname, unsigned blocksize)
 		if (1 << blockbits != blocksize)
 			error("blocksize must be a power of two");
 	}
-	struct dev *dev = &(struct dev){ .fd = fd, .bits = blockbits };
-	init_buffers(dev, 1 << 20, 1);
+	struct dev *dev = &(struct dev){ .fd = fd, .bits = blockbits, .flags = devflags };
+	init_buffers(dev, poolsize, 1);
 
 	struct sb *sb = rapid_sb(dev,
 		.max_inodes_per_block = 64,
 		.entries_per_node = calc_entries_per_node(blocksize),
 		.volblocks = volsize >> dev->bits,
 		.freeblocks = volsize >> dev->bits);
-	sb->super = (struct disksuper){ .magic = TUX3_MAGIC, .volblocks = to_be_u64(sb->blockbits) };
+	sb->super = (struct disksuper){ .volblocks = to_be_u64(sb->blockbits),
+		.flags = to_be_u64(sbflags) };
+	memcpy(sb->super.magic, sb_magic(sbflags), sizeof(sb->super.magic));
 
 	sb->volmap = tux_new_volmap(sb);
 	if (!sb->volmap)
@@ -57,6 +62,7 @@ static int mkfs(int fd, const char *volname, unsigned blocksize)
 		iput(sb->atable);
 		iput(sb->bitmap);
 		iput(sb->logmap);
+		release_finger(itable_btree(sb));
 		iput(sb->volmap);
 	}
 	return err;
@@ -64,18 +70,28 @@ static int mkfs(int fd, const char *volname, unsigned blocksize)
 
 int main(int argc, char *argv[])
 {
-	char *seekarg = NULL;
-	unsigned blocksize = 0;
+	char *seekarg = NULL, *simarg = NULL, *tracearg = NULL;
+	unsigned blocksize = 0, devflags = 0, poolsize = 1 << 20;
+	u64 sbflags = 0;
+	int stats = 0;
 	static struct option long_options[] = {
 		{ "seek", required_argument, NULL, 's' },
 		{ "blocksize", required_argument, NULL, 'b' },
+		{ "mmap", no_argument, NULL, 'm' },
+		{ "direct", no_argument, NULL, 'd' },
+		{ "poolsize", required_argument, NULL, 'p' },
+		{ "stats", no_argument, NULL, 'S' },
+		{ "sim", required_argument, NULL, 'D' },
+		{ "trace", required_argument, NULL, 'T' },
+		{ "compact", no_argument, NULL, 'c' },
+		{ "wide", no_argument, NULL, 'w' },
 		{ "help", no_argument, NULL, 'h' },
 		{ NULL, 0, NULL, 0 }
 	};
 
 	while (1) {
 		int c, optindex = 0;
-		c = getopt_long(argc, argv, "s:b:h", long_options, &optindex);
+		c = getopt_long(argc, argv, "s:b:mdp:SD:T:cwh", long_options, &optindex);
 		if (c == -1)
 			break;
 		switch (c) {
@@ -85,6 +101,30 @@ int main(int argc, char *argv[])
 		case 'b':
 			blocksize = strtoul(optarg, NULL, 0);
 			break;
+		case 'm':
+			devflags |= DEV_MMAP;
+			break;
+		case 'd':
+			devflags |= DEV_DIRECT;
+			break;
+		case 'p':
+			poolsize = strtoul(optarg, NULL, 0);
+			break;
+		case 'S':
+			stats = 1;
+			break;
+		case 'D':
+			simarg = optarg;
+			break;
+		case 'T':
+			tracearg = optarg;
+			break;
+		case 'c':
+			sbflags |= SB_COMPACT_BNODE;
+			break;
+		case 'w':
+			sbflags |= SB_WIDE_DLEAF;
+			break;
 		case 'h':
 		default:
 			goto usage;
@@ -100,22 +140,35 @@ int main(int argc, char *argv[])
 	int fd = open(volname, O_RDWR);
 	if (fd < 0)
 		goto eek;
+	if (simarg) {
+		struct simconfig config;
+		if ((errno = -sim_config(&config, simarg)))
+			goto eek;
+		if ((errno = -sim_attach(fd, &config)))
+			goto eek;
+	}
+	if (tracearg && (errno = -iotrace_open(tracearg)))
+		goto eek;
 
 	if (!strcmp(command, "mkfs") || !strcmp(command, "make")) {
 		if (optind != argc)
 			goto usage;
-		if ((errno = -mkfs(fd, volname, blocksize)))
+		if ((errno = -mkfs(fd, volname, blocksize, devflags, poolsize, sbflags)))
 			goto eek;
+		if (stats) {
+			show_buffer_stats();
+			show_sim_stats(fd);
+		}
 		return 0;
 	}
 
 	/* dev->bits is still unknown. Note, some structure can't use yet. */
-	struct dev *dev = &(struct dev){ .fd = fd };
+	struct dev *dev = &(struct dev){ .fd = fd, .flags = devflags };
 	struct sb *sb = rapid_sb(dev);
 	if ((errno = -load_sb(sb)))
 		goto eek;
 	dev->bits = sb->blockbits;
-	init_buffers(dev, 1 << 20, 1);
+	init_buffers(dev, poolsize, 1);
 
 	sb->volmap = tux_new_volmap(sb);
 	if (!sb->volmap) {
@@ -301,13 +354,38 @@ int main(int argc, char *argv[])
 			goto eek;
 	}
 
+	if (!strcmp(command, "compact")) {
+		printf("---- compact file and inode table ----\n");
+		struct inode *inode = tuxopen(sb->rootdir, filename, strlen(filename));
+		if (IS_ERR(inode)) {
+			errno = -PTR_ERR(inode);
+			goto eek;
+		}
+		if ((errno = -tree_compact(&tux_inode(inode)->btree)))
+			goto eek;
+		iput(inode);
+		if ((errno = -tree_compact(itable_btree(sb))))
+			goto eek;
+		if ((errno = -sync_super(sb)))
+			goto eek;
+	}
+
 	//printf("---- show state ----\n");
 	//show_buffers(sb->rootdir->map);
 	//show_buffers(sb->volmap->map);
+	if (stats) {
+		show_map_stats(sb->volmap->map, "volume");
+		show_map_stats(sb->logmap->map, "log");
+		show_map_stats(sb->bitmap->map, "bitmap");
+		show_map_stats(sb->rootdir->map, "root directory");
+		show_buffer_stats();
+		show_sim_stats(fd);
+	}
 	iput(sb->rootdir);
 	iput(sb->atable);
 	iput(sb->bitmap);
 	iput(sb->logmap);
+	release_finger(itable_btree(sb));
 	iput(sb->volmap);
 
 	return 0;
@@ -48,6 +48,7 @@
 
 static struct sb *sb;
 static struct dev *dev;
+static unsigned devflags;
 
 static struct inode *open_fuse_ino(fuse_ino_t ino)
 {
@@ -396,7 +397,7 @@ static void tux3_init(void *data, struct fuse_conn_info *conn)
 
 	dev = malloc(sizeof(*dev));
 	/* dev->bits is still unknown. Note, some structure can't use yet. */
-	*dev = (struct dev){ .fd = fd };
+	*dev = (struct dev){ .fd = fd, .flags = devflags };
 	sb = malloc(sizeof(*sb));
 	*sb = (struct sb){ INIT_SB(*sb, dev), };
 	if ((errno = -load_sb(sb)))
@@ -709,14 +710,20 @@ static struct fuse_lowlevel_ops tux3_ops = {
 
 int main(int argc, char *argv[])
 {
-	struct fuse_args args = FUSE_ARGS_INIT(argc-1, argv+1);
-
 	char *mountpoint;
 	int foreground;
 	int err = -1;
 
+	while (argc > 1 && (!strcmp(argv[1], "--mmap") || !strcmp(argv[1], "--direct"))) {
+		devflags |= !strcmp(argv[1], "--mmap") ? DEV_MMAP : DEV_DIRECT;
+		argv[1] = argv[0];
+		argc--;
+		argv++;
+	}
 	if (argc < 3)
-		error("usage: %s <volname> <mountpoint>", argv[0]);
+		error("usage: %s [--mmap] [--direct] <volname> <mountpoint>", argv[0]);
+
+	struct fuse_args args = FUSE_ARGS_INIT(argc-1, argv+1);
 
 	if (fuse_parse_cmdline(&args, &mountpoint, NULL, &foreground) != -1)
 	{
@@ -145,17 +145,30 @@ static void draw_log(struct graph_info *gi, struct sb *sb,
 		switch (code) {
 		case LOG_BALLOC:
 		case LOG_BFREE:
-		case LOG_BFREE_ON_ROLLUP: {
-			unsigned count = *data++;
+		case LOG_BFREE_ON_ROLLUP:
+		case LOG_BALLOC_WIDE:
+		case LOG_BFREE_WIDE:
+		case LOG_BFREE_ON_ROLLUP_WIDE: {
+			unsigned count;
 			u64 block;
 			char *name;
+			if (code >= LOG_BALLOC_WIDE)
+				data = decode16(data, &count);
+			else
+				count = *data++;
 			data = decode48(data, &block);
 			if (code == LOG_BALLOC)
 				name = "LOG_BALLOC";
 			else if (code == LOG_BFREE)
 				name = "LOG_BFREE";
-			else
+			else if (code == LOG_BFREE_ON_ROLLUP)
 				name = "LOG_BFREE_ON_ROLLUP";
+			else if (code == LOG_BALLOC_WIDE)
+				name = "LOG_BALLOC_WIDE";
+			else if (code == LOG_BFREE_WIDE)
+				name = "LOG_BFREE_WIDE";
+			else
+				name = "LOG_BFREE_ON_ROLLUP_WIDE";
 			fprintf(gi->f,
 				" | [%s] count %u, block %llu ",
 				name, count, (L)block);
@@ -266,20 +279,20 @@ static void draw_bnode(struct graph_info *gi, int depth, int level,
 {
 	struct bnode *bnode = bufdata(buffer);
 	block_t blocknr = buffer->index;
-	struct index_entry *index = bnode->entries;
 	int n;
 
 	fprintf(gi->f,
 		"%s_bnode_%llu [\n"
-		"label = \"{ <bnode0> [bnode] (blocknr %llu%s) | count %u |",
-		gi->bname, (L)blocknr, (L)blocknr,
+		"label = \"{ <bnode0> [%s] (blocknr %llu%s) | count %u |",
+		gi->bname, (L)blocknr,
+		bnode_compact(bnode) ? "cnode" : "bnode", (L)blocknr,
 		buffer_dirty(buffer) ? ", dirty" : "",
 		bcount(bnode));
 	for (n = 0; n < bcount(bnode); n++) {
 		fprintf(gi->f,
 			" %c <f%u> key %llu, block %lld",
 			n ? '|' : '{', n,
-			(L)from_be_u64(index[n].key), (L)from_be_u64(index[n].block));
+			(L)bnode_key(bnode, n), (L)bnode_block(bnode, n));
 	}
 	fprintf(gi->f,
 		" }}\"\n"
@@ -293,7 +306,7 @@ static void draw_bnode(struct graph_info *gi, int depth, int level,
 			fprintf(gi->f,
 				"%s_bnode_%llu:f%u -> %s_%llu:%s0;\n",
 				gi->bname, (L)blocknr, n,
-				gi->lname, (L)from_be_u64(index[n].block),
+				gi->lname, (L)bnode_block(bnode, n),
 				gi->lname);
 		}
 	} else {
@@ -301,7 +314,7 @@ static void draw_bnode(struct graph_info *gi, int depth, int level,
 			fprintf(gi->f,
 				"%s_bnode_%llu:f%u -> %s_bnode_%llu:bnode0;\n",
 				gi->bname, (L)blocknr, n,
-				gi->bname, (L)from_be_u64(index[n].block));
+				gi->bname, (L)bnode_block(bnode, n));
 		}
 	}
 }
@@ -325,18 +338,22 @@ static int draw_advance(struct graph_info *gi, struct cursor *cursor)
 			return 0;
 		level--;
 	} while (level_finished(cursor, level));
+	if (level + 1 < depth)
+		cursor->ahead = 0;
 	while (1) {
-		buffer = vol_bread(btree->sb, from_be_u64(cursor->path[level].next->block));
+		if (level + 1 == depth && cursor->prefetch)
+			prefetch_leaves(cursor, level);
+		buffer = vol_bread(btree->sb, bnode_block(cursor_node(cursor, level), cursor->path[level].next));
 		if (!buffer)
 			goto eek;
 		cursor->path[level].next++;
 		if (level + 1 == depth)
 			break;
-		level_push(cursor, buffer, ((struct bnode *)bufdata(buffer))->entries);
+		level_push(cursor, buffer, 0);
 		level++;
 		draw_bnode(gi, depth, level, buffer);
 	}
-	level_push(cursor, buffer, NULL);
+	level_push(cursor, buffer, 0);
 	return 1;
 eek:
 	release_cursor(cursor);
@@ -360,6 +377,7 @@ static void draw_btree(struct graph_info *gi, struct btree *btree, draw_leaf_t d
 	cursor = alloc_cursor(btree, 0);
 	if (!cursor)
 		error("out of memory");
+	cursor_prefetch(cursor, CURSOR_PREFETCH);
 
 	if (probe(cursor, 0))
 		error("tell me why!!!");
@@ -388,6 +406,7 @@ static void walk_dtree(struct graph_info *gi, struct btree *btree,
 {
 	struct cursor *cursor = alloc_cursor(btree, 0);
 	assert(cursor);
+	cursor_prefetch(cursor, CURSOR_PREFETCH);
 	int err = probe(cursor, 0);
 	assert(!err);
 	struct buffer_head *leafbuf;
@@ -613,11 +632,11 @@ static void draw_dleaf(struct graph_info *gi, struct btree *btree, struct buffer
 	fprintf(gi->f,
 		"%s [\n"
 		"label = \"{ <%s0> [%s] (blocknr %llu%s)"
-		" | magic 0x%04x, free %u, used %u, groups %u",
+		" | magic 0x%04x%s, free %u, used %u, groups %u",
 		dleaf_name,
 		gi->lname, gi->lname, (L)blocknr,
 		buffer_dirty(buffer) ? ", dirty" : "",
-		from_be_u16(leaf->magic), from_be_u16(leaf->free), from_be_u16(leaf->used), dleaf_groups(leaf));
+		from_be_u16(leaf->magic), dleaf_wide(leaf) ? " (wide)" : "", from_be_u16(leaf->free), from_be_u16(leaf->used), dleaf_groups(leaf));
 
 	/* draw extents */
 	for (gr = 0; gr < dleaf_groups(leaf); gr++) {
@@ -627,13 +646,14 @@ static void draw_dleaf(struct graph_info *gi, struct btree *btree, struct buffer
 			int ex, ex_count = dleaf_extent_count(entries, ent);
 			extents = dleaf_extents(leaf, groups, gr, ent);
 			for (ex = 0; ex < ex_count; ex++) {
+				fprintf(gi->f, " | <gr%uent%uex%u>", gr, ent, ex);
+				if (!dleaf_wide(leaf))
+					fprintf(gi->f, " version 0x%03x,",
+						extent_version(extents[ex]));
 				fprintf(gi->f,
-					" | <gr%uent%uex%u>"
-					" version 0x%03x, count %u, block %llu "
+					" count %u, block %llu "
 					" (extent %u)",
-					gr, ent, ex,
-					extent_version(extents[ex]),
-					extent_count(extents[ex]),
+					leaf_extent_count(leaf, extents[ex]),
 					(L)extent_block(extents[ex]),
 					ex);
 			}
@@ -905,7 +925,7 @@ static void merge_tmpfiles(struct graph_info *gi)
 
 static void usage(void)
 {
-	printf("tux3  [-h|--help] [-v|--verbose] [-b|--blocksize=<size>] <volume>\n");
+	printf("tux3  [-h|--help] [-v|--verbose] [-m|--mmap] [-d|--direct] [-b|--blocksize=<size>] <volume>\n");
 	exit(1);
 }
 
@@ -913,21 +933,30 @@ int main(int argc, char *argv[])
 {
 	static struct option long_options[] = {
 		{ "verbose", no_argument, NULL, 'v' },
+		{ "mmap", no_argument, NULL, 'm' },
+		{ "direct", no_argument, NULL, 'd' },
 		{ "help", no_argument, NULL, 'h' },
 		{ NULL, 0, NULL, 0 }
 	};
 	const char *volname = NULL;
+	unsigned devflags = 0;
 	int ret = 0;
 
 	while (1) {
 		int c, optindex = 0;
-		c = getopt_long(argc, argv, "b:vh", long_options, &optindex);
+		c = getopt_long(argc, argv, "b:vmdh", long_options, &optindex);
 		if (c == -1)
 			break;
 		switch (c) {
 		case 'v':
 			verbose++;
 			break;
+		case 'm':
+			devflags |= DEV_MMAP;
+			break;
+		case 'd':
+			devflags |= DEV_DIRECT;
+			break;
 		case 'h':
 		default:
 			goto usage;
@@ -944,7 +973,7 @@ int main(int argc, char *argv[])
 		goto eek;
 
 	/* dev->bits is still unknown. Note, some structure can't use yet. */
-	struct dev *dev = &(struct dev){ .fd = fd };
+	struct dev *dev = &(struct dev){ .fd = fd, .flags = devflags };
 	struct sb *sb = rapid_sb(dev);
 	if ((errno = -load_sb(sb)))
 		goto eek;
@@ -1002,6 +1031,7 @@ int main(int argc, char *argv[])
 	iput(sb->bitmap);
 	iput(sb->rootdir);
 	iput(sb->atable);
+	release_finger(itable_btree(sb));
 	iput(sb->volmap);
 
 out:
@@ -0,0 +1,279 @@
+/*
+ * Analyse or replay a block io trace
+ *
+ * Licensed under the GPL version 3
+ *
+ * By contributing changes to this file you grant the original copyright holder
+ * the right to distribute those changes under any license.
+ *
+ * $ TUX3_IOTRACE=volname.trace tux3 write volname file < data
+ * $ tux3trace volname.trace
+ * $ tux3trace --replay=scratch.img --sim=hdd volname.trace
+ */
+
+#include <getopt.h>
+#include "tux3user.h"
+#include "diskio.h"
+
+#define SEEK_BUCKETS 32
+
+static void usage(void)
+{
+	printf("tux3trace [-r|--replay=<volume>] [-D|--sim=<device>] [-t|--timed]\n"
+	       "          [-v|--verbose] [-h|--help] <trace>\n");
+	exit(1);
+}
+
+static const char *kind_name(unsigned kind)
+{
+	return kind < IOTRACE_KINDS ? iotrace_names[kind] : "?";
+}
+
+static void show_kinds(struct iotrace_record *records, unsigned long count)
+{
+	unsigned long transfers[2][IOTRACE_KINDS] = {}, bytes[2][IOTRACE_KINDS] = {};
+	for (unsigned long i = 0; i < count; i++) {
+		struct iotrace_record *record = records + i;
+		if (record->kind >= IOTRACE_KINDS)
+			continue;
+		transfers[record->write][record->kind]++;
+		bytes[record->write][record->kind] += record->bytes;
+	}
+	printf("%-8s %10s %12s %10s %12s\n", "kind", "reads", "bytes", "writes", "bytes");
+	for (int kind = 0; kind < IOTRACE_KINDS; kind++) {
+		if (!transfers[0][kind] && !transfers[1][kind])
+			continue;
+		printf("%-8s %10lu %12lu %10lu %12lu\n", kind_name(kind),
+		       transfers[0][kind], bytes[0][kind], transfers[1][kind], bytes[1][kind]);
+	}
+}
+
+/* log2 of the distance in blocks from the end of the transfer before */
+static unsigned seek_bucket(uint64_t from, uint64_t to, unsigned bits)
+{
+	uint64_t distance = (from > to ? from - to : to - from) >> bits;
+	unsigned bucket = distance ? 64 - __builtin_clzll(distance) : 0;
+	return bucket < SEEK_BUCKETS ? bucket : SEEK_BUCKETS - 1;
+}
+
+static void show_seeks(struct iotrace_record *records, unsigned long count, unsigned bits)
+{
+	unsigned long buckets[2][SEEK_BUCKETS] = {};
+	uint64_t head = 0;
+	unsigned top = 0;
+	for (unsigned long i = 0; i < count; i++) {
+		struct iotrace_record *record = records + i;
+		unsigned bucket = seek_bucket(head, record->offset, bits);
+		buckets[record->write][bucket]++;
+		if (bucket > top)
+			top = bucket;
+		head = record->offset + record->bytes;
+	}
+	printf("seek distance in blocks:\n");
+	printf("%-12s %10s %10s\n", "distance", "reads", "writes");
+	for (unsigned bucket = 0; bucket <= top; bucket++) {
+		char range[32];
+		if (bucket < 2)
+			snprintf(range, sizeof(range), "%u", bucket);
+		else
+			snprintf(range, sizeof(range), "<%llu", 1ULL << bucket);
+		printf("%-12s %10lu %10lu\n", range, buckets[0][bucket], buckets[1][bucket]);
+	}
+}
+
+/*
+ * A delta ends with the superblock write that commits it.  Writing a
+ * delta costs all the blocks it writes, amplification is that over the
+ * file data it carries.
+ */
+static void show_deltas(struct iotrace_record *records, unsigned long count, int verbose)
+{
+	unsigned long long delta[IOTRACE_KINDS] = {}, total[IOTRACE_KINDS] = {};
+	unsigned deltas = 0;
+	printf("write amplification per delta:\n");
+	if (verbose)
+		printf("%-6s %12s %12s %12s %12s %12s %8s\n", "delta",
+		       "data", "btree", "bitmap", "log", "super", "ampl");
+	for (unsigned long i = 0; i < count; i++) {
+		struct iotrace_record *record = records + i;
+		if (!record->write || record->kind >= IOTRACE_KINDS)
+			continue;
+		delta[record->kind] += record->bytes;
+		if (record->kind != IOTRACE_SUPER && i + 1 < count)
+			continue;
+		unsigned long long btree = delta[IOTRACE_BNODE] + delta[IOTRACE_ILEAF] + delta[IOTRACE_DLEAF];
+		unsigned long long all = 0;
+		for (int kind = 0; kind < IOTRACE_KINDS; kind++) {
+			all += delta[kind];
+			total[kind] += delta[kind];
+		}
+		if (verbose) {
+			printf("%-6u %12Lu %12Lu %12Lu %12Lu %12Lu", deltas, delta[IOTRACE_DATA], btree,
+			       delta[IOTRACE_BITMAP], delta[IOTRACE_LOG], delta[IOTRACE_SUPER]);
+			if (delta[IOTRACE_DATA])
+				printf(" %8.2f\n", (double)all / delta[IOTRACE_DATA]);
+			else
+				printf(" %8s\n", "-");
+		}
+		memset(delta, 0, sizeof(delta));
+		deltas++;
+	}
+	unsigned long long all = 0;
+	for (int kind = 0; kind < IOTRACE_KINDS; kind++)
+		all += total[kind];
+	printf("%u deltas, %Lu bytes written for %Lu bytes of data", deltas, all, total[IOTRACE_DATA]);
+	if (total[IOTRACE_DATA])
+		printf(", amplification %.2f", (double)all / total[IOTRACE_DATA]);
+	printf("\n");
+}
+
+static int cmp_block(const void *a, const void *b)
+{
+	uint64_t x = *(uint64_t *)a, y = *(uint64_t *)b;
+	return x < y ? -1 : x > y;
+}
+
+/*
+ * Reads that carry on where the last one stopped are sequential, reads
+ * within a few blocks of it are near, and blocks read more than once are
+ * what a bigger cache would have saved.
+ */
+static void show_locality(struct iotrace_record *records, unsigned long count, unsigned bits)
+{
+	unsigned long reads = 0, sequential = 0, near = 0, blocks = 0, reread = 0;
+	uint64_t head = 0, *seen = NULL;
+	for (unsigned long i = 0; i < count; i++) {
+		struct iotrace_record *record = records + i;
+		if (record->write)
+			continue;
+		uint64_t distance = record->offset > head ? record->offset - head : head - record->offset;
+		if (reads && !distance)
+			sequential++;
+		else if (reads && distance >> bits < 64)
+			near++;
+		reads++;
+		head = record->offset + record->bytes;
+		unsigned span = (record->bytes + (1 << bits) - 1) >> bits;
+		uint64_t *more = realloc(seen, (blocks + span) * sizeof(*seen));
+		if (!more)
+			error("out of memory");
+		seen = more;
+		for (unsigned j = 0; j < span; j++)
+			seen[blocks++] = (record->offset >> bits) + j;
+	}
+	printf("read locality:\n");
+	if (!reads) {
+		printf("no reads\n");
+		return;
+	}
+	qsort(seen, blocks, sizeof(*seen), cmp_block);
+	for (unsigned long i = 1; i < blocks; i++)
+		reread += seen[i] == seen[i - 1];
+	free(seen);
+	printf("%lu reads, %.1f%% sequential, %.1f%% within 64 blocks\n",
+	       reads, 100.0 * sequential / reads, 100.0 * near / reads);
+	printf("%lu blocks read, %.1f%% of them read again\n", blocks, 100.0 * reread / blocks);
+}
+
+/* Issue the same transfers again, data written is not the original data */
+static int replay_trace(struct iotrace_record *records, unsigned long count, const char *volname,
+			const char *simarg, int timed)
+{
+	int fd = open(volname, O_RDWR);
+	if (fd < 0)
+		return -errno;
+	int err = 0;
+	if (simarg) {
+		struct simconfig config;
+		if ((err = sim_config(&config, simarg)) || (err = sim_attach(fd, &config)))
+			goto out;
+	}
+	struct dev *dev = &(struct dev){ .fd = fd };
+	void *data = NULL;
+	unsigned size = 0;
+	unsigned long long start = io_clock();
+	for (unsigned long i = 0; i < count; i++) {
+		struct iotrace_record *record = records + i;
+		if (record->bytes > size) {
+			free(data);
+			size = record->bytes;
+			if (!(data = calloc(1, size))) {
+				err = -ENOMEM;
+				goto out;
+			}
+		}
+		if (timed) {
+			unsigned long long now = io_clock() - start;
+			if (record->time > now)
+				usleep((record->time - now) / 1000);
+		}
+		if ((err = devio(record->write, dev, record->offset, data, record->bytes)))
+			break;
+	}
+	free(data);
+	printf("replayed %lu transfers in %Lu us\n", count, (io_clock() - start) / 1000);
+	show_sim_stats(fd);
+out:
+	close(fd);
+	return err;
+}
+
+int main(int argc, char *argv[])
+{
+	char *volname = NULL, *simarg = NULL;
+	int timed = 0, verbose = 0;
+	static struct option long_options[] = {
+		{ "replay", required_argument, NULL, 'r' },
+		{ "sim", required_argument, NULL, 'D' },
+		{ "timed", no_argument, NULL, 't' },
+		{ "verbose", no_argument, NULL, 'v' },
+		{ "help", no_argument, NULL, 'h' },
+		{ NULL, 0, NULL, 0 }
+	};
+
+	while (1) {
+		int c, optindex = 0;
+		c = getopt_long(argc, argv, "r:D:tvh", long_options, &optindex);
+		if (c == -1)
+			break;
+		switch (c) {
+		case 'r':
+			volname = optarg;
+			break;
+		case 'D':
+			simarg = optarg;
+			break;
+		case 't':
+			timed = 1;
+			break;
+		case 'v':
+			verbose = 1;
+			break;
+		case 'h':
+		default:
+			usage();
+		}
+	}
+	if (argc - optind != 1)
+		usage();
+
+	struct iotrace_header header;
+	struct iotrace_record *records;
+	unsigned long count;
+	int err = iotrace_load(argv[optind], &header, &records, &count);
+	if (err)
+		error("unable to load trace '%s' (%s)", argv[optind], strerror(-err));
+	unsigned bits = header.blockbits;
+	printf("%lu transfers, block size %u\n", count, bits ? 1 << bits : 0);
+	if (volname) {
+		if ((err = replay_trace(records, count, volname, simarg, timed)))
+			error("replay on '%s' failed (%s)", volname, strerror(-err));
+	} else if (count) {
+		show_kinds(records, count);
+		show_seeks(records, count, bits);
+		show_deltas(records, count, verbose);
+		show_locality(records, count, bits);
+	}
+	free(records);
+	return 0;
+}
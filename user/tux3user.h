@@ -15,6 +15,8 @@
 #include <time.h>
 #include <errno.h>
 #include "buffer.h"
+#include "simdev.h"
+#include "iotrace.h"
 #include "trace.h"
 
 #include "knlcompat.h"
@@ -104,6 +106,7 @@ struct tux_iattr {
 	.i_version = 1,						\
 	.i_nlink = 1,						\
 	.i_count = ATOMIC_INIT(1),				\
+	.excache_lock = __SPIN_LOCK_UNLOCKED,			\
 	.alloc_list = LIST_HEAD_INIT((inode).alloc_list),	\
 	.list = LIST_HEAD_INIT((inode).list)
 
@@ -119,8 +122,10 @@ struct tux_iattr {
 	.commit = LIST_HEAD_INIT((sb).commit),			\
 	.pinned = LIST_HEAD_INIT((sb).pinned)
 
+/* On the heap, a compound literal would not outlive the statement expression */
 #define rapid_open_inode(sb, io, mode, init_defs...) ({		\
-	struct inode *__inode = &(struct inode){};		\
+	struct inode *__inode = malloc(sizeof(struct inode));	\
+	assert(__inode);					\
 	*__inode = (struct inode){				\
 		INIT_INODE(*__inode, sb, mode),			\
 		.btree = {					\
@@ -136,7 +141,8 @@ struct tux_iattr {
 	})
 
 #define rapid_sb(dev, init_defs...) ({				\
-	struct sb *__sb = &(struct sb){};			\
+	struct sb *__sb = malloc(sizeof(struct sb));		\
+	assert(__sb);						\
 	*__sb = (struct sb){					\
 		INIT_SB(*__sb, dev),				\
 		init_defs					\
@@ -170,6 +176,7 @@ int write_inode(struct inode *inode);
 /* utility.c */
 void stacktrace(void);
 int devio(int rw, struct dev *dev, loff_t offset, void *data, unsigned len);
+int bufferio(int rw, struct buffer_head *buffer, block_t block);
 int blockio(int rw, struct buffer_head *buffer, block_t block);
 
 /* super.c */
@@ -3,6 +3,9 @@
 
 #include "buffer.c"
 #include "diskio.c"
+#include "asyncio.c"
+#include "simdev.c"
+#include "iotrace.c"
 #include "hexdump.c"
 
 #ifndef trace
@@ -11,18 +14,71 @@
 
 #include "kernel/utility.c"
 
+/* O_DIRECT needs aligned memory, offset and length, copy through a bounce buffer */
+static int devio_bounce(int rw, struct dev *dev, loff_t offset, void *data, unsigned len)
+{
+	unsigned align = dev_align(dev);
+	loff_t start = offset & -(loff_t)align, end = (offset + len + align - 1) & -(loff_t)align;
+	void *bounce;
+	int err = -posix_memalign(&bounce, align, end - start);
+	if (err)
+		return err;
+	/* a partial write has to keep the rest of the blocks it covers */
+	if (!rw || start < offset || end > offset + len)
+		err = ioabs(dev->fd, bounce, end - start, 0, start);
+	if (!err) {
+		if (rw) {
+			memcpy(bounce + (offset - start), data, len);
+			err = ioabs(dev->fd, bounce, end - start, 1, start);
+		} else
+			memcpy(data, bounce + (offset - start), len);
+	}
+	free(bounce);
+	return err;
+}
+
+static int __devio(int rw, struct dev *dev, loff_t offset, void *data, unsigned len)
+{
+	unsigned mask = dev_align(dev) - 1;
+	unsigned long long due = 0;
+	struct simdev *sim;
+	int err;
+	if ((sim = sim_lookup(dev->fd)))
+		due = sim_schedule(sim, rw, offset, len);
+	if ((dev->flags & DEV_DIRECT) && (((unsigned long)data | offset | len) & mask))
+		err = devio_bounce(rw, dev, offset, data, len);
+	else if (!(err = ioabs(dev->fd, data, len, rw, offset)) && rw)
+		dev_written(dev, offset, len);
+	if (due)
+		sim_sleep(due);
+	return err;
+}
+
 int devio(int rw, struct dev *dev, loff_t offset, void *data, unsigned len)
 {
-	return ioabs(dev->fd, data, len, rw, offset);
+	unsigned long long start = io_clock();
+	int err = __devio(rw, dev, offset, data, len);
+	count_io(rw, start);
+	iotrace_io(rw, dev, offset, len, NULL, 0, start);
+	return err;
+}
+
+/* Transfer a buffer to or from any block, accounted to the buffer */
+int bufferio(int rw, struct buffer_head *buffer, block_t block)
+{
+	struct dev *dev = buffer->map->dev;
+	unsigned long long start = io_clock();
+	int err = __devio(rw, dev, block << dev->bits, bufdata(buffer), bufsize(buffer));
+	count_io(rw, start);
+	iotrace_io(rw, dev, block << dev->bits, 0, &buffer, 1, start);
+	return err;
 }
 
 int blockio(int rw, struct buffer_head *buffer, block_t block)
 {
 	trace("%s: buffer %p, block %Lx", rw ? "write" : "read",
 	      buffer, (L)block);
-	struct sb *sb = tux_sb(buffer_inode(buffer)->i_sb);
-	return devio(rw, sb_dev(sb), block << sb->blockbits, bufdata(buffer),
-		     sb->blocksize);
+	return bufferio(rw, buffer, block);
 }
 
 unsigned long find_next_bit(const unsigned long *addr, unsigned long size,